@@ -10,3 +10,8 @@ int bfree(struct sb *sb, block_t block, unsigned blocks)
 	trace("<- %Lx, count %x\n", (L)block, blocks);
 	return 0;
 }
+
+int stream_balloc(struct inode *inode, unsigned blocks, block_t *block)
+{
+	return balloc(inode->i_sb, blocks, block);
+}
@@ -1,4 +1,4 @@
-static struct btree_ops dtree_ops;
+static struct btree_ops dtree_ops, dtree_unindexed_ops;
 static void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btree_ops *ops)
 {
 	btree->sb = sb;
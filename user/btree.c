@@ -138,6 +138,7 @@ int uleaf_insert(struct btree *btree, struct uleaf *leaf, unsigned key, unsigned
 	return 0;
 }
 
+#ifdef build_btree
 static void tree_expand_test(struct cursor *cursor, tuxkey_t key)
 {
 	struct btree *btree = cursor->btree;
@@ -156,6 +157,14 @@ static void tree_expand_test(struct cursor *cursor, tuxkey_t key)
 	release_cursor(cursor);
 }
 
+static unsigned freed;
+
+static int bfree_counted(struct sb *sb, block_t block, unsigned blocks)
+{
+	freed += blocks;
+	return bfree(sb, block, blocks);
+}
+
 int main(int argc, char *argv[])
 {
 	struct dev *dev = &(struct dev){ .bits = 6 };
@@ -216,5 +225,49 @@ int main(int argc, char *argv[])
 	free_cursor(cursor);
 	free_cursor(cursor2);
 	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+
+	/* bulk load test: full leaves and nodes, every key found by probe */
+	struct btree_load load;
+	int keys = until_new_depth * sb->entries_per_node;
+	btree_load_begin(&load, &btree);
+	for (int key = 0; key < keys; key++) {
+		struct uentry *entry = btree_load_add(&load, key * 3, 1);
+		assert(entry);
+		*entry = (struct uentry){ .key = key * 3, .val = key };
+	}
+	assert(!btree_load_finish(&load));
+	assert(btree.root.depth == 3);
+	show_tree_range(&btree, 0, -1);
+	cursor = alloc_cursor(&btree, 0);
+	for (int key = 0; key < keys; key++) {
+		assert(!probe(&btree, key * 3, cursor));
+		struct uleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		unsigned at = uleaf_seek(&btree, key * 3, leaf);
+		assert(at < leaf->count && leaf->entries[at].val == key);
+		/* only the last leaf is short */
+		assert(key >= keys - btree.entries_per_leaf || !uleaf_free(&btree, leaf));
+		release_cursor(cursor);
+	}
+	free_cursor(cursor);
+	tree_chop(&btree, &(struct delete_info){ .key = 0 }, 0);
+
+	/* a load that fails gives back every block it took */
+	struct btree_ops counted = ops;
+	struct root root = btree.root;
+	block_t start = sb->nextalloc;
+	counted.bfree = bfree_counted;
+	btree.ops = &counted;
+	btree_load_begin(&load, &btree);
+	for (int key = 0; key < keys; key++) {
+		struct uentry *entry = btree_load_add(&load, key * 3, 1);
+		assert(entry);
+		*entry = (struct uentry){ .key = key * 3, .val = key };
+	}
+	load.err = -EIO;
+	assert(btree_load_finish(&load) == -EIO);
+	assert(freed == sb->nextalloc - start);
+	assert(btree.root.block == root.block && btree.root.depth == root.depth);
+	btree.ops = &ops;
 	exit(0);
 }
+#endif
@@ -2,3 +2,168 @@
 #include "tux3.h"
 #include "kernel/dedup.c"
 #include "hexdump.c"
+
+#ifdef build_dedup
+static unsigned hleaf_seek_linear(struct hleaf *leaf, tuxkey_t key)
+{
+	unsigned at = 0;
+	while (at < leaf->count && hentry_key(leaf->entries + at) < key)
+		at++;
+	return at;
+}
+
+static unsigned hleaf_seek_binary(struct hleaf *leaf, tuxkey_t key)
+{
+	unsigned lo = 0, hi = leaf->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (hentry_key(leaf->entries + mid) < key)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static u64 random_key(void)
+{
+	return (u64)random() << 33 ^ (u64)random() << 11 ^ random();
+}
+
+static int compare_keys(const void *a, const void *b)
+{
+	tuxkey_t x = hentry_key((void *)a), y = hentry_key((void *)b);
+	return x < y ? -1 : x > y;
+}
+
+static double nanoseconds(struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) * 1e9 + (now.tv_nsec - start->tv_nsec);
+}
+
+/*
+ * Check the hleaf and index node searches against plain scans, and time
+ * each strategy per lookup as a leaf fills with fingerprint keys.
+ */
+int main(int argc, char *argv[])
+{
+	struct dev *dev = &(struct dev){ .bits = 12 };
+	struct sb *sb = &(struct sb){ INIT_SB(dev), };
+	struct btree *btree = &(struct btree){ .sb = sb };
+	enum { lookups = 1 << 16 };
+	static tuxkey_t probes[lookups];
+	hleaf_btree_init(btree);
+	struct hleaf *leaf = malloc(sb->blocksize);
+	struct bnode *node = malloc(sb->blocksize);
+	unsigned max = btree->entries_per_leaf;
+	srandom(1);
+	for (int i = 0; i < lookups; i++)
+		probes[i] = random_key();
+
+	printf("%6s %10s %10s %10s %10s %10s\n", "keys", "linear", "binary", "interp", "node bin", "node int");
+	for (unsigned count = 8; count <= max; count = count * 2 > max && count < max ? max : count * 2) {
+		hleaf_init(btree, leaf);
+		for (unsigned i = 0; i < count; i++)
+			leaf->entries[i] = make_hentry(random_key(), 0, 1, 0);
+		qsort(leaf->entries, count, sizeof(*leaf->entries), compare_keys);
+		leaf->count = count;
+		node->count = to_be_u32(count);
+		for (unsigned i = 0; i < count; i++)
+			node->entries[i].key = leaf->entries[i].key;
+		for (int i = 0; i < lookups; i++) {
+			tuxkey_t key = i & 1 ? probes[i] : hentry_key(leaf->entries + i % count);
+			unsigned at = hleaf_seek_linear(leaf, key);
+			assert(hleaf_seek(btree, key, leaf) == at);
+			assert(hleaf_seek_binary(leaf, key) == at);
+			struct index_entry *next = node->entries + 1;
+			while (next < node->entries + count && from_be_u64(next->key) <= key)
+				next++;
+			assert(bnode_binary_search(node, key) == next);
+			assert(bnode_interpolation_search(node, key) == next);
+		}
+
+		double ns[5];
+		unsigned sum = 0;
+		struct timespec start;
+		for (int way = 0; way < 5; way++) {
+			clock_gettime(CLOCK_MONOTONIC, &start);
+			for (int i = 0; i < lookups; i++) {
+				switch (way) {
+				case 0: sum += hleaf_seek_linear(leaf, probes[i]); break;
+				case 1: sum += hleaf_seek_binary(leaf, probes[i]); break;
+				case 2: sum += hleaf_seek(btree, probes[i], leaf); break;
+				case 3: sum += bnode_binary_search(node, probes[i]) - node->entries; break;
+				case 4: sum += bnode_interpolation_search(node, probes[i]) - node->entries; break;
+				}
+			}
+			ns[way] = nanoseconds(&start) / lookups;
+		}
+		printf("%6u %9.1fns %9.1fns %9.1fns %9.1fns %9.1fns\n", count, ns[0], ns[1], ns[2], ns[3], ns[4]);
+		assert(sum);
+		if (count == max)
+			break;
+	}
+
+	/* tagged leaves: fingerprints sharing a key get one entry each */
+	sb->flags |= SB_TAGGED_INDEX;
+	hleaf_init(btree, leaf);
+	unsigned char hash[4][FINGERPRINT_SIZE] = { };
+	for (int i = 0; i < 4; i++) {
+		hash[i][7] = i < 3 ? 5 : 9;
+		hash[i][11] = i;
+	}
+	for (int i = 0; i < 4; i++) {
+		u64 key = fingerprint_key(hash[i]);
+		assert(!hleaf_find(btree, leaf, key, hash[i]));
+		struct hleaf_entry *entry = hleaf_resize(btree, key, leaf, 1);
+		*entry = make_hentry(key, fingerprint_tag(hash[i]), i + 1, i);
+	}
+	assert(leaf->count == 4);
+	for (int i = 0; i < 4; i++)
+		assert(hentry_bucket(hleaf_find(btree, leaf, fingerprint_key(hash[i]), hash[i])) == i + 1);
+	/* the split goes around the run of equal keys */
+	struct hleaf *into = malloc(sb->blocksize);
+	assert(hleaf_split(btree, 0, leaf, into) == 9);
+	assert(leaf->count == 3 && into->count == 1);
+	/* a single entry stays where it is */
+	assert(hleaf_split(btree, 0, into, leaf) == 0);
+	assert(into->count == 1 && leaf->count == 0);
+	free(into);
+
+	/* packed entries: 48 bit blocks, the collision slot survives */
+	assert(sizeof(struct hleaf_entry) == 20 && sizeof(struct bucket_entry) == 28);
+	struct hleaf_entry hentry = make_hentry(-1ULL, 0xdeadbeef, (1ULL << 48) - 1, -1);
+	assert(hentry_key(&hentry) == -1ULL && hentry_tag(&hentry) == 0xdeadbeef);
+	assert(hentry_bucket(&hentry) == (1ULL << 48) - 1 && hentry_slot(&hentry) == -1);
+	hentry_point(&hentry, 0x123456789aLL, 0xfffe);
+	assert(hentry_bucket(&hentry) == 0x123456789aLL && hentry_slot(&hentry) == 0xfffe);
+	struct bucket_entry bentry;
+	bentry_set(&bentry, hash[3], 0xabcdef012345LL, 77);
+	assert(bentry_block(&bentry) == 0xabcdef012345LL && bentry_slot(&bentry) == 77);
+	assert(!memcmp(bentry.sha_hash, hash[3], FINGERPRINT_SIZE));
+
+	/* the weak engine is xxHash64, its hash is the key as it is */
+	unsigned char weak[FINGERPRINT_SIZE];
+	fingerprint_engines[FINGERPRINT_XXH64].hash("", 0, weak);
+	assert(fingerprint_key(weak) == 0xef46db3751d8e999ULL && !fingerprint_tag(weak));
+	fingerprint_engines[FINGERPRINT_XXH64].hash("abc", 3, weak);
+	assert(fingerprint_key(weak) == 0x44bc2cf5ad770999ULL);
+	/* time each engine per block */
+	char *block = malloc(sb->blocksize);
+	for (unsigned i = 0; i < sb->blocksize; i++)
+		block[i] = random();
+	for (int engine = 0; engine < FINGERPRINT_ENGINES; engine++) {
+		struct timespec start;
+		clock_gettime(CLOCK_MONOTONIC, &start);
+		for (int i = 0; i < 1 << 12; i++)
+			fingerprint_engines[engine].hash(block, sb->blocksize, weak);
+		printf("%-8s %9.1fns per block\n", fingerprint_engines[engine].name, nanoseconds(&start) / (1 << 12));
+	}
+	free(block);
+	free(leaf);
+	free(node);
+	return 0;
+}
+#endif
@@ -0,0 +1,317 @@
+/*
+ * Tux3 dedup workload generator and benchmark
+ *
+ * Licensed under the GPL version 3
+ *
+ * By contributing changes to this file you grant the original copyright holder
+ * the right to distribute those changes under any license.
+ */
+
+#include "inode.c"
+#include <popt.h>
+
+void change_begin(struct sb *sb) { }
+void change_end(struct sb *sb) { }
+
+/*
+ * Workload model
+ *
+ * A run is a series of backup generations of the same set of files.  Every
+ * file is written as runs of blocks whose length averages the locality
+ * setting, and each run is either duplicate or new data as the duplicate
+ * ratio decides.  In the first generation a duplicate run copies blocks
+ * from anywhere earlier in the generation; in later ones it copies the same
+ * place in the previous generation of the file, which is what an unchanged
+ * stretch of a backed up file looks like.  File sizes are drawn evenly
+ * from a range, once, and kept for every generation.
+ *
+ * Block contents are made from 64 bit ids so that only the ids need to be
+ * remembered between generations, and the same id always makes the same
+ * block.
+ */
+
+struct workload {
+	unsigned dupratio, runlength;	/* percent of runs duplicated, average run */
+	unsigned minblocks, maxblocks;	/* range of file sizes */
+};
+
+struct corpus {
+	u64 **ids;		/* block ids of each file, previous generation */
+	unsigned *blocks;	/* size of each file in blocks */
+	u64 nextid;
+};
+
+static u64 splitmix(u64 *state)
+{
+	u64 z = (*state += 0x9e3779b97f4a7c15ULL);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+	return z ^ (z >> 31);
+}
+
+static unsigned random_below(u64 *state, unsigned limit)
+{
+	return limit ? splitmix(state) % limit : 0;
+}
+
+static void make_block(u64 id, void *data, unsigned size)
+{
+	u64 state = id, *word = data;
+	for (unsigned i = 0; i < size / sizeof(*word); i++)
+		word[i] = splitmix(&state);
+}
+
+static double now(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+/* Block ids of one file of one generation */
+static void make_ids(struct workload *work, struct corpus *corpus, unsigned file, int first, u64 *state, u64 *ids)
+{
+	unsigned blocks = corpus->blocks[file], run = 0, dup = 0, from = 0, limit = 0;
+	u64 *source = NULL;
+	for (unsigned i = 0; i < blocks; i++, run--) {
+		if (!run) {
+			run = 1 + random_below(state, 2 * work->runlength - 1);
+			dup = random_below(state, 100) < work->dupratio;
+			if (dup && first) {
+				/* an earlier file of this generation, or earlier in this one */
+				unsigned other = random_below(state, file + 1);
+				source = other == file ? ids : corpus->ids[other];
+				limit = other == file ? i : corpus->blocks[other];
+				from = random_below(state, limit);
+			}
+		}
+		if (dup && !first)
+			ids[i] = corpus->ids[file][i];
+		else if (dup && from < limit)
+			ids[i] = source[from++];
+		else
+			ids[i] = ++corpus->nextid;
+	}
+}
+
+struct tally {
+	u64 blocks, plain;
+	u64 count[DEDUP_COUNTERS];
+	double seconds;
+};
+
+static void report(FILE *out, const char *what, struct sb *sb, struct tally *was, struct tally *now)
+{
+	double seconds = now->seconds - was->seconds, blocks = now->blocks - was->blocks;
+	double hashed = blocks - (now->count[DEDUP_ZERO] - was->count[DEDUP_ZERO]) - (now->plain - was->plain);
+	u64 *count = now->count, *before = was->count;
+	if (!blocks || !seconds)
+		return;
+	fprintf(out, "%-6s %8.1f MB/s %10.0f hashed/s %6.3f probes/block %6.3f bucket reads/block %5.1f%% saved, %Lu of %Lu blocks used\n",
+		what, blocks * sb->blocksize / seconds / (1 << 20), hashed / seconds,
+		(count[DEDUP_HTREE_PROBES] - before[DEDUP_HTREE_PROBES]) / blocks,
+		(count[DEDUP_BUCKET_READS] - before[DEDUP_BUCKET_READS]) / blocks,
+		100.0 * (count[DEDUP_SAVED] - before[DEDUP_SAVED]) / blocks,
+		(L)(sb->volblocks - sb->freeblocks), (L)sb->volblocks);
+}
+
+static void take_tally(struct sb *sb, struct tally *tally, u64 blocks, double start)
+{
+	tally->blocks = blocks;
+	tally->plain = sb->plainblocks;
+	memcpy(tally->count, sb->dedupstat.count, sizeof(tally->count));
+	tally->seconds = now() - start;
+}
+
+/* Jumps a restore of a file makes between its extents, the first included */
+static unsigned restore_seeks(struct inode *inode, unsigned blocks)
+{
+	struct seg map[2 * MAX_EXTENT];
+	block_t next = -1;
+	unsigned seeks = 0;
+	for (unsigned at = 0; at < blocks;) {
+		int segs = map_region(inode, at, min(blocks - at, (unsigned)MAX_EXTENT), map, ARRAY_SIZE(map), 0);
+		if (segs <= 0)
+			break;
+		for (int i = 0; i < segs; at += map[i++].count) {
+			if (map[i].state == SEG_HOLE)
+				continue;
+			seeks += map[i].block != next;
+			next = map[i].block + map[i].count;
+		}
+	}
+	return seeks;
+}
+
+#define SYNC_BLOCKS 256 /* flush a file this often, the buffer pool is fixed */
+
+int main(int argc, const char *argv[])
+{
+	poptContext popt;
+	unsigned volsize = 1024, cachesize = 64, hashers = 0, minsize = 1024, maxsize = 8192;
+	unsigned files = 10, generations = 5, dupratio = 50, runlength = 64, seed = 1;
+	int bloom = 8, verbose = 0;
+	char *index = NULL, *dedup = NULL, *fingerprint = NULL;
+	struct poptOption options[] = {
+		{ "size", 's', POPT_ARG_INT, &volsize, 0, "volume size in MB (default 1024)", "<MB>" },
+		{ "files", 'n', POPT_ARG_INT, &files, 0, "files per generation (default 10)", "<count>" },
+		{ "min", 0, POPT_ARG_INT, &minsize, 0, "smallest file in KB (default 1024)", "<KB>" },
+		{ "max", 0, POPT_ARG_INT, &maxsize, 0, "largest file in KB (default 8192)", "<KB>" },
+		{ "generations", 'g', POPT_ARG_INT, &generations, 0, "backup generations (default 5)", "<count>" },
+		{ "dup", 'd', POPT_ARG_INT, &dupratio, 0, "percent of runs that are duplicates (default 50)", "<percent>" },
+		{ "run", 'r', POPT_ARG_INT, &runlength, 0, "average run length in blocks (default 64)", "<blocks>" },
+		{ "seed", 0, POPT_ARG_INT, &seed, 0, "random seed (default 1)", "<seed>" },
+		{ "bloom", 0, POPT_ARG_INT, &bloom, 0, "fingerprint filter bits per volume block (default 8)", "<bits>" },
+		{ "index", 0, POPT_ARG_STRING, &index, 0, "fingerprint index (htree, log)", "<kind>" },
+		{ "fingerprint", 'f', POPT_ARG_STRING, &fingerprint, 0, "fingerprint engine (sha1, sha256, blake2s, xxh64)", "<name>" },
+		{ "dedup", 0, POPT_ARG_STRING, &dedup, 0, "dedup mode (inline, offline, off)", "<mode>" },
+		{ "hashers", 'j', POPT_ARG_INT, &hashers, 0, "fingerprint worker threads (default one per cpu)", "<count>" },
+		{ "cache", 'c', POPT_ARG_INT, &cachesize, 0, "buffer cache in MB (default 64)", "<MB>" },
+		{ "verbose", 'v', POPT_ARG_NONE, &verbose, 0, "keep filesystem tracing", NULL },
+		POPT_AUTOHELP
+		{ NULL, 0, 0, NULL, 0 }};
+
+	popt = poptGetContext(NULL, argc, argv, options, 0);
+	poptSetOtherOptionHelp(popt, "<volume>");
+	int c;
+	while ((c = poptGetNextOpt(popt)) >= 0)
+		;
+	if (c < -1) {
+		fprintf(stderr, "%s: %s\n", poptBadOption(popt, POPT_BADOPTION_NOALIAS), poptStrerror(c));
+		exit(1);
+	}
+	const char *volname = poptGetArg(popt);
+	if (!volname || poptPeekArg(popt) || !files || !runlength || dupratio > 100 || minsize > maxsize ||
+	    (index && strcmp(index, "htree") && strcmp(index, "log")) || (dedup && dedup_mode(dedup) < 0) ||
+	    (fingerprint && fingerprint_engine(fingerprint) < 0)) {
+		poptPrintUsage(popt, stderr, 0);
+		exit(1);
+	}
+	poptFreeContext(popt);
+
+	/* the filesystem traces to stdout, keep the report apart */
+	FILE *out = stderr;
+	if (!verbose && !freopen("/dev/null", "w", stdout))
+		error("unable to silence tracing (%s)", strerror(errno));
+
+	fd_t fd = open(volname, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
+	if (fd < 0 || ftruncate(fd, (loff_t)volsize << 20))
+		error("unable to make volume '%s' (%s)", volname, strerror(errno));
+	struct dev *dev = &(struct dev){ .fd = fd, .bits = 12 };
+	init_buffers(dev, cachesize << 20, 0);
+	struct sb *sb = &(struct sb){
+		INIT_SB(dev),
+		.max_inodes_per_block = 64,
+		.entries_per_node = 20,
+		.volblocks = ((loff_t)volsize << 20) >> dev->bits,
+		.freeblocks = ((loff_t)volsize << 20) >> dev->bits,
+	};
+	for (sb->bloombits = 0; bloom > 0 && (1ULL << sb->bloombits) < (u64)sb->volblocks * bloom; sb->bloombits++)
+		;
+	if (index && !strcmp(index, "log"))
+		sb->flags |= SB_LOG_INDEX;
+	if (dedup)
+		sb->flags |= dedup_mode(dedup);
+	if (fingerprint)
+		sb->fingerprint = fingerprint_engine(fingerprint);
+	sb->volmap = rapid_open_inode(sb, NULL, 0);
+	sb->logmap = rapid_open_inode(sb, NULL, 0);
+	if ((errno = -make_tux3(sb)))
+		goto eek;
+	sb->hashpool = new_hashpool(hashers ? hashers : sysconf(_SC_NPROCESSORS_ONLN));
+
+	struct workload work = {
+		.dupratio = dupratio, .runlength = runlength,
+		.minblocks = (minsize << 10) >> sb->blockbits,
+		.maxblocks = (maxsize << 10) >> sb->blockbits,
+	};
+	u64 state = seed;
+	struct corpus corpus = {
+		.ids = calloc(files, sizeof(*corpus.ids)),
+		.blocks = calloc(files, sizeof(*corpus.blocks)),
+	};
+	char *data = malloc(sb->blocksize);
+	if (!corpus.ids || !corpus.blocks || !data)
+		goto nomem;
+	for (unsigned i = 0; i < files; i++) {
+		corpus.blocks[i] = work.minblocks + random_below(&state, work.maxblocks - work.minblocks + 1);
+		if (!corpus.blocks[i])
+			corpus.blocks[i] = 1;
+	}
+
+	fprintf(out, "%u files of %u to %u KB, %u generations, %u%% duplicate runs of %u blocks, %s fingerprints\n",
+		files, minsize, maxsize, generations, dupratio, runlength, fingerprint_engines[sb->fingerprint].name);
+	double start = now();
+	struct tally first = { }, last = { }, this;
+	u64 written = 0;
+	for (unsigned gen = 0; gen < generations; gen++) {
+		for (unsigned i = 0; i < files; i++) {
+			char name[32];
+			int len = snprintf(name, sizeof(name), "gen%u.file%u", gen, i);
+			struct inode *inode = tuxcreate(sb->rootdir, name, len, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
+			if (!inode) {
+				errno = EEXIST;
+				goto eek;
+			}
+			struct file *file = &(struct file){ .f_inode = inode };
+			u64 *ids = malloc(corpus.blocks[i] * sizeof(u64));
+			if (!ids)
+				goto nomem;
+			make_ids(&work, &corpus, i, !gen, &state, ids);
+			for (unsigned j = 0; j < corpus.blocks[i]; j++) {
+				make_block(ids[j], data, sb->blocksize);
+				if ((errno = -tuxwrite(file, data, sb->blocksize)) > 0)
+					goto eek;
+				if ((j + 1) % SYNC_BLOCKS == 0 && (errno = -tuxsync(inode)))
+					goto eek;
+			}
+			tuxclose(inode);
+			free(corpus.ids[i]);
+			corpus.ids[i] = ids;
+			written += corpus.blocks[i];
+		}
+		if (sb->flags & SB_DEDUP_OFFLINE) {
+			double began = now();
+			int blocks = dedupd(sb, 0, 0);
+			if ((errno = -blocks) > 0)
+				goto eek;
+			fprintf(out, "dedupd %8.1f MB/s, %i blocks\n", (double)blocks * sb->blocksize / (now() - began) / (1 << 20), blocks);
+		}
+		if ((errno = -sync_super(sb)))
+			goto eek;
+		take_tally(sb, &this, written, start);
+		char what[16];
+		snprintf(what, sizeof(what), "gen %u", gen);
+		report(out, what, sb, &last, &this);
+		last = this;
+		/* how close to sequential a restore of this generation reads */
+		u64 seeks = 0, blocks = 0;
+		for (unsigned i = 0; i < files; i++) {
+			char name[32];
+			int len = snprintf(name, sizeof(name), "gen%u.file%u", gen, i);
+			struct inode *inode = tuxopen(sb->rootdir, name, len);
+			if (!inode) {
+				errno = ENOENT;
+				goto eek;
+			}
+			seeks += restore_seeks(inode, corpus.blocks[i]);
+			blocks += corpus.blocks[i];
+			tuxclose(inode);
+		}
+		fprintf(out, "%-6s %8.1f seeks/MB to restore\n", what, seeks / ((double)blocks * sb->blocksize / (1 << 20)));
+	}
+	report(out, "total", sb, &first, &last);
+	fprintf(out, "%.1f MB written, %.1f MB used\n",
+		(double)written * sb->blocksize / (1 << 20),
+		(double)(sb->volblocks - sb->freeblocks) * sb->blocksize / (1 << 20));
+	char stats[1 << 12];
+	dedupstat_show(sb, stats, sizeof(stats));
+	fprintf(out, "%s", stats);
+	free_hashpool(sb->hashpool);
+	return 0;
+nomem:
+	errno = ENOMEM;
+eek:
+	fprintf(stderr, "%s!\n", strerror(errno));
+	exit(1);
+}
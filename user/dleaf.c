@@ -17,6 +17,12 @@
 
 #include "balloc-dummy.c"
 
+/* no dedup index here, every block has just the one reference */
+int dedup_free(struct sb *sb, block_t block, unsigned blocks)
+{
+	return bfree(sb, block, blocks);
+}
+
 #undef MAX_GROUP_ENTRIES
 #define MAX_GROUP_ENTRIES 7
 #include "kernel/dleaf.c"
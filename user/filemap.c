@@ -97,29 +97,26 @@ int filemap_extent_io(struct buffer_head *buffer, int write)
 			buffer = blockget(mapping(inode), index + j);
 			trace("block 0x%Lx => %Lx", (L)bufindex(buffer), (L)block);
 			if (write) {
-				if (map[i].state != SEG_DUP) /* DREAMZ */
+				if (hole)
+					trace("zero block left as a hole");
+				else if (map[i].state != SEG_DUP) { /* DREAMZ */
+					readcache_forget(sb, block);
 					err = diskwrite(dev->fd, bufdata(buffer), sb->blocksize, block << dev->bits);
-				else
+					if (!err)
+						crc_record(sb, block, bufdata(buffer));
+				} else
 					warn("Duplicate block not written");					
 			}else {
 				if (hole)
 					memset(bufdata(buffer), 0, sb->blocksize);
+				else if (!readcache_read(sb, block, bufdata(buffer)))
+					trace("block %Lx from the read cache", (L)block);
 				else{
 					err = diskread(dev->fd, bufdata(buffer), sb->blocksize, block << dev->bits);
-					if(sb->readcheck == 1){
-						unsigned char *hash;
-						block_t blk;
-						struct buffer_head* buffer;
-						if( inode->inum > 4 && inode->inum != 10 && inode->inum != 13) {
-							buffer = (blockget(mapping(inode),start)); /* DREAMZ */
-							hash = (unsigned char *)malloc(sizeof(unsigned char) * SHA_DIGEST_LENGTH);
-							hash = SHA1(bufdata(buffer),inode->i_sb->blocksize,hash); 
-							brelse(buffer);
-							blk = hash_lookup(inode, hash);
-							if(blk != block)
-								return -EIO;
-						}
-					}
+					if (!err && sb->readcheck)
+						err = crc_verify(sb, block, bufdata(buffer));
+					if (!err)
+						readcache_insert(sb, block, bufdata(buffer));
 				}
 			}
 			brelse(set_buffer_clean(buffer)); // leave empty if error ???
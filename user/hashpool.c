@@ -0,0 +1,154 @@
+#include <stdlib.h>
+#include <errno.h>
+#include <pthread.h>
+#include "hashpool.h"
+#include "trace.h"
+
+/*
+ * Fingerprint worker pool
+ *
+ * Hashing a block needs nothing but the block data, so a batch of dirty
+ * blocks can be fingerprinted on several threads while the index lookups
+ * and extent packing that follow stay serialized in the caller.  A batch is
+ * a job function plus a count: each thread takes the next unclaimed index
+ * until the batch is used up.  The submitting thread takes a share of the
+ * batch itself and returns only when every index has been done, so the
+ * caller can hand in pointers to its own stack.
+ *
+ * A NULL pool runs the batch inline, which is what the tests and the
+ * command line tools get unless they ask for workers.
+ */
+
+struct hashpool {
+	pthread_mutex_t lock;
+	pthread_cond_t wake, done;
+	hashjob_t *job;
+	void *info;
+	unsigned next, count, finished, batch;
+	int stop;
+	unsigned workers;
+	pthread_t threads[];
+};
+
+/* call with pool->lock held, returns with it held */
+static void hashpool_take(struct hashpool *pool)
+{
+	while (pool->next < pool->count) {
+		unsigned index = pool->next++;
+		pthread_mutex_unlock(&pool->lock);
+		pool->job(pool->info, index);
+		pthread_mutex_lock(&pool->lock);
+		if (++pool->finished == pool->count)
+			pthread_cond_signal(&pool->done);
+	}
+}
+
+static void *hashpool_worker(void *data)
+{
+	struct hashpool *pool = data;
+	unsigned batch = 0;
+	pthread_mutex_lock(&pool->lock);
+	while (1) {
+		while (!pool->stop && pool->batch == batch)
+			pthread_cond_wait(&pool->wake, &pool->lock);
+		if (pool->stop)
+			break;
+		batch = pool->batch;
+		hashpool_take(pool);
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return NULL;
+}
+
+struct hashpool *new_hashpool(unsigned workers)
+{
+	if (workers < 2)
+		return NULL;
+	struct hashpool *pool = malloc(sizeof(*pool) + workers * sizeof(pthread_t));
+	if (!pool)
+		return NULL;
+	*pool = (struct hashpool){
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.wake = PTHREAD_COND_INITIALIZER,
+		.done = PTHREAD_COND_INITIALIZER,
+	};
+	/* the submitter is one of the workers */
+	for (; pool->workers < workers - 1; pool->workers++) {
+		int err = pthread_create(pool->threads + pool->workers, NULL, hashpool_worker, pool);
+		if (err) {
+			warn("only started %u of %u workers (%s)", pool->workers, workers - 1, strerror(err));
+			break;
+		}
+	}
+	if (!pool->workers) {
+		free(pool);
+		return NULL;
+	}
+	return pool;
+}
+
+void free_hashpool(struct hashpool *pool)
+{
+	if (!pool)
+		return;
+	pthread_mutex_lock(&pool->lock);
+	pool->stop = 1;
+	pthread_cond_broadcast(&pool->wake);
+	pthread_mutex_unlock(&pool->lock);
+	for (unsigned i = 0; i < pool->workers; i++)
+		pthread_join(pool->threads[i], NULL);
+	free(pool);
+}
+
+unsigned hashpool_workers(struct hashpool *pool)
+{
+	return pool ? pool->workers + 1 : 1;
+}
+
+void hashpool_run(struct hashpool *pool, hashjob_t *job, void *info, unsigned count)
+{
+	if (!pool || count < 2) {
+		for (unsigned i = 0; i < count; i++)
+			job(info, i);
+		return;
+	}
+	pthread_mutex_lock(&pool->lock);
+	pool->job = job;
+	pool->info = info;
+	pool->count = count;
+	pool->next = pool->finished = 0;
+	pool->batch++;
+	pthread_cond_broadcast(&pool->wake);
+	hashpool_take(pool);
+	while (pool->finished < pool->count)
+		pthread_cond_wait(&pool->done, &pool->lock);
+	pthread_mutex_unlock(&pool->lock);
+}
+
+#ifdef build_hashpool
+static void square(void *info, unsigned index)
+{
+	unsigned *vec = info;
+	vec[index] = vec[index] * vec[index];
+}
+
+int main(int argc, char *argv[])
+{
+	struct hashpool *pool = new_hashpool(4);
+	assert(hashpool_workers(pool) == 4);
+	unsigned vec[1000];
+	for (int pass = 0; pass < 100; pass++) {
+		unsigned count = pass * 10 + 1;
+		for (unsigned i = 0; i < count; i++)
+			vec[i] = i;
+		hashpool_run(pool, square, vec, count);
+		for (unsigned i = 0; i < count; i++)
+			assert(vec[i] == i * i);
+	}
+	free_hashpool(pool);
+	assert(!new_hashpool(1));
+	hashpool_run(NULL, square, vec, 3);
+	assert(vec[2] == 16);
+	return 0;
+}
+#endif
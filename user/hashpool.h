@@ -0,0 +1,12 @@
+#ifndef HASHPOOL_H
+#define HASHPOOL_H
+
+struct hashpool;
+
+typedef void (hashjob_t)(void *info, unsigned index);
+
+struct hashpool *new_hashpool(unsigned workers);
+void free_hashpool(struct hashpool *pool);
+unsigned hashpool_workers(struct hashpool *pool);
+void hashpool_run(struct hashpool *pool, hashjob_t *job, void *info, unsigned count);
+#endif
@@ -37,6 +37,7 @@ error:
 void free_inode(struct inode *inode)
 {
 	assert(mapping(inode)); /* some inodes are not malloced */
+	evict_buffers(mapping(inode)); /* cached buffers would outlive the map */
 	free_map(mapping(inode)); // invalidate dirty buffers!!!
 	if (inode->xcache)
 		free(inode->xcache);
@@ -185,16 +186,215 @@ void tuxclose(struct inode *inode)
 	free_inode(inode);
 }
 
+/* Feed the data extents of an inode to an index rebuild, in file order */
+static int index_build_inode(struct inode *inode, struct index_build *build)
+{
+	struct sb *sb = inode->i_sb;
+	struct btree *btree = &inode->btree;
+	int err;
+	if (!btree->root.depth)
+		return 0;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -ENOMEM;
+	down_read(&btree->lock);
+	if ((err = probe(btree, 0, cursor)))
+		goto out;
+	do {
+		struct dwalk walk;
+		dwalk_probe(bufdata(cursor_leafbuf(cursor)), sb->blocksize, &walk, 0);
+		for (; !dwalk_end(&walk); dwalk_next(&walk)) {
+			if ((err = index_build_extent(sb, build, dwalk_block(&walk), dwalk_count(&walk)))) {
+				release_cursor(cursor);
+				goto out;
+			}
+		}
+	} while ((err = advance(btree, cursor)) > 0);
+out:
+	up_read(&btree->lock);
+	free_cursor(cursor);
+	return err;
+}
+
+/* Rebuild the dedup index from the data of every deduplicated file */
+int rebuild_index(struct sb *sb)
+{
+	struct btree *itable = itable_btree(sb);
+	struct index_build *build = new_index_build();
+	int err;
+	if (!build)
+		return -ENOMEM;
+	struct cursor *cursor = alloc_cursor(itable, 0);
+	if (!cursor) {
+		free_index_build(build);
+		return -ENOMEM;
+	}
+	down_read(&itable->lock);
+	if ((err = probe(itable, 0, cursor)))
+		goto out;
+	do {
+		struct ileaf *leaf = bufdata(cursor_leafbuf(cursor));
+		for (inum_t inum = 0; (inum = find_used_inode(itable, leaf, inum)) != -1; inum++) {
+			struct inode *inode = iget(sb, inum);
+			if (!inode) {
+				err = -ENOMEM;
+				break;
+			}
+			/* the files map_region() deduplicates */
+			if (!(err = open_inode(inode)) && dedup_policy(inode) != DEDUP_POLICY_OFF)
+				err = index_build_inode(inode, build);
+			free_inode(inode);
+			if (err)
+				break;
+		}
+		if (err) {
+			release_cursor(cursor);
+			goto out;
+		}
+	} while ((err = advance(itable, cursor)) > 0);
+out:
+	up_read(&itable->lock);
+	free_cursor(cursor);
+	if (!err)
+		err = index_build_finish(sb, build);
+	free_index_build(build);
+	return err;
+}
+
+/* Deduplicate up to one dtree extent's worth of a file, returns blocks done */
+static int dedup_extent(struct inode *inode, block_t index, unsigned count)
+{
+	struct buffer_head *buffers[MAX_EXTENT];
+	struct seg map[2 * MAX_EXTENT];
+	int segs, done = 0;
+	count = min(count, (unsigned)MAX_EXTENT);
+	for (unsigned i = 0; i < count; i++) {
+		if (!(buffers[i] = blockread(mapping(inode), index + i))) {
+			while (i--)
+				brelse(buffers[i]);
+			return -EIO;
+		}
+	}
+	if ((segs = map_region(inode, index, count, map, ARRAY_SIZE(map), 3)) > 0)
+		for (int i = 0; i < segs; i++)
+			done += map[i].count;
+	for (unsigned i = 0; i < count; i++)
+		brelse(buffers[i]);
+	return segs < 0 ? segs : done ? done : count;
+}
+
+/*
+ * Post-process dedup, see Offline deduplication in dedup.c.  Works through
+ * the extents noted since the last run, oldest first, until budget blocks
+ * have been read back, or all of them for a zero budget.  A nonzero rate
+ * caps the blocks read each second.  Extents not reached are kept for the
+ * next run.  Returns the number of blocks read.
+ */
+int dedupd(struct sb *sb, unsigned budget, unsigned rate)
+{
+	struct inode *inode = NULL;
+	unsigned done = 0, next = 0;
+	u64 start = dedup_clock();
+	int err;
+
+	if ((err = pending_load(sb)))
+		return err;
+	struct pendlist *list = sb->pending;
+	while (list && next < list->count && (!budget || done < budget)) {
+		struct pending *this = list->entries + next;
+		if (!inode || inode->inum != this->inum) {
+			if (inode && (err = tuxsync(inode)))
+				break;
+			if (inode)
+				free_inode(inode);
+			if (!(inode = iget(sb, this->inum))) {
+				err = -ENOMEM;
+				break;
+			}
+			if ((err = open_inode(inode))) {
+				free_inode(inode);
+				inode = NULL;
+				if (err != -ENOENT)
+					break;
+				/* deleted since */
+				err = 0;
+				next++;
+				continue;
+			}
+		}
+		if (dedup_policy(inode) == DEDUP_POLICY_OFF) {
+			/* turned off since */
+			next++;
+			continue;
+		}
+		unsigned count = budget ? min(this->count, budget - done) : this->count;
+		int did = dedup_extent(inode, this->index, count);
+		if (did < 0) {
+			err = did;
+			break;
+		}
+		this->index += did;
+		this->count -= did;
+		done += did;
+		if (!this->count)
+			next++;
+		if (rate) {
+			/* hold back until the blocks done are due */
+			u64 due = start + (u64)done * 1000000000 / rate, now = dedup_clock();
+			if (due > now)
+				nanosleep(&(struct timespec){ (due - now) / 1000000000, (due - now) % 1000000000 }, NULL);
+		}
+	}
+	if (inode) {
+		int synced = tuxsync(inode);
+		if (!err)
+			err = synced;
+		free_inode(inode);
+	}
+	if (list) {
+		vecmove(list->entries, list->entries + next, list->count - next);
+		list->count -= next;
+	}
+	return err ? err : done;
+}
+
 #include "super.c"
 
 #ifdef build_inode
 void change_begin(struct sb *sb) { }
 void change_end(struct sb *sb) { }
 
+static struct inode *new_file(struct inode *dir, const char *name, unsigned mode)
+{
+	struct inode *inode = tuxcreate(dir, name, strlen(name), &(struct tux_iattr){ .mode = mode | S_IRWXU });
+	if (!inode)
+		exit(1);
+	return inode;
+}
+
+/* Write count blocks from the file position, each zero but for fmt of its number from first */
+static void write_range(struct file *file, const char *fmt, int first, int count)
+{
+	char data[1 << 12];
+	for (int i = first; i < first + count; i++) {
+		memset(data, 0, sizeof(data));
+		snprintf(data, sizeof(data), fmt, i);
+		tuxwrite(file, data, sizeof(data));
+	}
+}
+
+/* A new file of count blocks written by write_range() */
+static struct inode *write_blocks(struct inode *dir, const char *name, const char *fmt, int count)
+{
+	struct inode *inode = new_file(dir, name, S_IFREG);
+	write_range(&(struct file){ .f_inode = inode }, fmt, 0, count);
+	return inode;
+}
+
 int main(int argc, char *argv[])
 {
 	if (argc < 2)
-		error("usage: %s <volname>", argv[0]);
+		error("usage: %s <volname> [htree|log]", argv[0]);
 	int err = 0;
 	char *name = argv[1];
 	fd_t fd = open(name, O_CREAT|O_TRUNC|O_RDWR, S_IRWXU);
@@ -209,17 +409,20 @@ int main(int argc, char *argv[])
 		.max_inodes_per_block = 64,
 		.entries_per_node = 20,
 		.volblocks = size >> dev->bits,
+		.bloombits = 16,
 	};
 	sb->volmap = rapid_open_inode(sb, NULL, 0);
 	sb->logmap = rapid_open_inode(sb, NULL, 0);
+	if (argc > 2 && !strcmp(argv[2], "log"))
+		sb->flags |= SB_LOG_INDEX;
+	else if (argc > 2 && fingerprint_engine(argv[2]) >= 0)
+		sb->fingerprint = fingerprint_engine(argv[2]);
 
 	trace("make tux3 filesystem on %s (0x%Lx bytes)", name, (L)size);
 	if ((errno = -make_tux3(sb)))
 		goto eek;
 	trace("create file");
-	struct inode *inode = tuxcreate(sb->rootdir, "foo", 3, &(struct tux_iattr){ .mode = S_IFREG | S_IRWXU });
-	if (!inode)
-		exit(1);
+	struct inode *inode = new_file(sb->rootdir, "foo", S_IFREG);
 	tux_dump_entries(blockget(mapping(sb->rootdir), 0));
 
 	trace(">>> write file");
@@ -252,6 +455,480 @@ int main(int argc, char *argv[])
 	if (got < 0)
 		exit(1);
 	hexdump(buf, got);
+
+	/* streams written together each fill their own container, buckets and all */
+	struct inode *stream[2] = { new_file(sb->rootdir, "left", S_IFREG), new_file(sb->rootdir, "right", S_IFREG) };
+	struct file streamfile[2] = { { .f_inode = stream[0] }, { .f_inode = stream[1] } };
+	char streamdata[1 << 12];
+	for (int i = 0; i < 64; i++) {
+		for (int j = 0; j < 2; j++) {
+			memset(streamdata, 0, sizeof(streamdata));
+			snprintf(streamdata, sizeof(streamdata), "stream %i block %i", j, i);
+			tuxwrite(streamfile + j, streamdata, sizeof(streamdata));
+		}
+		if (i % 16 == 15) {
+			tuxsync(stream[0]);
+			tuxsync(stream[1]);
+		}
+	}
+	for (int j = 0; j < 2; j++) {
+		struct seg streammap[8];
+		int streamsegs = map_region(stream[j], 0, 64, streammap, ARRAY_SIZE(streammap), 0);
+		block_t first = streammap[0].block, end = streammap[streamsegs - 1].block + streammap[streamsegs - 1].count;
+		/* nothing of the other stream in between, only its own bucket */
+		assert(end - first == 64 + 1);
+		assert(stream[j]->writebucket >= first && stream[j]->writebucket < end);
+		assert(!tree_chop(&stream[j]->btree, &(struct delete_info){ .key = 0 }, -1));
+		free_inode(stream[j]);
+	}
+	/* and leave the index as it was for the tests below */
+	assert(dedup_gc(sb) == 128);
+
+	trace(">>> dedup file");
+	sb->hashpool = new_hashpool(4);
+	unsigned cachehits = sb->fpcache ? sb->fpcache->hits : 0;
+	struct inode *dup = new_file(sb->rootdir, "dup", S_IFREG);
+	struct file *dupfile = &(struct file){ .f_inode = dup };
+	char data[1 << 12];
+	for (int i = 0; i < 6; i++) {
+		memset(data, "abcabb"[i], sizeof(data));
+		tuxwrite(dupfile, data, sizeof(data));
+	}
+	tuxsync(dup);
+	/* repeats within a flush are resolved once, by the first of them */
+	assert(!sb->fpcache || sb->fpcache->hits == cachehits);
+	/* a new file has no reference bucket, so its repeats hit the cache */
+	struct inode *dup2 = new_file(sb->rootdir, "dup2", S_IFREG);
+	struct file *dup2file = &(struct file){ .f_inode = dup2 };
+	for (int i = 0; i < 2; i++) {
+		memset(data, "ab"[i], sizeof(data));
+		tuxwrite(dup2file, data, sizeof(data));
+	}
+	tuxsync(dup2);
+	free_hashpool(sb->hashpool);
+	sb->hashpool = NULL;
+	assert(sb->fpcache && sb->fpcache->hits >= cachehits + 2);
+	/* new fingerprints skip the lookups, and the filter can be rebuilt */
+	assert(sb->bloomstat.skips >= 3);
+	assert(rebuild_bloom(sb) >= 3);
+	/* a b c => new extent, a b => one dup extent, b => dup of block 1 */
+	struct seg dupmap[6];
+	int segs = map_region(dup, 0, 6, dupmap, ARRAY_SIZE(dupmap), 0);
+	assert(segs == 3);
+	assert(dupmap[0].count == 3);
+	assert(dupmap[1].block == dupmap[0].block && dupmap[1].count == 2);
+	assert(dupmap[2].block == dupmap[0].block + 1 && dupmap[2].count == 1);
+	/* dup and dup2 share a three ways and b four, until and after the fold */
+	for (int fold = 0; fold < 2; fold++) {
+		assert(dedup_refs(sb, dupmap[0].block) == 3);
+		assert(dedup_refs(sb, dupmap[0].block + 1) == 4);
+		assert(dedup_refs(sb, dupmap[0].block + 2) == 1);
+		assert(!fold_refcounts(sb) && !sb->refdelta->count);
+	}
+	/* more changes than are held fold on the way, also while freeing */
+	u64 savedrefs = sb->dedupstat.count[DEDUP_SAVED];
+	unsigned deadcount = sb->dead ? sb->dead->count : 0, folds = sb->refdelta->folds, many = REFDELTA_SIZE + 100;
+	block_t fake = sb->volblocks;
+	for (unsigned i = 0; i < many; i++)
+		dedup_ref(sb, fake + i, 1);
+	assert(sb->refdelta->folds == folds + 1 && sb->refdelta->count == 100);
+	for (unsigned i = 0; i < many; i += 97)
+		assert(dedup_refs(sb, fake + i) == 2);
+	assert(!fold_refcounts(sb));
+	/* odd blocks down to their last reference die, even ones lose one */
+	for (unsigned i = 1; i < many; i += 2)
+		dedup_ref(sb, fake + i, -1);
+	assert(!dedup_free(sb, fake, many) && sb->refdelta->folds == folds + 3);
+	for (unsigned i = 0; i < many; i++)
+		assert(dedup_refs(sb, fake + i) == !(i & 1));
+	assert(sb->dead->count == deadcount + many / 2);
+	/* they are past the end of the volume, keep the collector off them */
+	for (unsigned i = 0, kept = 0; i < sb->dead->count; i++)
+		if (sb->dead->blocks[i] < fake)
+			sb->dead->blocks[kept++] = sb->dead->blocks[i];
+	sb->dead->count = deadcount;
+	assert(!fold_refcounts(sb) && dedup_refs(sb, fake + 1) == 1);
+	sb->dedupstat.count[DEDUP_SAVED] = savedrefs;
+	/* deleting both files leaves a, b and c unreferenced but indexed */
+	int keys = rebuild_bloom(sb);
+	assert(!fplog_flush(sb));
+	block_t freeblocks = sb->freeblocks;
+	assert(!tree_chop(&dup2->btree, &(struct delete_info){ .key = 0 }, -1));
+	free_inode(dup2);
+	assert(dedup_refs(sb, dupmap[0].block) == 2);
+	assert(dedup_refs(sb, dupmap[0].block + 1) == 3);
+	assert(!tree_chop(&dup->btree, &(struct delete_info){ .key = 0 }, -1));
+	for (int i = 0; i < 3; i++)
+		assert(dedup_refs(sb, dupmap[0].block + i) == 0);
+	assert(sb->freeblocks == freeblocks);
+	/* the dead list is written at sync and read back at mount */
+	struct deadlist *synced = sb->dead;
+	assert(!dead_flush(sb) && sb->deadblock && !synced->dirty);
+	sb->dead = NULL;
+	assert(!dead_load(sb) && sb->dead->count == synced->count && !sb->dead->dirty);
+	for (unsigned i = 0; i < synced->count; i++)
+		assert(dead_find(sb, synced->blocks[i]));
+	free(synced);
+	/* collecting them drops their keys and gives the space back */
+	assert(dedup_gc(sb) == 3);
+	assert(sb->freeblocks >= freeblocks + 3);
+	assert(rebuild_bloom(sb) == keys - 3);
+	assert(!dead_flush(sb) && !sb->deadblock);
+	free_inode(dup);
+
+	/* out of space, file data collects the dead blocks and tries again */
+	if (!(sb->flags & SB_LOG_INDEX)) {
+		block_t *taken = malloc(sb->volblocks * sizeof(*taken)), block;
+		unsigned took = 0;
+		assert(taken);
+		while (!balloc(sb, 1, taken + took))
+			took++;
+		assert(data_balloc(sb->rootdir, 1, &block) == -ENOSPC);
+		assert(!dead_add(sb, taken[--took], 1));
+		assert(!data_balloc(sb->rootdir, 1, &block) && !sb->dead->count);
+		assert(!bfree(sb, block, 1));
+		while (took)
+			bfree(sb, taken[--took], 1);
+		free(taken);
+	}
+
+	/* a filter gone stale only costs the share, not a reference */
+	struct inode *stale[2];
+	block_t staleblock[2];
+	for (int i = 0; i < 2; i++) {
+		stale[i] = new_file(sb->rootdir, i ? "stale2" : "stale1", S_IFREG);
+		memset(data, 'x', sizeof(data));
+		tuxwrite(&(struct file){ .f_inode = stale[i] }, data, sizeof(data));
+		tuxsync(stale[i]);
+		struct seg stalemap[1];
+		assert(map_region(stale[i], 0, 1, stalemap, 1, 0) == 1);
+		staleblock[i] = stalemap[0].block;
+		if (!i)
+			assert(!make_bloom(sb, sb->bloombits));
+	}
+	assert(staleblock[1] != staleblock[0]);
+	assert(dedup_refs(sb, staleblock[0]) == 1);
+	assert(dedup_refs(sb, staleblock[1]) == 1);
+	for (int i = 0; i < 2; i++) {
+		assert(!tree_chop(&stale[i]->btree, &(struct delete_info){ .key = 0 }, -1));
+		free_inode(stale[i]);
+	}
+	assert(dedup_gc(sb) == 1);
+	assert(rebuild_bloom(sb) == keys - 3);
+
+	/* a few dead blocks wait for more, and leave the filter as it is */
+	struct inode *few = write_blocks(sb->rootdir, "few", "few %i", 8);
+	unsigned char fewhash[FINGERPRINT_SIZE];
+	memset(data, 0, sizeof(data));
+	snprintf(data, sizeof(data), "few %i", 7);
+	fingerprint(sb, data, fewhash);
+	tuxsync(few);
+	assert(!tree_chop(&few->btree, &(struct delete_info){ .key = 6 }, -1));
+	assert(!dedup_gc_due(sb));
+	assert(dedup_gc(sb) == 2 && sb->bloomstale == 2);
+	assert(bloom_test(sb, fingerprint_key(fewhash)));
+	assert(!tree_chop(&few->btree, &(struct delete_info){ .key = 0 }, -1));
+	free_inode(few);
+	assert(dedup_gc(sb) == 6 && !sb->bloomstale);
+	assert(rebuild_bloom(sb) == keys - 3);
+
+	/* collecting a bucket in the middle of a chain links past it */
+	unsigned perbucket = sb->entries_per_bucket, chainblocks = 3 * perbucket;
+	struct inode *chain = new_file(sb->rootdir, "chain", S_IFREG);
+	struct inode *tail = new_file(sb->rootdir, "tail", S_IFREG);
+	struct file chainfile[3] = { { .f_inode = chain }, { .f_inode = tail } };
+	/* so much new data would back the volume off, see dedup_wanted() */
+	struct dedup_yield yield = sb->yield;
+	for (int j = 0; j < 2; j++) {
+		write_range(chainfile + j, "chain %i", j * 2 * perbucket, chainblocks - j * 2 * perbucket);
+		tuxsync(chainfile[j].f_inode);
+		sb->yield = yield;
+	}
+	unsigned char chainhash[1][FINGERPRINT_SIZE];
+	struct hash_ref chainref[1];
+	memset(data, 0, sizeof(data));
+	snprintf(data, sizeof(data), "chain %i", 0);
+	fingerprint(sb, data, chainhash[0]);
+	assert(!hash_resolve(chain, chainhash, chainref, 1) && chainref[0].block != -1);
+	block_t chainbucket[3] = { chainref[0].bucket };
+	for (int i = 1; i < 3; i++) {
+		struct buffer_head *buffer = sb_bread(sb, chainbucket[i - 1]);
+		chainbucket[i] = bucket_next(sb, chainbucket[i - 1], bufdata(buffer));
+		brelse(buffer);
+		assert(chainbucket[i] > chainbucket[i - 1]);
+	}
+	/* the middle bucket dies with its blocks, the tail keeps the last one full */
+	assert(!tree_chop(&chain->btree, &(struct delete_info){ .key = perbucket }, -1));
+	assert(dedup_gc_due(sb));
+	assert(dedup_gc(sb) == perbucket);
+	struct buffer_head *chainbuf = sb_bread(sb, chainbucket[0]);
+	assert(bucket_next(sb, chainbucket[0], bufdata(chainbuf)) == chainbucket[2]);
+	brelse(chainbuf);
+	/* its block reused for anything, a copy still follows the chain */
+	chainbuf = sb_getblk(sb, chainbucket[1]);
+	memset(bufdata(chainbuf), 0xff, bufsize(chainbuf));
+	brelse_dirty(chainbuf);
+	struct inode *rechain = new_file(sb->rootdir, "rechain", S_IFREG);
+	chainfile[2] = (struct file){ .f_inode = rechain };
+	write_range(chainfile + 2, "chain %i", 0, perbucket);
+	write_range(chainfile + 2, "chain %i", 2 * perbucket, chainblocks - 2 * perbucket);
+	tuxsync(rechain);
+	sb->yield = yield;
+	struct seg chainmap[2][8];
+	for (unsigned at = 0; at < 2 * perbucket; at += perbucket) {
+		int chainsegs = map_region(rechain, at, perbucket, chainmap[0], ARRAY_SIZE(chainmap[0]), 0);
+		struct inode *from = at ? tail : chain;
+		assert(map_region(from, 0, perbucket, chainmap[1], ARRAY_SIZE(chainmap[1]), 0) == chainsegs);
+		for (int i = 0; i < chainsegs; i++)
+			assert(chainmap[0][i].block == chainmap[1][i].block && chainmap[0][i].count == chainmap[1][i].count);
+	}
+	/* and leave the index as it was for the tests below */
+	struct inode *chained[] = { chain, tail, rechain };
+	for (int i = 0; i < 3; i++) {
+		assert(!tree_chop(&chained[i]->btree, &(struct delete_info){ .key = 0 }, -1));
+		free_inode(chained[i]);
+	}
+	assert(dedup_gc(sb) == 2 * perbucket);
+	assert(rebuild_bloom(sb) == keys - 3);
+
+	/* a copy finds its fingerprints down the buckets of the original */
+	struct inode *orig = NULL, *copy = NULL;
+	for (int pass = 0; pass < 2; pass++) {
+		struct inode *stream = write_blocks(sb->rootdir, pass ? "copy" : "orig", "block %i", 300);
+		*(pass ? &copy : &orig) = stream;
+		/* as after a remount, only the buckets can help */
+		memset(sb->fpcache->entries, 0, sizeof(sb->fpcache->entries));
+		u64 probes = sb->dedupstat.count[DEDUP_HTREE_PROBES];
+		tuxsync(stream);
+		assert(!pass || sb->dedupstat.count[DEDUP_HTREE_PROBES] - probes <= 3);
+	}
+	assert(sb->dedupstat.count[DEDUP_BUCKET_HITS] >= 290);
+	struct seg origmap[10], copymap[10];
+	segs = map_region(orig, 0, 300, origmap, ARRAY_SIZE(origmap), 0);
+	assert(map_region(copy, 0, 300, copymap, ARRAY_SIZE(copymap), 0) == segs);
+	for (int i = 0; i < segs; i++)
+		assert(copymap[i].block == origmap[i].block && copymap[i].count == origmap[i].count);
+	assert(dedup_refs(sb, copymap[0].block) == 2);
+	/* a copy flushed a few blocks at a time still packs into whole extents */
+	struct inode *piece = new_file(sb->rootdir, "piece", S_IFREG);
+	struct file *piecefile = &(struct file){ .f_inode = piece };
+	for (int i = 0; i < 300; i += 7) {
+		write_range(piecefile, "block %i", i, min(7, 300 - i));
+		tuxsync(piece);
+	}
+	assert(map_region(piece, 0, 300, copymap, ARRAY_SIZE(copymap), 0) == segs);
+	for (int i = 0; i < segs; i++)
+		assert(copymap[i].block == origmap[i].block && copymap[i].count == origmap[i].count);
+	/* files sharing blocks read them from disk once between them */
+	unsigned readhits = sb->readcache ? sb->readcache->hits : 0;
+	struct inode *sharers[] = { orig, copy, piece };
+	for (int i = 0; i < ARRAY_SIZE(sharers); i++) {
+		struct file *reader = &(struct file){ .f_inode = sharers[i] };
+		evict_buffers(mapping(sharers[i]));
+		tuxseek(reader, 0);
+		for (int j = 0; j < 300; j++) {
+			char want[16];
+			snprintf(want, sizeof(want), "block %i", j);
+			assert(tuxread(reader, data, sizeof(data)) == sizeof(data) && !strcmp(data, want));
+		}
+	}
+	assert(sb->readcache && sb->readcache->hits >= readhits + 600);
+	tuxclose(piece);
+	tuxclose(orig);
+	tuxclose(copy);
+
+	/* zero blocks are left as holes and cost no space */
+	struct inode *sparse = new_file(sb->rootdir, "sparse", S_IFREG);
+	struct file *sparsefile = &(struct file){ .f_inode = sparse };
+	for (int i = 0; i < 4; i++) {
+		memset(data, i == 1 ? 'z' : 0, sizeof(data));
+		tuxwrite(sparsefile, data, sizeof(data));
+	}
+	tuxsync(sparse);
+	struct seg sparsemap[4];
+	assert(map_region(sparse, 0, 4, sparsemap, ARRAY_SIZE(sparsemap), 0) == 3);
+	assert(sparsemap[0].state == SEG_HOLE && sparsemap[0].count == 1);
+	assert(sparsemap[1].state != SEG_HOLE && sparsemap[1].count == 1);
+	assert(sparsemap[2].state == SEG_HOLE && sparsemap[2].count == 2);
+	tuxseek(sparsefile, 0);
+	assert(tuxread(sparsefile, data, sizeof(data)) == sizeof(data) && zero_block(data, sizeof(data)));
+	assert(tuxread(sparsefile, data, sizeof(data)) == sizeof(data) && data[0] == 'z');
+	tuxclose(sparse);
+	assert(sb->dedupstat.count[DEDUP_ZERO] == 3);
+
+	/* written blocks read back clean against their checksums, and damage shows */
+	assert(sb->crctable);
+	assert(!diskread(dev->fd, data, sizeof(data), sparsemap[1].block << dev->bits));
+	assert(!crc_verify(sb, sparsemap[1].block, data));
+	data[7] ^= 1;
+	assert(crc_verify(sb, sparsemap[1].block, data) == -EIO);
+
+	/* a rebuilt index finds what the old one did, in about the same space */
+	block_t before = sb->freeblocks;
+	sb->hashpool = new_hashpool(4);
+	assert(rebuild_index(sb) >= 300);
+	assert(sb->freeblocks + 4 >= before);
+	struct inode *again = write_blocks(sb->rootdir, "again", "block %i", 300);
+	tuxsync(again);
+	free_hashpool(sb->hashpool);
+	sb->hashpool = NULL;
+	assert(map_region(again, 0, 300, copymap, ARRAY_SIZE(copymap), 0) == segs);
+	for (int i = 0; i < segs; i++)
+		assert(copymap[i].block == origmap[i].block && copymap[i].count == origmap[i].count);
+	tuxclose(again);
+	assert(sb->dedupstat.count[DEDUP_SAVED] >= 300);
+
+	/* offline, a copy is written out in full and dedupd shares it later */
+	sb->flags |= SB_DEDUP_OFFLINE;
+	struct inode *later = new_file(sb->rootdir, "later", S_IFREG);
+	struct file *laterfile = &(struct file){ .f_inode = later };
+	write_range(laterfile, "block %i", 0, 150);
+	write_range(laterfile, "", 150, 1);
+	write_range(laterfile, "block %i", 151, 149);
+	u64 saved = sb->dedupstat.count[DEDUP_SAVED];
+	tuxsync(later);
+	assert(sb->dedupstat.count[DEDUP_SAVED] == saved);
+	assert(map_region(later, 0, 300, copymap, ARRAY_SIZE(copymap), 0) > 0 && copymap[0].block != origmap[0].block);
+	inum_t laterinum = later->inum;
+	tuxclose(later);
+	/* noted extents survive a sync, and a budget leaves the rest for later */
+	assert(sb->pending && sb->pending->count && !pending_flush(sb) && sb->pendblock && !sb->pending->count);
+	assert(dedupd(sb, 100, 0) == 100 && sb->pending->count);
+	assert(!pending_flush(sb) && sb->pendblock);
+	assert(dedupd(sb, 0, 1 << 20) == 200 && !sb->pending->count && !sb->pendblock);
+	assert(sb->dedupstat.count[DEDUP_SAVED] == saved + 299);
+	later = iget(sb, laterinum);
+	assert(!open_inode(later));
+	/* the blocks of the original, but for the zero block, now a hole */
+	block_t origblock[300];
+	for (int i = 0, at = 0; i < segs; at += origmap[i++].count)
+		for (int j = 0; j < origmap[i].count; j++)
+			origblock[at + j] = origmap[i].block + j;
+	struct seg latermap[16];
+	int latersegs = map_region(later, 0, 300, latermap, ARRAY_SIZE(latermap), 0);
+	for (int i = 0, at = 0; i < latersegs; at += latermap[i++].count)
+		for (int j = 0; j < latermap[i].count; j++)
+			assert(at + j == 150 ? latermap[i].state == SEG_HOLE : latermap[i].block + j == origblock[at + j]);
+	evict_buffers(mapping(later));
+	laterfile = &(struct file){ .f_inode = later };
+	for (int i = 0; i < 300; i++) {
+		char want[16] = { };
+		if (i != 150)
+			snprintf(want, sizeof(want), "block %i", i);
+		assert(tuxread(laterfile, data, sizeof(data)) == sizeof(data) && !strcmp(data, want));
+	}
+	tuxclose(later);
+	/* and the copies it dropped go back to free space */
+	freeblocks = sb->freeblocks;
+	assert(sb->dead && sb->dead->count == 300 && dedup_gc(sb) >= 0);
+	assert(sb->freeblocks >= freeblocks + 300);
+	sb->flags &= ~SB_DEDUP_OFFLINE;
+
+	/* a stream that stops finding duplicates backs off, and comes back when they return */
+	struct inode *noise = new_file(sb->rootdir, "noise", S_IFREG);
+	struct file *noisefile = &(struct file){ .f_inode = noise };
+	u64 plain = sb->plainblocks;
+	for (int i = 0; i < 2048; i += 64) {
+		write_range(noisefile, "noise %i", i, 64);
+		tuxsync(noise);
+	}
+	assert(noise->yield.off && sb->plainblocks >= plain + 512);
+	/* samples still go through the index */
+	assert(sb->plainblocks < plain + 2048 - YIELD_WINDOW / 2);
+	/* the blocks of orig over and over, synced every 64 as before */
+	for (int i = 0, run; i < 2048; i += run) {
+		run = min(64 - i % 64, 300 - i % 300);
+		write_range(noisefile, "block %i", i % 300, run);
+		if ((i + run) % 64 == 0)
+			tuxsync(noise);
+	}
+	assert(!noise->yield.off && noise->yield.hits);
+	tuxclose(noise);
+
+	/* a policy set on a directory is taken by the files made in it */
+	struct inode *quiet = new_file(sb->rootdir, "quiet", S_IFDIR);
+	assert(set_xattr(quiet, "tux3.dedup", 10, "maybe", 5, 0) == -EINVAL);
+	assert(!set_xattr(quiet, "tux3.dedup", 10, "off", 3, 0));
+	struct inode *loud = write_blocks(quiet, "loud", "block %i", 100);
+	assert(dedup_policy(loud) == DEDUP_POLICY_OFF);
+	assert(get_xattr(loud, "tux3.dedup", 10, data, sizeof(data)) == 3 && !memcmp(data, "off", 3));
+	saved = sb->dedupstat.count[DEDUP_SAVED];
+	tuxsync(loud);
+	assert(sb->dedupstat.count[DEDUP_SAVED] == saved);
+	/* never indexed, so its blocks are freed at once, not left to the collector */
+	unsigned dead = sb->dead ? sb->dead->count : 0;
+	assert(!tree_chop(&loud->btree, &(struct delete_info){ .key = 0 }, -1));
+	assert((sb->dead ? sb->dead->count : 0) == dead);
+	tuxclose(loud);
+	tuxclose(quiet);
+
+	/* verify only shares what compares equal, so a block gone bad on disk is not shared */
+	char good[sizeof(data)];
+	assert(!diskread(dev->fd, good, sizeof(good), origblock[7] << dev->bits));
+	memset(data, 0, sizeof(data));
+	strcpy(data, "bad block");
+	assert(!diskwrite(dev->fd, data, sizeof(data), origblock[7] << dev->bits));
+	readcache_forget(sb, origblock[7]);
+	struct inode *checked = new_file(sb->rootdir, "checked", S_IFREG);
+	assert(!set_xattr(checked, "tux3.dedup", 10, "verify", 6, 0));
+	assert(dedup_policy(checked) == DEDUP_POLICY_VERIFY);
+	write_range(&(struct file){ .f_inode = checked }, "block %i", 0, 100);
+	struct verifystat verify = sb->verifystat;
+	saved = sb->dedupstat.count[DEDUP_SAVED];
+	tuxsync(checked);
+	assert(sb->dedupstat.count[DEDUP_SAVED] == saved + 99);
+	assert(sb->verifystat.compares == verify.compares + 100);
+	assert(sb->verifystat.mismatches == verify.mismatches + 1);
+	segs = map_region(checked, 0, 100, copymap, ARRAY_SIZE(copymap), 0);
+	for (int i = 0, at = 0; i < segs; at += copymap[i++].count)
+		for (int j = 0; j < copymap[i].count; j++)
+			assert((copymap[i].block + j == origblock[at + j]) == (at + j != 7));
+	tuxclose(checked);
+	assert(!diskwrite(dev->fd, good, sizeof(good), origblock[7] << dev->bits));
+
+	/* log runs pile up a sync at a time, merge, and still find everything */
+	if (sb->flags & SB_LOG_INDEX) {
+		unsigned entries, logged;
+		assert(!fplog_flush(sb) && fplog_runs(sb, &logged) == 1);
+		struct inode *runs = new_file(sb->rootdir, "runs", S_IFREG);
+		struct inode *rerun = new_file(sb->rootdir, "rerun", S_IFREG);
+		for (int pass = 0; pass < 2; pass++) {
+			struct file *stream = &(struct file){ .f_inode = pass ? rerun : runs };
+			for (int i = 0; i < 150; i += pass ? 150 : 50) {
+				write_range(stream, "run %i", i, pass ? 150 : 50);
+				if (!pass) {
+					tuxsync(runs);
+					assert(!fplog_flush(sb));
+				}
+			}
+			memset(sb->fpcache->entries, 0, sizeof(sb->fpcache->entries));
+			tuxsync(stream->f_inode);
+		}
+		/* one run each sync would make four */
+		assert(fplog_runs(sb, &entries) < 4 && entries == logged + 150);
+		/* same blocks in the same extents, however the writes were flushed */
+		segs = map_region(runs, 0, 150, origmap, ARRAY_SIZE(origmap), 0);
+		assert(map_region(rerun, 0, 150, copymap, ARRAY_SIZE(copymap), 0) == segs);
+		for (int i = 0; i < segs; i++)
+			assert(copymap[i].block == origmap[i].block && copymap[i].count == origmap[i].count);
+		tuxclose(runs);
+		tuxclose(rerun);
+	}
+
+	/* a weak fingerprint engine shares nothing it has not compared */
+	if (fingerprint_engines[sb->fingerprint].weak)
+		assert(sb->verifystat.compares - sb->verifystat.mismatches == sb->dedupstat.count[DEDUP_SAVED]);
+
+	/* the report is sized first, then filled */
+	int statsize = dedupstat_show(sb, NULL, 0);
+	assert(statsize > 0 && statsize < sizeof(data));
+	assert(dedupstat_show(sb, data, sizeof(data)) == statsize && strlen(data) == statsize);
+	printf("%s", data);
+	u64 hashed = 0;
+	for (int i = 0; i < DEDUP_TIME_SLOTS; i++)
+		hashed += sb->dedupstat.time[DEDUP_TIME_HASH][i];
+	assert(hashed >= 600);
+
 	trace(">>> show state");
 	show_buffers(mapping(file->f_inode));
 	show_buffers(mapping(sb->rootdir));
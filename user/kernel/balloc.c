@@ -293,6 +293,81 @@ eek:
 	return -1; // error???
 }
 
+/*
+ * Stream containers
+ *
+ * New data of a file is laid out in containers, runs of free blocks taken
+ * whole from the global cursor, one open at a time for each file being
+ * written.  A file's data and its dedup buckets fill its container in the
+ * order they are written, so what one backup stream writes, and the index
+ * entries for it, stay together however many streams and how much
+ * metadata are written at the same time, and a restore reads nearly in
+ * order.  A container is claimed by allocating it and freeing it again,
+ * which only moves the global cursor past it: just the blocks handed out
+ * are ever marked in the bitmap, so an abandoned container leaks nothing
+ * and is reused once the cursor wraps.  Anything but a regular file, or a
+ * file that cannot get a container, is allocated at the global cursor as
+ * before.
+ */
+
+#define CONTAINER_BITS 22	/* 4MB containers, less on small volumes */
+
+static unsigned container_blocks(struct sb *sb)
+{
+	unsigned blocks = 1 << (CONTAINER_BITS - sb->blockbits);
+	return min(blocks, (unsigned)(sb->volblocks >> 4));
+}
+
+/* Next blocks of the open container, if they are still free */
+static block_t container_take(struct sb *sb, struct container *box, unsigned blocks)
+{
+	if (box->next + blocks > box->limit)
+		return -1;
+	mutex_lock_nested(&sb->bitmap->i_mutex, I_MUTEX_BITMAP);
+	block_t goal = sb->nextalloc, found = balloc_from_range(sb, box->next, blocks, blocks);
+	sb->nextalloc = goal;
+	mutex_unlock(&sb->bitmap->i_mutex);
+	if (found != -1)
+		box->next = found + blocks;
+	return found;
+}
+
+/* Allocate for a file, in its container if it is a regular file */
+int stream_balloc(struct inode *inode, unsigned blocks, block_t *block)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct container *box = &tux_inode(inode)->container;
+	unsigned size = container_blocks(sb);
+
+	if (!S_ISREG(inode->i_mode) || blocks > size)
+		return balloc(sb, blocks, block);
+	if ((*block = container_take(sb, box, blocks)) != -1)
+		return 0;
+	/* full, or taken by someone else after a wrap */
+	block_t base;
+	if (!balloc(sb, size, &base)) {
+		bfree(sb, base, size);
+		*box = (struct container){ .next = base, .limit = base + size };
+		trace("open container [%Lx/%x]", (L)base, size);
+		if ((*block = container_take(sb, box, blocks)) != -1)
+			return 0;
+	}
+	*box = (struct container){ };
+	return balloc(sb, blocks, block);
+}
+
+/* Give back blocks a file allocated but did not use */
+int stream_bfree(struct inode *inode, block_t start, unsigned blocks)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	struct container *box = &tux_inode(inode)->container;
+	if (box->next == start + blocks)
+		box->next = start;
+	else if (sb->nextalloc == start + blocks)
+		sb->nextalloc = start;
+	return bfree(sb, start, blocks);
+}
+
 int update_bitmap(struct sb *sb, block_t start, unsigned count, int set)
 {
 	unsigned shift = sb->blockbits + 3, mask = (1 << shift) - 1;
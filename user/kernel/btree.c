@@ -218,6 +218,46 @@ void free_cursor(struct cursor *cursor)
 	free(cursor);
 }
 
+/*
+ * Index node search: return the first entry after the leftmost whose key
+ * is greater than key, or the end of the node.  probe() descends through
+ * the entry before it.
+ */
+static struct index_entry *bnode_binary_search(struct bnode *node, tuxkey_t key)
+{
+	unsigned lo = 1, hi = bcount(node);
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (from_be_u64(node->entries[mid].key) > key)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return node->entries + lo;
+}
+
+/*
+ * For evenly spread keys one interpolated guess lands within a few entries
+ * of the answer, then walk the rest of the way.  Skewed keys make the walk
+ * long, so only trees of fingerprint keys should use this.
+ */
+static struct index_entry *bnode_interpolation_search(struct bnode *node, tuxkey_t key)
+{
+	struct index_entry *entries = node->entries;
+	unsigned count = bcount(node);
+	if (count < 2 || key < from_be_u64(entries[1].key))
+		return entries + 1;
+	tuxkey_t last = from_be_u64(entries[count - 1].key);
+	if (key >= last)
+		return entries + count;
+	unsigned at = interpolate(key, from_be_u64(entries[1].key), last, 1, count - 1);
+	while (from_be_u64(entries[at].key) > key)
+		at--;
+	while (from_be_u64(entries[at + 1].key) <= key)
+		at++;
+	return entries + at + 1;
+}
+
 int probe(struct btree *btree, tuxkey_t key, struct cursor *cursor)
 {
 	unsigned i, depth = btree->root.depth;
@@ -227,10 +267,15 @@ int probe(struct btree *btree, tuxkey_t key, struct cursor *cursor)
 	struct bnode *node = bufdata(buffer);
 
 	for (i = 0; i < depth; i++) {
-		struct index_entry *next = node->entries, *top = next + bcount(node);
-		while (++next < top) /* binary search goes here */
-			if (from_be_u64(next->key) > key)
-				break;
+		/* the searches trust the count, so do not let them off the end */
+		if (bcount(node) > (btree->sb->blocksize - sizeof(struct bnode)) / sizeof(struct index_entry)) {
+			warn("index node %Lx count %u is bad", (L)bufindex(buffer), bcount(node));
+			brelse(buffer);
+			goto eek;
+		}
+		struct index_entry *next = btree->ops->search == SEARCH_INTERPOLATE ?
+			bnode_interpolation_search(node, key) :
+			bnode_binary_search(node, key);
 		trace("probe level %i, %ti of %i", i, next - node->entries, bcount(node));
 		level_push(cursor, buffer, next);
 		if (!(buffer = sb_bread(vfs_sb(btree->sb), from_be_u64((next - 1)->block))))
@@ -294,6 +339,30 @@ tuxkey_t next_key(struct cursor *cursor, int depth)
 }
 // also write this_key!!!
 
+/*
+ * Reposition a cursor for a key at or after the last one it was used for,
+ * for callers that walk a sorted batch of keys.  Stay put if the key is in
+ * the same leaf, advance if it is in the next leaf under the same parent,
+ * otherwise probe from the root.  An empty cursor is just probed.
+ */
+int probe_forward(struct btree *btree, tuxkey_t key, struct cursor *cursor)
+{
+	int depth = btree->root.depth;
+	if (!cursor->len)
+		return probe(btree, key, cursor);
+	if (key < next_key(cursor, depth))
+		return 0;
+	struct bnode *parent = cursor_node(cursor, depth - 1);
+	struct index_entry *next = cursor->path[depth - 1].next;
+	if (next + 1 < parent->entries + bcount(parent) && key < from_be_u64((next + 1)->key)) {
+		int err = advance(btree, cursor);
+		if (err)
+			return err < 0 ? err : 0;
+	}
+	release_cursor(cursor);
+	return probe(btree, key, cursor);
+}
+
 void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count)
 {
 	printf("%i level btree at %Li:\n", btree->root.depth, (L)btree->root.block);
@@ -529,6 +598,7 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 	struct btree *btree = cursor->btree;
 	int depth = btree->root.depth;
 	block_t childblock = bufindex(leafbuf);
+	int moved = !keep; /* cursor is under the new child at this level */
 	if (keep)
 		brelse(leafbuf);
 	else {
@@ -543,7 +613,7 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 		/* insert and exit if not full */
 		if (bcount(parent) < btree->sb->entries_per_node) {
 			add_child(parent, at->next, childblock, childkey);
-			if (!keep)
+			if (moved)
 				at->next++;
 			mark_buffer_dirty(parentbuf);
 			return 0;
@@ -561,7 +631,8 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 		parent->count = to_be_u32(half);
 
 		/* if the cursor is in the new node, use that as the parent */
-		if (at->next > parent->entries + half) {
+		int split = at->next > parent->entries + half;
+		if (split) {
 			struct index_entry *newnext;
 			mark_buffer_dirty(parentbuf);
 			newnext = newnode->entries + (at->next - &parent->entries[half]);
@@ -571,9 +642,11 @@ static int insert_leaf(struct cursor *cursor, tuxkey_t childkey, struct buffer_h
 			parent = newnode;
 		}
 		add_child(parent, at->next, childblock, childkey);
-		if (!keep)
+		if (moved)
 			at->next++;
 		mark_buffer_dirty(parentbuf);
+		/* whether the split left it in the new node, not where the leaf went */
+		moved = split;
 		childkey = newkey;
 		childblock = bufindex(newbuf);
 		brelse(newbuf);
@@ -637,6 +710,140 @@ void *tree_expand(struct btree *btree, tuxkey_t key, unsigned newsize, struct cu
 	return NULL;
 }
 
+/*
+ * Bulk loading
+ *
+ * Builds a btree bottom up from keys that arrive in ascending order, in
+ * place of one tree_expand() per key.  Leaves are filled left to right and
+ * each one that is closed passes its first key up to the index node being
+ * filled above it, which is closed in turn once it holds entries_per_node
+ * children.  Every block is allocated once, comes out full, and is never
+ * split or written again while loading.
+ *
+ * btree_load_add() fills leaves through the leaf_resize method and starts
+ * a new leaf when that finds no room.  Leaf formats without leaf_resize
+ * are filled by the caller in load->leafbuf, calling btree_load_leaf() to
+ * start each leaf.  btree_load_finish() closes the right edge and installs
+ * the new root, or if anything failed frees the blocks loaded so far.  The
+ * tree that was there before is not freed, that is up to the caller, and
+ * neither is anything the loaded leaves refer to.
+ */
+
+void btree_load_begin(struct btree_load *load, struct btree *btree)
+{
+	*load = (struct btree_load){ .btree = btree };
+}
+
+/* Add a child to the index node being filled at level, closing it if full */
+static int load_child(struct btree_load *load, unsigned level, tuxkey_t key, block_t child)
+{
+	struct btree *btree = load->btree;
+	if (level == BTREE_LOAD_LEVELS)
+		return -E2BIG;
+	struct load_level *at = load->level + level;
+	if (at->buffer && bcount(bufdata(at->buffer)) == btree->sb->entries_per_node) {
+		int err = load_child(load, level + 1, at->key, bufindex(at->buffer));
+		/* kept on error, so btree_load_finish() can free it */
+		if (err)
+			return err;
+		brelse(at->buffer);
+		at->buffer = NULL;
+	}
+	if (!at->buffer) {
+		if (!(at->buffer = new_node(btree)))
+			return -ENOMEM;
+		at->key = key;
+		if (load->levels <= level)
+			load->levels = level + 1;
+	}
+	struct bnode *node = bufdata(at->buffer);
+	add_child(node, node->entries + bcount(node), child, key);
+	return 0;
+}
+
+/* Close the current leaf and start a new one, key must be above all before */
+int btree_load_leaf(struct btree_load *load, tuxkey_t key)
+{
+	struct btree *btree = load->btree;
+	if (load->err)
+		return load->err;
+	if (load->leafbuf) {
+		int err = load_child(load, 0, load->leafkey, bufindex(load->leafbuf));
+		if (err)
+			return load->err = err;
+		brelse(load->leafbuf);
+		load->leafbuf = NULL;
+	}
+	if (!(load->leafbuf = new_leaf(btree)))
+		return load->err = -ENOMEM;
+	load->leafkey = key;
+	return 0;
+}
+
+/* Room for key at the end of the tree, as tree_expand() gives it */
+void *btree_load_add(struct btree_load *load, tuxkey_t key, unsigned newsize)
+{
+	struct btree *btree = load->btree;
+	for (int i = 0; i < 2; i++) {
+		if (load->leafbuf) {
+			void *space = (btree->ops->leaf_resize)(btree, key, bufdata(load->leafbuf), newsize);
+			if (space)
+				return space;
+			assert(!i);
+		}
+		if (btree_load_leaf(load, key))
+			return NULL;
+	}
+	return NULL;
+}
+
+/* Free a subtree of a failed load, not what its leaves refer to */
+static void load_free(struct btree *btree, struct buffer_head *buffer, unsigned depth)
+{
+	if (depth) {
+		struct bnode *node = bufdata(buffer);
+		for (unsigned i = 0; i < bcount(node); i++) {
+			struct buffer_head *child = sb_bread(vfs_sb(btree->sb), from_be_u64(node->entries[i].block));
+			if (child)
+				load_free(btree, child, depth - 1);
+		}
+	}
+	brelse_free(btree, buffer);
+}
+
+/* Close the right edge and make the loaded tree the btree, or clean up */
+int btree_load_finish(struct btree_load *load)
+{
+	struct btree *btree = load->btree;
+	/* even an empty tree has a leaf */
+	if (!load->leafbuf)
+		btree_load_leaf(load, 0);
+	if (load->leafbuf && !load->err &&
+	    !(load->err = load_child(load, 0, load->leafkey, bufindex(load->leafbuf)))) {
+		brelse(load->leafbuf);
+		load->leafbuf = NULL;
+	}
+	for (unsigned level = 0; level < load->levels && !load->err; level++) {
+		struct load_level *at = load->level + level;
+		if (level == load->levels - 1) {
+			btree->root = (struct root){ .block = bufindex(at->buffer), .depth = load->levels };
+			mark_btree_dirty(btree);
+		} else if ((load->err = load_child(load, level + 1, at->key, bufindex(at->buffer))))
+			break;
+		brelse(at->buffer);
+		at->buffer = NULL;
+	}
+	if (load->err) {
+		/* every block loaded so far is held open below, or under one that is */
+		if (load->leafbuf)
+			load_free(btree, load->leafbuf, 0);
+		for (unsigned level = 0; level < BTREE_LOAD_LEVELS; level++)
+			if (load->level[level].buffer)
+				load_free(btree, load->level[level].buffer, level + 1);
+	}
+	return load->err;
+}
+
 void init_btree(struct btree *btree, struct sb *sb, struct root root, struct btree_ops *ops)
 {
 	btree->sb = sb;
@@ -37,8 +37,52 @@ int unpack_sb(struct sb *sb, struct disksuper *super, struct root *iroot, int si
 	sb->freeatom = from_be_u32(super->freeatom);
 	sb->dictsize = from_be_u64(super->dictsize);
 	sb->entries_per_bucket = (sb->blocksize - offsetof(struct bucket,entries)) / sizeof(struct bucket_entry);
+	sb->flags = from_be_u64(super->flags);
+	sb->fingerprint = from_be_u16(super->fingerprint);
+	if (sb->fingerprint >= FINGERPRINT_ENGINES) {
+		if (!silent)
+			printf("unknown fingerprint engine %u\n", sb->fingerprint);
+		return -EINVAL;
+	}
+	u64 bloom = from_be_u64(super->bloom);
+	sb->bloom = bloom & (~0ULL >> 16);
+	sb->bloombits = bloom >> 48;
+	if (sb->bloom && (sb->bloombits < sb->blockbits + 3 ||
+	    sb->bloom + (1 << (sb->bloombits - sb->blockbits - 3)) > sb->volblocks)) {
+		if (!silent)
+			printf("ignoring bad fingerprint filter [%Lx]\n", (L)bloom);
+		sb->bloom = sb->bloombits = 0;
+	}
+	sb->crctable = from_be_u64(super->crctable);
+	if (sb->crctable && sb->crctable + crctable_blocks(sb) > sb->volblocks) {
+		if (!silent)
+			printf("ignoring bad checksum table [%Lx]\n", (L)sb->crctable);
+		sb->crctable = 0;
+	}
+	sb->logindex = from_be_u64(super->logindex);
+	if ((sb->flags & SB_LOG_INDEX) && (!sb->logindex || sb->logindex >= sb->volblocks)) {
+		if (!silent)
+			printf("bad fingerprint log directory [%Lx]\n", (L)sb->logindex);
+		return -EINVAL;
+	}
+	sb->pendblock = from_be_u64(super->pending);
+	if (sb->pendblock >= sb->volblocks) {
+		if (!silent)
+			printf("ignoring bad pending extent chain [%Lx]\n", (L)sb->pendblock);
+		sb->pendblock = 0;
+	}
+	sb->deadblock = from_be_u64(super->dead);
+	if (sb->deadblock >= sb->volblocks) {
+		if (!silent)
+			printf("ignoring bad dead list [%Lx]\n", (L)sb->deadblock);
+		sb->deadblock = 0;
+	}
 	*iroot = unpack_root(iroot_val);
 	sb->htree.root = unpack_root(hroot_val);
+	sb->rtree.root = unpack_root(from_be_u64(super->rroot));
+	u64 *stat = (u64 *)&sb->dedupstat;
+	for (int i = 0; i < ARRAY_SIZE(super->dedupstat); i++)
+		stat[i] = from_be_u64(super->dedupstat[i]);
 
 	return 0;
 }
@@ -46,6 +90,8 @@ int unpack_sb(struct sb *sb, struct disksuper *super, struct root *iroot, int si
 void pack_sb(struct sb *sb, struct disksuper *super)
 {
 	super->blockbits = to_be_u16(sb->blockbits);
+	super->flags = to_be_u64(sb->flags);
+	super->fingerprint = to_be_u16(sb->fingerprint);
 	super->volblocks = to_be_u64(sb->volblocks);
 	super->freeblocks = to_be_u64(sb->freeblocks); // probably does not belong here
 	super->nextalloc = to_be_u64(sb->nextalloc); // probably does not belong here
@@ -54,4 +100,13 @@ void pack_sb(struct sb *sb, struct disksuper *super)
 	super->dictsize = to_be_u64(sb->dictsize); // probably does not belong here
 	super->iroot = to_be_u64(pack_root(&itable_btree(sb)->root));
 	super->hroot = to_be_u64(pack_root(&sb->htree.root));/*  DREAMZ  */	
+	super->bloom = to_be_u64((u64)sb->bloombits << 48 | sb->bloom);
+	super->rroot = to_be_u64(pack_root(&sb->rtree.root));
+	super->crctable = to_be_u64(sb->crctable);
+	super->logindex = to_be_u64(sb->logindex);
+	super->pending = to_be_u64(sb->pendblock);
+	super->dead = to_be_u64(sb->deadblock);
+	u64 *stat = (u64 *)&sb->dedupstat;
+	for (int i = 0; i < ARRAY_SIZE(super->dedupstat); i++)
+		super->dedupstat[i] = to_be_u64(stat[i]);
 }
@@ -1,25 +1,320 @@
 #include "tux3.h"
 #include <openssl/sha.h>
+#include <openssl/evp.h>
+#include <time.h>
+#include <stdarg.h>
 #ifdef trace
 #undef trace
 #endif
 #define trace trace_off
 
+/*
+ * Index leaves are keyed by the first 64 bits of the fingerprint.  On
+ * volumes made with SB_TAGGED_INDEX each entry also carries the next 32
+ * bits as a tag, and fingerprints that share a key get an entry each, kept
+ * together in one leaf and told apart by tag.  Only a clash on all 96 bits
+ * falls back to a collision bucket (slot == -1), which older volumes use
+ * for every shared key.
+ *
+ * Entries are packed big endian, 20 bytes: key, tag, then the bucket entry
+ * they point at as slot:16 and bucket:48, in the style of a diskextent.
+ * A slot of all ones points at a collision bucket.
+ */
 struct hleaf {
 	u16 magic;
 	u32 count;
-	struct hleaf_entry { u64 key; block_t block; int offset; }entries[];
+	struct hleaf_entry { be_u64 key; be_u32 tag; be_u64 where; } PACKED entries[];
 };
 
+#define HLEAF_MAGIC 0xdadf
+
+static inline u64 hentry_key(struct hleaf_entry *entry)
+{
+	return from_be_u64(entry->key);
+}
+
+static inline u32 hentry_tag(struct hleaf_entry *entry)
+{
+	return from_be_u32(entry->tag);
+}
+
+static inline block_t hentry_bucket(struct hleaf_entry *entry)
+{
+	return from_be_u64(entry->where) & ~(-1ULL << 48);
+}
+
+static inline int hentry_slot(struct hleaf_entry *entry)
+{
+	unsigned slot = from_be_u64(entry->where) >> 48;
+	return slot == 0xffff ? -1 : slot;
+}
+
+static inline void hentry_point(struct hleaf_entry *entry, block_t bucket, int slot)
+{
+	entry->where = to_be_u64((u64)(u16)slot << 48 | bucket);
+}
+
+static inline struct hleaf_entry make_hentry(u64 key, u32 tag, block_t bucket, int slot)
+{
+	struct hleaf_entry entry = { .key = to_be_u64(key), .tag = to_be_u32(tag) };
+	hentry_point(&entry, bucket, slot);
+	return entry;
+}
+
+/*
+ * Fingerprint engines
+ *
+ * The algorithm is chosen at mkfs and recorded in the superblock; volumes
+ * made before there was a choice have zero there and keep SHA-1.  Every
+ * engine produces FINGERPRINT_SIZE bytes, longer digests are truncated, so
+ * the index and bucket formats do not depend on the algorithm.
+ *
+ * A weak engine is a fast non-cryptographic hash for machines short of CPU.
+ * Its 64 bits go first, so they are the index key as they are, and the
+ * rest of the fingerprint is zero.  Different data can match, so on such
+ * volumes every match is compared byte for byte before it is shared, as
+ * for the verify dedup policy (see verify_dup() in filemap.c).
+ */
+
+static void sha1_fingerprint(const void *data, unsigned size, unsigned char *hash)
+{
+	SHA1(data, size, hash);
+}
+
+static void sha256_fingerprint(const void *data, unsigned size, unsigned char *hash)
+{
+	unsigned char digest[SHA256_DIGEST_LENGTH];
+	SHA256(data, size, digest);
+	memcpy(hash, digest, FINGERPRINT_SIZE);
+}
+
+static void blake2s_fingerprint(const void *data, unsigned size, unsigned char *hash)
+{
+	unsigned char digest[EVP_MAX_MD_SIZE];
+	if (!EVP_Digest(data, size, digest, NULL, EVP_blake2s256(), NULL))
+		error("blake2s digest failed");
+	memcpy(hash, digest, FINGERPRINT_SIZE);
+}
+
+#define XXH64_PRIME1 0x9e3779b185ebca87ULL
+#define XXH64_PRIME2 0xc2b2ae3d27d4eb4fULL
+#define XXH64_PRIME3 0x165667b19e3779f9ULL
+#define XXH64_PRIME4 0x85ebca77c2b2ae63ULL
+#define XXH64_PRIME5 0x27d4eb2f165667c5ULL
+
+static inline u64 rotl64(u64 x, unsigned bits)
+{
+	return x << bits | x >> (64 - bits);
+}
+
+/* Lanes are little endian, which the host is taken to be, as in tux3.h */
+static inline u64 xxh64_load(const unsigned char *p, unsigned bytes)
+{
+	u64 x = 0;
+	memcpy(&x, p, bytes);
+	return x;
+}
+
+static inline u64 xxh64_round(u64 acc, u64 input)
+{
+	return rotl64(acc + input * XXH64_PRIME2, 31) * XXH64_PRIME1;
+}
+
+static inline u64 xxh64_merge(u64 acc, u64 lane)
+{
+	return (acc ^ xxh64_round(0, lane)) * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+/* xxHash64 with seed zero */
+static u64 xxh64(const void *data, unsigned size)
+{
+	const unsigned char *p = data, *limit = p + size;
+	u64 h;
+
+	if (size >= 32) {
+		u64 v1 = XXH64_PRIME1 + XXH64_PRIME2, v2 = XXH64_PRIME2, v3 = 0, v4 = -XXH64_PRIME1;
+		for (; p + 32 <= limit; p += 32) {
+			v1 = xxh64_round(v1, xxh64_load(p, 8));
+			v2 = xxh64_round(v2, xxh64_load(p + 8, 8));
+			v3 = xxh64_round(v3, xxh64_load(p + 16, 8));
+			v4 = xxh64_round(v4, xxh64_load(p + 24, 8));
+		}
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = xxh64_merge(h, v1);
+		h = xxh64_merge(h, v2);
+		h = xxh64_merge(h, v3);
+		h = xxh64_merge(h, v4);
+	} else
+		h = XXH64_PRIME5;
+	h += size;
+	for (; p + 8 <= limit; p += 8)
+		h = rotl64(h ^ xxh64_round(0, xxh64_load(p, 8)), 27) * XXH64_PRIME1 + XXH64_PRIME4;
+	if (p + 4 <= limit) {
+		h = rotl64(h ^ xxh64_load(p, 4) * XXH64_PRIME1, 23) * XXH64_PRIME2 + XXH64_PRIME3;
+		p += 4;
+	}
+	for (; p < limit; p++)
+		h = rotl64(h ^ *p * XXH64_PRIME5, 11) * XXH64_PRIME1;
+	h ^= h >> 33;
+	h *= XXH64_PRIME2;
+	h ^= h >> 29;
+	h *= XXH64_PRIME3;
+	return h ^ h >> 32;
+}
+
+static void xxh64_fingerprint(const void *data, unsigned size, unsigned char *hash)
+{
+	u64 h = xxh64(data, size);
+	memset(hash, 0, FINGERPRINT_SIZE);
+	for (int i = 8; i--; h >>= 8)
+		hash[i] = h;
+}
+
+struct fingerprint_engine fingerprint_engines[] = {
+	[FINGERPRINT_SHA1] = { .name = "sha1", .hash = sha1_fingerprint },
+	[FINGERPRINT_SHA256] = { .name = "sha256", .hash = sha256_fingerprint },
+	[FINGERPRINT_BLAKE2S] = { .name = "blake2s", .hash = blake2s_fingerprint },
+	[FINGERPRINT_XXH64] = { .name = "xxh64", .hash = xxh64_fingerprint, .weak = 1 },
+};
+
+int fingerprint_engine(const char *name)
+{
+	for (int i = 0; i < FINGERPRINT_ENGINES; i++)
+		if (!strcmp(fingerprint_engines[i].name, name))
+			return i;
+	return -EINVAL;
+}
+
+/*
+ * Statistics
+ *
+ * Counters for each step of deduplication and histograms of how long the
+ * steps take, kept in the superblock so they add up over the life of the
+ * volume.  A step is timed by reading the clock on either side of it, once
+ * per batch where there is one, so this is cheap enough to leave on.  The
+ * report is shown by "tux3 dedupstat" and by the tux3.dedupstat attribute
+ * of the root directory under FUSE.
+ */
+
+static const char *dedup_counter_names[DEDUP_COUNTERS] = {
+	[DEDUP_LOOKUPS] = "lookups",
+	[DEDUP_BUCKET_HITS] = "bucket hits",
+	[DEDUP_CACHE_HITS] = "cache hits",
+	[DEDUP_HTREE_PROBES] = "htree probes",
+	[DEDUP_HTREE_HITS] = "htree hits",
+	[DEDUP_BUCKET_READS] = "bucket reads",
+	[DEDUP_COLLISIONS] = "collisions",
+	[DEDUP_NEW_BUCKETS] = "new buckets",
+	[DEDUP_SAVED] = "blocks saved",
+	[DEDUP_ZERO] = "zero blocks",
+};
+
+static const char *dedup_timer_names[DEDUP_TIMERS] = {
+	[DEDUP_TIME_HASH] = "hash",
+	[DEDUP_TIME_LOOKUP] = "lookup",
+	[DEDUP_TIME_BUCKET] = "bucket",
+	[DEDUP_TIME_HTREE] = "htree",
+};
+
+static u64 dedup_clock(void)
+{
+#ifdef __KERNEL__
+	return ktime_to_ns(ktime_get());
+#else
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+/* Count steps that took from start to now between them */
+static void dedup_time(struct sb *sb, unsigned timer, u64 start, unsigned steps)
+{
+	u64 ns = (dedup_clock() - start) / (steps ? steps : 1), limit = 1000;
+	unsigned slot = 0;
+	for (; ns >= limit && slot < DEDUP_TIME_SLOTS - 1; limit *= 4)
+		slot++;
+	sb->dedupstat.time[timer][slot] += steps;
+}
+
+static int show_more(char *buf, unsigned size, int len, const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	len += vsnprintf(len < size ? buf + len : NULL, len < size ? size - len : 0, fmt, args);
+	va_end(args);
+	return len;
+}
+
+/* Report into buf, returns the length the whole report needs */
+int dedupstat_show(struct sb *sb, char *buf, unsigned size)
+{
+	struct dedupstat *stat = &sb->dedupstat;
+	int len = 0;
+	for (int i = 0; i < DEDUP_COUNTERS; i++)
+		len = show_more(buf, size, len, "%-12s %Lu\n", dedup_counter_names[i], (L)stat->count[i]);
+	len = show_more(buf, size, len, "%-12s", "latency");
+	for (int i = 0, us = 1; i < DEDUP_TIME_SLOTS; i++, us *= 4)
+		len = i < DEDUP_TIME_SLOTS - 1 ?
+			show_more(buf, size, len, us < 1000 ? " <%ius" : " <%ims", us < 1000 ? us : us / 1000) :
+			show_more(buf, size, len, " more\n");
+	for (int i = 0; i < DEDUP_TIMERS; i++) {
+		len = show_more(buf, size, len, "%-12s", dedup_timer_names[i]);
+		for (int j = 0; j < DEDUP_TIME_SLOTS; j++)
+			len = show_more(buf, size, len, " %Lu", (L)stat->time[i][j]);
+		len = show_more(buf, size, len, "\n");
+	}
+	struct verifystat *verify = &sb->verifystat;
+	if (verify->compares)
+		len = show_more(buf, size, len, "%-12s %Lu compares, %Lu reads, %Lu mismatches\n", "verify",
+			(L)verify->compares, (L)verify->reads, (L)verify->mismatches);
+	return len;
+}
+
+/*
+ * Bucket entries are packed big endian, 28 bytes: the fingerprint, then the
+ * data block it names as slot:16 and block:48.  The slot is only used in
+ * collision buckets, where the block is the bucket holding the real entry
+ * and the slot is its place there.  Reference counts live in the rtree.
+ */
 struct bucket {
 	u16 count;
-	struct bucket_entry { 
-		unsigned char sha_hash[SHA_DIGEST_LENGTH];
-		block_t block;
-		int refcount;
-	}entries[];
+	u16 unused;
+	u32 next;	/* blocks on to the next bucket of the same stream, or zero */
+	struct bucket_entry {
+		unsigned char sha_hash[FINGERPRINT_SIZE];
+		be_u64 where;
+	} PACKED entries[];
 };
 
+static inline block_t bentry_block(struct bucket_entry *entry)
+{
+	return from_be_u64(entry->where) & ~(-1ULL << 48);
+}
+
+static inline int bentry_slot(struct bucket_entry *entry)
+{
+	return from_be_u64(entry->where) >> 48;
+}
+
+static inline void bentry_point(struct bucket_entry *entry, block_t block, int slot)
+{
+	entry->where = to_be_u64((u64)slot << 48 | block);
+}
+
+static inline void bentry_set(struct bucket_entry *entry, unsigned char *hash, block_t block, int slot)
+{
+	memcpy(entry->sha_hash, hash, FINGERPRINT_SIZE);
+	bentry_point(entry, block, slot);
+}
+
+/* Read a bucket on behalf of a lookup */
+static struct buffer_head *bucket_read(struct sb *sb, block_t bucket)
+{
+	sb->dedupstat.count[DEDUP_BUCKET_READS]++;
+	return sb_bread(sb, bucket);
+}
+
 static inline struct hleaf *to_hleaf(vleaf *leaf)
 {
 	return leaf;
@@ -27,7 +322,7 @@ static inline struct hleaf *to_hleaf(vleaf *leaf)
 
 int hleaf_init(struct btree *btree,vleaf *leaf)
 {
-	*to_hleaf(leaf) = (struct hleaf){ .count = 0 , .magic = 0xdade };
+	*to_hleaf(leaf) = (struct hleaf){ .count = 0 , .magic = HLEAF_MAGIC };
 	return 0;
 }
 
@@ -41,22 +336,31 @@ static void hleaf_btree_init(struct btree *btree)
 
 int hleaf_sniff(struct btree *btree, vleaf *leaf)
 {
-	return to_hleaf(leaf)->magic == 0xdade;
+	return to_hleaf(leaf)->magic == HLEAF_MAGIC;
 }
 
 tuxkey_t hleaf_split(struct btree *btree, tuxkey_t key, vleaf *from, vleaf *into)
 {
 	assert(hleaf_sniff(btree, from));
 	struct hleaf *leaf = from;
+	struct hleaf_entry *entries = leaf->entries;
 	unsigned at = leaf->count / 2;
-	if (leaf->count && key > leaf->entries[leaf->count - 1].key)
+	if (leaf->count && key > hentry_key(entries + leaf->count - 1))
 		at = leaf->count;
+	/* lookups only search one leaf, so never split a run of equal keys */
+	while (at && at < leaf->count && entries[at - 1].key == entries[at].key)
+		at--;
+	if (!at && leaf->count) {
+		at = max(leaf->count / 2, 1U);
+		while (at < leaf->count && entries[at - 1].key == entries[at].key)
+			at++;
+	}
 	unsigned tail = leaf->count - at;
 	hleaf_init(btree, into);
 	veccopy(to_hleaf(into)->entries, leaf->entries + at, tail);
 	to_hleaf(into)->count = tail;
 	leaf->count = at;
-	return tail ? to_hleaf(into)->entries[0].key : key;
+	return tail ? hentry_key(to_hleaf(into)->entries) : key;
 }
 
 unsigned hleaf_free(struct btree *btree, vleaf *leaf)
@@ -64,12 +368,26 @@ unsigned hleaf_free(struct btree *btree, vleaf *leaf)
 	return btree->entries_per_leaf - to_hleaf(leaf)->count;
 }
 
+/*
+ * Keys are fingerprint prefixes and so spread evenly over the key space: a
+ * single interpolated guess lands within a few entries of the slot, and a
+ * short walk from there is cheaper than bisecting down to it.
+ */
 unsigned hleaf_seek(struct btree *btree, tuxkey_t key, struct hleaf *leaf)
 {
-	unsigned at = 0;
-	while (at < leaf->count && leaf->entries[at].key < key)
+	struct hleaf_entry *entries = leaf->entries;
+	unsigned count = leaf->count;
+	if (!count || key <= hentry_key(entries))
+		return 0;
+	u64 first = hentry_key(entries), last = hentry_key(entries + count - 1);
+	if (key > last)
+		return count;
+	unsigned at = interpolate(key, first, last, 0, count - 1);
+	while (hentry_key(entries + at) >= key)
+		at--;
+	while (hentry_key(entries + at + 1) < key)
 		at++;
-	return at;
+	return at + 1;
 }
 
 void *hleaf_resize(struct btree *btree, tuxkey_t key, vleaf *data, unsigned one)
@@ -77,7 +395,11 @@ void *hleaf_resize(struct btree *btree, tuxkey_t key, vleaf *data, unsigned one)
 	assert(hleaf_sniff(btree, data));
 	struct hleaf *leaf = data;
 	unsigned at = hleaf_seek(btree, key, leaf);
-	if (at < leaf->count && leaf->entries[at].key == key)
+	if (btree->sb->flags & SB_TAGGED_INDEX) {
+		/* a new entry goes after any others with the same key */
+		while (at < leaf->count && hentry_key(leaf->entries + at) == key)
+			at++;
+	} else if (at < leaf->count && hentry_key(leaf->entries + at) == key)
 		goto out;
 	if (hleaf_free(btree, leaf) < one)
 		return NULL;
@@ -91,84 +413,1560 @@ void hleaf_dump(struct btree *btree, vleaf *data)
 	struct hleaf *leaf = data;
 	struct hleaf_entry *entry, *limit = leaf->entries + leaf->count;
 	for (entry = leaf->entries; entry < limit; entry++) {
-		printf(" %llu", entry->key); 
-		printf(" %llu", entry->block);
+		printf(" %llu", (L)hentry_key(entry));
+		printf(" %llu", (L)hentry_bucket(entry));
+		printf(" %x", hentry_tag(entry));
 	}
 	trace(" (%x free)\n", hleaf_free(btree, leaf));
 }
 
-block_t bucket_lookup(struct inode *inode, unsigned char *hash)
+/*
+ * Reference counts
+ *
+ * Counting a duplicate hit in its bucket entry would dirty a whole bucket
+ * block for every shared block written.  Instead counts live in their own
+ * btree, the rtree, keyed by data block.  It only records the extra
+ * references of shared blocks: a block that is not in it has the single
+ * reference of the write that made it, so unique data never touches it.
+ *
+ * Changes are not applied as they happen either.  They are collected in
+ * memory as (block, delta) pairs and folded into the rtree in one sorted
+ * sweep when the volume is synced, so a block shared many times between
+ * syncs costs one leaf update.  The pairs are hashed by block as they are
+ * added, so a block changed again adds to its pair, and a count is looked
+ * up without searching them all.
+ */
+
+#define REFDELTA_SIZE 4096
+#define REFDELTA_HASH_BITS 13	/* twice the slots of REFDELTA_SIZE */
+
+struct rleaf {
+	u16 magic;
+	u32 count;
+	struct rleaf_entry { block_t block; u32 refs; } entries[];
+};
+
+struct refdelta {
+	unsigned count, size;
+	unsigned folds;		/* times folded into the rtree */
+	u16 hash[1 << REFDELTA_HASH_BITS]; /* entry number + 1 by block, or zero */
+	struct refdelta_entry { block_t block; int delta; } entries[];
+};
+
+static int rleaf_init(struct btree *btree, vleaf *leaf)
+{
+	*(struct rleaf *)leaf = (struct rleaf){ .magic = 0x4efc };
+	return 0;
+}
+
+static void rleaf_btree_init(struct btree *btree)
 {
-	int k;
-	struct bucket_entry *entry;
-	block_t block;
-	if(inode->refbucket == 0)
-		return -1;
-	trace("In reference bucket %Lx",(L)inode->refbucket);
-	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->refbucket); 
-	struct bucket *bck = (struct bucket *)bufdata(buffer);
-	for (int i = 0;i < bck->count;i++) {
-		entry = bck->entries + i;
-		for(k = 0;k < 20;k++) {
-			if (hash[k] == entry->sha_hash[k])
-				continue;
-			else 
+	struct sb *sb = btree->sb;
+	btree->entries_per_leaf = (sb->blocksize - offsetof(struct rleaf, entries)) / sizeof(struct rleaf_entry);
+}
+
+static int rleaf_sniff(struct btree *btree, vleaf *leaf)
+{
+	return ((struct rleaf *)leaf)->magic == 0x4efc;
+}
+
+/* Data blocks are handed out in ascending order, keep appends packed */
+static tuxkey_t rleaf_split(struct btree *btree, tuxkey_t key, vleaf *from, vleaf *into)
+{
+	assert(rleaf_sniff(btree, from));
+	struct rleaf *leaf = from, *dest = into;
+	unsigned at = leaf->count / 2;
+	if (leaf->count && key > leaf->entries[leaf->count - 1].block)
+		at = leaf->count;
+	unsigned tail = leaf->count - at;
+	rleaf_init(btree, into);
+	veccopy(dest->entries, leaf->entries + at, tail);
+	dest->count = tail;
+	leaf->count = at;
+	return tail ? dest->entries[0].block : key;
+}
+
+static unsigned rleaf_free(struct btree *btree, vleaf *leaf)
+{
+	return btree->entries_per_leaf - ((struct rleaf *)leaf)->count;
+}
+
+static unsigned rleaf_seek(struct rleaf *leaf, block_t block)
+{
+	unsigned lo = 0, hi = leaf->count;
+	while (lo < hi) {
+		unsigned mid = (lo + hi) / 2;
+		if (leaf->entries[mid].block < block)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* New entries start with no extra references */
+static void *rleaf_resize(struct btree *btree, tuxkey_t key, vleaf *data, unsigned one)
+{
+	assert(rleaf_sniff(btree, data));
+	struct rleaf *leaf = data;
+	unsigned at = rleaf_seek(leaf, key);
+	if (at < leaf->count && leaf->entries[at].block == key)
+		return leaf->entries + at;
+	if (rleaf_free(btree, leaf) < one)
+		return NULL;
+	vecmove(leaf->entries + at + one, leaf->entries + at, leaf->count++ - at);
+	leaf->entries[at] = (struct rleaf_entry){ .block = key };
+	return leaf->entries + at;
+}
+
+static void rleaf_dump(struct btree *btree, vleaf *data)
+{
+	struct rleaf *leaf = data;
+	for (unsigned i = 0; i < leaf->count; i++)
+		printf(" %Lx+%u", (L)leaf->entries[i].block, leaf->entries[i].refs);
+	printf("\n");
+}
+
+struct btree_ops rtree_ops = {
+	.btree_init = rleaf_btree_init,
+	.leaf_init = rleaf_init,
+	.leaf_split = rleaf_split,
+	.leaf_resize = rleaf_resize,
+	.leaf_sniff = rleaf_sniff,
+	.leaf_free = rleaf_free,
+	.leaf_dump = rleaf_dump,
+	.balloc = balloc,
+	.search = SEARCH_BINARY,
+};
+
+static int refdelta_cmp(const void *a, const void *b)
+{
+	block_t x = ((struct refdelta_entry *)a)->block, y = ((struct refdelta_entry *)b)->block;
+	return x < y ? -1 : x > y;
+}
+
+/* Hash slot of a block's pending change, or of the free slot it would take */
+static u16 *refdelta_slot(struct refdelta *refdelta, block_t block)
+{
+	unsigned mask = (1 << REFDELTA_HASH_BITS) - 1;
+	unsigned i = (block * 0x9e3779b97f4a7c15ULL) >> (64 - REFDELTA_HASH_BITS);
+	while (refdelta->hash[i] && refdelta->entries[refdelta->hash[i] - 1].block != block)
+		i = (i + 1) & mask;
+	return refdelta->hash + i;
+}
+
+static int refdelta_get(struct sb *sb, block_t block)
+{
+	struct refdelta *refdelta = sb->refdelta;
+	if (!refdelta || !refdelta->count)
+		return 0;
+	u16 *slot = refdelta_slot(refdelta, block);
+	return *slot ? refdelta->entries[*slot - 1].delta : 0;
+}
+
+/* Sort the pending changes, dropping the ones that came to nothing */
+static void refdelta_merge(struct refdelta *refdelta)
+{
+	struct refdelta_entry *entries = refdelta->entries;
+	unsigned count = 0;
+	qsort(entries, refdelta->count, sizeof(*entries), refdelta_cmp);
+	for (unsigned i = 0; i < refdelta->count; i++)
+		if (entries[i].delta)
+			entries[count++] = entries[i];
+	refdelta->count = count;
+	memset(refdelta->hash, 0, sizeof(refdelta->hash));
+	for (unsigned i = 0; i < count; i++)
+		*refdelta_slot(refdelta, entries[i].block) = i + 1;
+}
+
+/* Apply the pending reference count changes to the rtree */
+int fold_refcounts(struct sb *sb)
+{
+	struct refdelta *refdelta = sb->refdelta;
+	struct btree *btree = &sb->rtree;
+	int err = 0;
+	if (!refdelta || !refdelta->count)
+		return 0;
+	refdelta_merge(refdelta);
+	if (!refdelta->count)
+		return 0;
+	/* volumes made before the rtree get one when first needed */
+	if (!btree->root.depth && (err = new_btree(btree, sb, &rtree_ops)))
+		return err;
+	struct cursor *cursor = alloc_cursor(btree, 8);
+	if (!cursor)
+		return -ENOMEM;
+	down_write(&btree->lock);
+	for (unsigned i = 0; i < refdelta->count; i++) {
+		struct refdelta_entry *change = refdelta->entries + i;
+		if ((err = probe_forward(btree, change->block, cursor)))
+			break;
+		struct buffer_head *leafbuf = cursor_leafbuf(cursor);
+		struct rleaf *leaf = bufdata(leafbuf);
+		if (change->delta > 0) {
+			struct rleaf_entry *entry = tree_expand(btree, change->block, 1, cursor);
+			if (!entry) {
+				err = -ENOMEM;
 				break;
+			}
+			entry->refs += change->delta;
+			mark_buffer_dirty(cursor_leafbuf(cursor));
+			continue;
 		}
-		
-		if(k == 20) {
-			entry->refcount++;
-			block = entry->block;
-			trace("Found block %Lx",(L)block);
-			brelse_dirty(buffer);
-			return block;
+		unsigned at = rleaf_seek(leaf, change->block);
+		struct rleaf_entry *entry = leaf->entries + at;
+		int refs = at < leaf->count && entry->block == change->block ? entry->refs : 0;
+		if (refs + change->delta < 0) {
+			warn("block %Lx dropped %i references, has %i", (L)change->block, -change->delta, refs);
+			change->delta = -refs;
+		}
+		if (!refs)
+			continue;
+		if ((entry->refs += change->delta) == 0)
+			vecmove(entry, entry + 1, --leaf->count - at);
+		mark_buffer_dirty(leafbuf);
+	}
+	release_cursor(cursor);
+	up_write(&btree->lock);
+	free_cursor(cursor);
+	if (!err) {
+		refdelta->count = 0;
+		refdelta->folds++;
+		memset(refdelta->hash, 0, sizeof(refdelta->hash));
+	}
+	return err;
+}
+
+/*
+ * Blocks that lost their last reference but may still be named by bucket
+ * entries, see dedup_free().  Kept as a plain array, sorted when searched,
+ * and written out at each sync it changed, see dead_flush().
+ */
+
+#define DEADLIST_MIN 1024
+
+struct deadlist {
+	unsigned count, size, sorted, dirty;
+	block_t blocks[];
+};
+
+static int block_cmp(const void *a, const void *b)
+{
+	block_t x = *(block_t *)a, y = *(block_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static block_t *dead_find(struct sb *sb, block_t block)
+{
+	struct deadlist *dead = sb->dead;
+	if (!dead || !dead->count)
+		return NULL;
+	if (!dead->sorted) {
+		qsort(dead->blocks, dead->count, sizeof(*dead->blocks), block_cmp);
+		dead->sorted = 1;
+	}
+	return bsearch(&block, dead->blocks, dead->count, sizeof(*dead->blocks), block_cmp);
+}
+
+static int dead_add(struct sb *sb, block_t start, unsigned blocks)
+{
+	struct deadlist *dead = sb->dead;
+	unsigned count = dead ? dead->count : 0;
+	if (!blocks)
+		return 0;
+	if (!dead || count + blocks > dead->size) {
+		unsigned size = dead ? dead->size : DEADLIST_MIN;
+		while (size < count + blocks)
+			size *= 2;
+		if (!(dead = realloc(dead, sizeof(*dead) + size * sizeof(*dead->blocks))))
+			return -ENOMEM;
+		dead->count = count;
+		dead->size = size;
+		sb->dead = dead;
+	}
+	for (unsigned i = 0; i < blocks; i++)
+		dead->blocks[dead->count++] = start + i;
+	dead->sorted = 0;
+	dead->dirty = 1;
+	return 0;
+}
+
+/* Count a reference to a data block gained, or lost if delta is negative */
+void dedup_ref(struct sb *sb, block_t block, int delta)
+{
+	struct refdelta *refdelta = sb->refdelta;
+	if (delta > 0)
+		sb->dedupstat.count[DEDUP_SAVED] += delta;
+	/* a dead block found by a lookup is back to its one reference */
+	block_t *dead = delta > 0 ? dead_find(sb, block) : NULL;
+	if (dead) {
+		vecmove(dead, dead + 1, sb->dead->blocks + --sb->dead->count - dead);
+		sb->dead->dirty = 1;
+		if (!--delta)
+			return;
+	}
+	if (!refdelta) {
+		refdelta = malloc(sizeof(*refdelta) + REFDELTA_SIZE * sizeof(*refdelta->entries));
+		if (!refdelta) {
+			warn("no memory to count a reference to block %Lx", (L)block);
+			return;
+		}
+		*refdelta = (struct refdelta){ .size = REFDELTA_SIZE };
+		sb->refdelta = refdelta;
+	}
+	u16 *slot = refdelta_slot(refdelta, block);
+	if (*slot) {
+		refdelta->entries[*slot - 1].delta += delta;
+		return;
+	}
+	if (refdelta->count == refdelta->size) {
+		refdelta_merge(refdelta);
+		/* mostly different blocks, fold them early */
+		if (refdelta->count > refdelta->size / 2 && fold_refcounts(sb)) {
+			warn("unable to count a reference to block %Lx", (L)block);
+			return;
+		}
+		slot = refdelta_slot(refdelta, block);
+	}
+	refdelta->entries[refdelta->count++] = (struct refdelta_entry){ .block = block, .delta = delta };
+	*slot = refdelta->count;
+}
+
+/* Number of references to a data block, including changes not yet folded */
+int dedup_refs(struct sb *sb, block_t block)
+{
+	struct btree *btree = &sb->rtree;
+	int refs = 1 + refdelta_get(sb, block);
+	if (dead_find(sb, block))
+		return 0;
+	if (!btree->root.depth)
+		return refs;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -ENOMEM;
+	down_read(&btree->lock);
+	if (!probe(btree, block, cursor)) {
+		struct rleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		unsigned at = rleaf_seek(leaf, block);
+		if (at < leaf->count && leaf->entries[at].block == block)
+			refs += leaf->entries[at].refs;
+		release_cursor(cursor);
+	}
+	up_read(&btree->lock);
+	free_cursor(cursor);
+	return refs;
+}
+
+/*
+ * Freeing shared blocks
+ *
+ * Truncate and delete free data blocks through here rather than straight
+ * through bfree().  A block with extra references just loses one.  A block
+ * losing its last reference cannot be freed yet, because its bucket entry
+ * and htree key may still point at it and nothing maps blocks back to
+ * fingerprints.  So it goes on the dead list, and dedup_gc() takes out its
+ * index entries before the block is really freed.  Until then it keeps its
+ * data, and a write that duplicates it brings it back to life.  Files none
+ * of whose data can be indexed skip all this, see dtree_unindexed_ops.
+ *
+ * Only shared blocks are in the rtree, so an extent being freed usually
+ * has few entries there or none.  They are read a batch at a time from
+ * one probe, not looked up block by block.
+ */
+
+#define FREE_BATCH 64
+
+/* Read up to max rtree entries for blocks from start up to end */
+static int rtree_gather(struct sb *sb, block_t start, block_t end, struct rleaf_entry *found, unsigned max)
+{
+	struct btree *btree = &sb->rtree;
+	unsigned count = 0;
+	int err;
+	if (!btree->root.depth)
+		return 0;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -ENOMEM;
+	down_read(&btree->lock);
+	if ((err = probe(btree, start, cursor)))
+		goto out;
+	do {
+		struct rleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		unsigned at = rleaf_seek(leaf, start);
+		while (at < leaf->count && leaf->entries[at].block < end && count < max)
+			found[count++] = leaf->entries[at++];
+		if (at < leaf->count)
+			break;
+	} while (count < max && (err = advance(btree, cursor)) > 0);
+	release_cursor(cursor);
+out:
+	up_read(&btree->lock);
+	free_cursor(cursor);
+	return err < 0 ? err : count;
+}
+
+int dedup_free(struct sb *sb, block_t start, unsigned blocks)
+{
+	struct rleaf_entry shared[FREE_BATCH];
+	block_t end = start + blocks, known = start;
+	unsigned run = 0, have = 0, next = 0;
+	int err;
+	for (block_t block = start; block < end; block++) {
+		/* rtree entries below known are in shared[] */
+		if (block >= known) {
+			int got = rtree_gather(sb, block, end, shared, FREE_BATCH);
+			if (got < 0)
+				return got;
+			known = got < FREE_BATCH ? end : shared[got - 1].block + 1;
+			have = got;
+			next = 0;
+		}
+		int refs = 1 + refdelta_get(sb, block);
+		if (next < have && shared[next].block == block)
+			refs += shared[next++].refs;
+		if (dead_find(sb, block))
+			refs = 0;
+		if (refs == 1) {
+			run++;
+			continue;
+		}
+		if ((err = dead_add(sb, block - run, run)))
+			return err;
+		run = 0;
+		if (!refs) {
+			warn("block %Lx freed twice", (L)block);
+			continue;
+		}
+		unsigned folds = sb->refdelta ? sb->refdelta->folds : 0;
+		dedup_ref(sb, block, -1);
+		/* folded into the rtree, so what was read of it is stale */
+		if (sb->refdelta && sb->refdelta->folds != folds)
+			known = block + 1;
+	}
+	return dead_add(sb, end - run, run);
+}
+
+/*
+ * Bucket locality
+ *
+ * Buckets fill up in the order a stream writes new data, so a stream that
+ * repeats an earlier one meets its fingerprints bucket after bucket.  Each
+ * inode remembers the REFBUCKETS buckets it hit last, most recent first,
+ * and each bucket records where the next bucket of the stream that wrote
+ * it was allocated.  A fingerprint is looked for in the recent buckets and
+ * then down the chain from the most recent one before the htree is probed.
+ * An htree hit reads the chain ahead, so the buckets the stream comes to
+ * next are already cached; as lookups move down the chain the htree is
+ * only needed again where the two streams part.
+ */
+
+#define BUCKET_READAHEAD 4
+
+/*
+ * The bucket a stream wrote after this one, or zero.  A chain is only a
+ * hint: should a link point at a block that no longer holds a bucket, the
+ * chain ends there rather than reading whatever is in it.
+ */
+static block_t bucket_next(struct sb *sb, block_t bucket, struct bucket *bck)
+{
+	if (!bck->next || bck->count > sb->entries_per_bucket || bck->next >= sb->volblocks - bucket)
+		return 0;
+	return bucket + bck->next;
+}
+
+/* Slot of a fingerprint in a bucket or -1, and the bucket after it */
+static int bucket_find(struct sb *sb, block_t bucket, unsigned char *hash, block_t *block, block_t *next)
+{
+	struct buffer_head *buffer = bucket_read(sb, bucket);
+	int slot = -1;
+	if (!buffer)
+		return -1;
+	struct bucket *bck = bufdata(buffer);
+	unsigned count = min(bck->count, sb->entries_per_bucket);
+	for (unsigned i = 0; i < count; i++) {
+		if (!memcmp(hash, bck->entries[i].sha_hash, FINGERPRINT_SIZE)) {
+			*block = bentry_block(bck->entries + i);
+			slot = i;
+			break;
 		}
-		
-	}      
+	}
+	if (next)
+		*next = bucket_next(sb, bucket, bck);
 	brelse(buffer);
-	trace("Not found in reference bucket %Lx", (L)inode->refbucket);
+	return slot;
+}
+
+/* Make bucket the most recent read bucket, dropping the oldest if full */
+static void refbucket_hit(struct inode *inode, block_t bucket)
+{
+	block_t *recent = inode->refbucket;
+	unsigned at = 0;
+	while (at < REFBUCKETS - 1 && recent[at] && recent[at] != bucket)
+		at++;
+	vecmove(recent + 1, recent, at);
+	recent[0] = bucket;
+}
+
+/* Bring the buckets a stream wrote after this one into the cache */
+static void bucket_readahead(struct sb *sb, block_t bucket)
+{
+	for (int i = 0; i < BUCKET_READAHEAD && bucket; i++) {
+		struct buffer_head *buffer = bucket_read(sb, bucket);
+		if (!buffer)
+			return;
+		block_t next = bucket_next(sb, bucket, bufdata(buffer));
+		brelse(buffer);
+		bucket = next;
+	}
+}
+
+/* Find a fingerprint near the last hits, without taking a reference */
+static block_t locality_locate(struct inode *inode, unsigned char *hash, block_t *bucket, int *slot)
+{
+	struct sb *sb = inode->i_sb;
+	block_t *recent = inode->refbucket, block, next = 0;
+	u64 start = dedup_clock();
+	for (int i = 0; i < REFBUCKETS && recent[i]; i++) {
+		if ((*slot = bucket_find(sb, recent[i], hash, &block, i ? NULL : &next)) != -1) {
+			*bucket = recent[i];
+			goto found;
+		}
+	}
+	for (int i = 0; i < BUCKET_READAHEAD && next; i++) {
+		*bucket = next;
+		if ((*slot = bucket_find(sb, *bucket, hash, &block, &next)) != -1)
+			goto found;
+	}
+	dedup_time(sb, DEDUP_TIME_BUCKET, start, 1);
 	return -1;
+found:
+	trace("Found block %Lx in bucket %Lx", (L)block, (L)*bucket);
+	refbucket_hit(inode, *bucket);
+	sb->dedupstat.count[DEDUP_BUCKET_HITS]++;
+	dedup_time(sb, DEDUP_TIME_BUCKET, start, 1);
+	return block;
 }
 
-void make_hash_entry(struct inode *inode, unsigned char *hash, block_t block)
+/* Returns the slot of the new entry in the writebucket */
+int make_hash_entry(struct inode *inode, unsigned char *hash, block_t block)
 {
 	trace("Making hash entry for block %Lx in writebucket %Lx", (L)block, (L)inode->writebucket);
 	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->writebucket);
 	struct bucket *bck = (struct bucket *)bufdata(buffer);
-	struct bucket_entry *entry;
-	entry = bck->entries + bck->count ;
- 	entry->refcount = 1; 
- 	entry->block = block; 
-	memcpy(entry->sha_hash,hash,SHA_DIGEST_LENGTH); 
-	bck->count ++; 
+	bentry_set(bck->entries + bck->count, hash, block, 0);
+	int slot = bck->count++;
 	brelse_dirty(buffer);
+	return slot;
 }
 
 void init_writebucket(struct inode *inode)
 {
-	int err = inode->btree.ops->balloc(inode->i_sb, 1, &inode->writebucket);
+	block_t last = inode->writebucket;
+	int err = stream_balloc(inode, 1, &inode->writebucket);
 	if(err){
 		warn("Failed to initialize write bucket");
 		exit(1);
 	}
 	trace("Initialised new write bucket %Lx", (L)inode->writebucket);
+	inode->i_sb->dedupstat.count[DEDUP_NEW_BUCKETS]++;
 	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->writebucket);
 	memset(bufdata(buffer), 0, bufsize(buffer));
 	struct bucket *bck = (struct bucket *)bufdata(buffer);
 	bck->count = 0;
 	brelse_dirty(buffer);
+	/* link the stream's buckets, see bucket_readahead() */
+	if (last && inode->writebucket > last && inode->writebucket - last <= (u32)~0) {
+		if ((buffer = sb_bread(inode->i_sb, last))) {
+			((struct bucket *)bufdata(buffer))->next = inode->writebucket - last;
+			brelse_dirty(buffer);
+		}
+	}
 }
 
-block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct hleaf_entry* temp ,unsigned char* hash, int first)
+/* Forget the buckets an inode was using if the collector has moved them */
+static void bucket_check(struct inode *inode)
+{
+	struct sb *sb = inode->i_sb;
+	if (inode->bucketgen != sb->bucketgen) {
+		memset(inode->refbucket, 0, sizeof(inode->refbucket));
+		inode->writebucket = 0;
+		inode->bucketgen = sb->bucketgen;
+	}
+}
+
+/* Slot the next new fingerprint gets, starting a new writebucket if full */
+static u16 writebucket_slot(struct inode *inode)
+{
+	if (inode->writebucket == 0)
+		init_writebucket(inode);
+	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->writebucket);
+	u16 count = ((struct bucket *)bufdata(buffer))->count;
+	brelse(buffer);
+	if (count >= inode->i_sb->entries_per_bucket) {
+		init_writebucket(inode);
+		count = 0;
+	}
+	return count;
+}
+
+/*
+ * Fingerprint cache
+ *
+ * Remembers where recently seen fingerprints live, by htree key, so that a
+ * repeat can go straight to its bucket entry without probing the htree.
+ * The cache is shared by all inodes and bounded: it is set associative,
+ * each key can only live in one small set and replacement happens within
+ * that set.  New entries come in cold and only warm up when they are hit
+ * again, and a victim is always taken from the cold entries of a set if it
+ * has any, so a long run of unique data churns through the cold entries
+ * without pushing out the fingerprints that keep repeating.
+ *
+ * Only entries that point at a single bucket slot are cached, a key that
+ * goes to a collision bucket is dropped from the cache.  A hit is just a
+ * hint, the full fingerprint in the bucket entry is still compared.
+ */
+
+#define FPCACHE_SETS (1 << 13)
+#define FPCACHE_WAYS 8
+#define FPCACHE_HOT 3
+
+struct fpcache {
+	unsigned hits, misses;
+	struct fpcache_entry {
+		u64 key;
+		block_t bucket; /* zero if empty */
+		int offset;
+		unsigned hot;
+	} entries[FPCACHE_SETS][FPCACHE_WAYS];
+};
+
+static u64 fingerprint_key(unsigned char *hash)
+{
+	u64 key = 0;
+	for (int i = 0; i < 8; i++)
+		key = (key << 8) | hash[i];
+	return key;
+}
+
+static u32 fingerprint_tag(unsigned char *hash)
+{
+	return hash[8] << 24 | hash[9] << 16 | hash[10] << 8 | hash[11];
+}
+
+static struct fpcache_entry *fpcache_set(struct sb *sb, u64 key)
+{
+	if (!sb->fpcache && !(sb->fpcache = calloc(1, sizeof(struct fpcache))))
+		return NULL;
+	return sb->fpcache->entries[key % FPCACHE_SETS];
+}
+
+static struct fpcache_entry *fpcache_find(struct sb *sb, u64 key)
+{
+	struct fpcache_entry *set = fpcache_set(sb, key);
+	if (set)
+		for (int i = 0; i < FPCACHE_WAYS; i++)
+			if (set[i].bucket && set[i].key == key)
+				return set + i;
+	return NULL;
+}
+
+static void fpcache_insert(struct sb *sb, u64 key, block_t bucket, int offset)
+{
+	struct fpcache_entry *set = fpcache_set(sb, key), *victim = NULL;
+	if (!set)
+		return;
+	for (int i = 0; i < FPCACHE_WAYS && !victim; i++)
+		if (!set[i].bucket || set[i].key == key)
+			victim = set + i;
+	while (!victim) {
+		for (int i = 0; i < FPCACHE_WAYS; i++) {
+			if (!set[i].hot) {
+				victim = set + i;
+				break;
+			}
+		}
+		if (!victim)
+			for (int i = 0; i < FPCACHE_WAYS; i++)
+				set[i].hot--;
+	}
+	*victim = (struct fpcache_entry){ .key = key, .bucket = bucket, .offset = offset };
+}
+
+static void fpcache_forget(struct sb *sb, u64 key)
+{
+	struct fpcache_entry *entry = fpcache_find(sb, key);
+	if (entry)
+		entry->bucket = 0;
+}
+
+/* Find where a cached fingerprint lives, without taking a reference */
+static block_t fpcache_locate(struct sb *sb, unsigned char *hash, block_t *bucket, int *slot)
+{
+	struct fpcache_entry *cached = fpcache_find(sb, fingerprint_key(hash));
+	if (!cached) {
+		if (sb->fpcache)
+			sb->fpcache->misses++;
+		return -1;
+	}
+	struct buffer_head *buffer = bucket_read(sb, cached->bucket);
+	if (!buffer)
+		return -1;
+	struct bucket *bck = bufdata(buffer);
+	struct bucket_entry *entry = bck->entries + cached->offset;
+	if (cached->offset >= bck->count || memcmp(hash, entry->sha_hash, FINGERPRINT_SIZE)) {
+		brelse(buffer);
+		sb->fpcache->misses++;
+		return -1;
+	}
+	block_t block = bentry_block(entry);
+	*bucket = cached->bucket;
+	*slot = cached->offset;
+	if (cached->hot < FPCACHE_HOT)
+		cached->hot++;
+	sb->fpcache->hits++;
+	sb->dedupstat.count[DEDUP_CACHE_HITS]++;
+	trace("Found block %Lx in fingerprint cache", (L)block);
+	brelse(buffer);
+	return block;
+}
+
+/*
+ * Fingerprint summary
+ *
+ * A Bloom filter over every key in the htree, kept in a contiguous run of
+ * volume blocks that is allocated at mkfs and cached like any other
+ * metadata, so it is loaded on demand and written out with the volmap.  All
+ * probes for one key land in the same filter block, chosen by the top bits
+ * of the key, so a test costs one buffer lookup.  A definite miss skips the
+ * reference bucket and the fingerprint cache and goes straight to the htree
+ * insert.  The htree is still the authority: a stale filter after a crash
+ * only costs those shortcuts, never a wrong answer.
+ *
+ * Keys are never removed, so the false positive rate creeps up as the
+ * index churns; "tux3 bloom" clears the filter and refills it from the
+ * htree, optionally at a new size.
+ */
+
+#define BLOOM_PROBES 4
+
+/* The filter of 2^bits bits at base is also used for fingerprint log runs */
+static struct buffer_head *bloom_buffer(struct sb *sb, block_t base, unsigned bits, u64 key, u32 *bit, u32 *step)
+{
+	unsigned shift = sb->blockbits + 3, order = bits - shift;
+	block_t block = base + (order ? (key * 0x9e3779b97f4a7c15ULL) >> (64 - order) : 0);
+	*bit = key;
+	*step = (key >> 32) | 1;
+	return sb_bread(sb, block);
+}
+
+/* Zero if key is certainly not in the filter */
+static int bloom_probe(struct sb *sb, block_t base, unsigned bits, u64 key)
+{
+	u32 bit, step, mask = (1 << (sb->blockbits + 3)) - 1;
+	struct buffer_head *buffer = bloom_buffer(sb, base, bits, key, &bit, &step);
+	if (!buffer)
+		return 1;
+	unsigned char *map = bufdata(buffer);
+	int maybe = 1;
+	for (int i = 0; i < BLOOM_PROBES && maybe; i++, bit += step)
+		maybe = map[(bit & mask) >> 3] & (1 << (bit & 7));
+	brelse(buffer);
+	return !!maybe;
+}
+
+static int bloom_set(struct sb *sb, block_t base, unsigned bits, u64 key)
+{
+	u32 bit, step, mask = (1 << (sb->blockbits + 3)) - 1;
+	struct buffer_head *buffer = bloom_buffer(sb, base, bits, key, &bit, &step);
+	if (!buffer)
+		return -EIO;
+	unsigned char *map = bufdata(buffer);
+	for (int i = 0; i < BLOOM_PROBES; i++, bit += step)
+		map[(bit & mask) >> 3] |= 1 << (bit & 7);
+	brelse_dirty(buffer);
+	return 0;
+}
+
+static int bloom_clear(struct sb *sb, block_t base, unsigned bits)
+{
+	unsigned blocks = 1 << (bits - sb->blockbits - 3);
+	for (unsigned i = 0; i < blocks; i++) {
+		struct buffer_head *buffer = sb_getblk(sb, base + i);
+		if (!buffer)
+			return -ENOMEM;
+		memset(bufdata(buffer), 0, bufsize(buffer));
+		brelse_dirty(buffer);
+	}
+	return 0;
+}
+
+static int bloom_test(struct sb *sb, u64 key)
+{
+	if (!sb->bloom)
+		return 1;
+	int maybe = bloom_probe(sb, sb->bloom, sb->bloombits, key);
+	sb->bloomstat.probes++;
+	if (!maybe)
+		sb->bloomstat.skips++;
+	return maybe;
+}
+
+static void bloom_add(struct sb *sb, u64 key)
+{
+	if (!sb->bloom)
+		return;
+	if (bloom_set(sb, sb->bloom, sb->bloombits, key))
+		warn("unable to read fingerprint filter");
+	sb->bloomkeys++;
+}
+
+/*
+ * Give the volume an empty filter of 2^bits bits, replacing any it had.
+ * Zero bits removes the filter.
+ */
+int make_bloom(struct sb *sb, unsigned bits)
+{
+	unsigned shift = sb->blockbits + 3;
+	int err;
+	if (sb->bloom) {
+		bfree(sb, sb->bloom, 1 << (sb->bloombits - shift));
+		sb->bloom = 0;
+	}
+	sb->bloombits = 0;
+	sb->bloomkeys = sb->bloomstale = 0;
+	if (!bits)
+		return 0;
+	if (bits < shift)
+		bits = shift;
+	if ((err = balloc(sb, 1 << (bits - shift), &sb->bloom)))
+		return err;
+	sb->bloombits = bits;
+	return bloom_clear(sb, sb->bloom, bits);
+}
+
+static int fplog_walk(struct sb *sb, int (*fn)(struct sb *sb, struct hleaf_entry *entry, void *info), void *info);
+
+static int bloom_entry(struct sb *sb, struct hleaf_entry *entry, void *info)
+{
+	bloom_add(sb, hentry_key(entry));
+	return 0;
+}
+
+/* Refill the filter from the index, returns the number of keys added */
+int rebuild_bloom(struct sb *sb)
+{
+	struct btree *btree = &sb->htree;
+	int err, keys = 0;
+	if (!sb->bloom)
+		return 0;
+	if ((err = bloom_clear(sb, sb->bloom, sb->bloombits)))
+		return err;
+	sb->bloomkeys = sb->bloomstale = 0;
+	if (sb->flags & SB_LOG_INDEX)
+		return fplog_walk(sb, bloom_entry, NULL);
+	if (!btree->root.depth)
+		return 0;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -ENOMEM;
+	down_read(&btree->lock);
+	if ((err = probe(btree, 0, cursor)))
+		goto out;
+	do {
+		struct hleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		for (int i = 0; i < leaf->count; i++, keys++)
+			bloom_add(sb, hentry_key(leaf->entries + i));
+	} while ((err = advance(btree, cursor)) > 0);
+out:
+	up_read(&btree->lock);
+	free_cursor(cursor);
+	return err < 0 ? err : keys;
+}
+
+/*
+ * Fingerprint log
+ *
+ * The other index, for volumes made with "mkfs --index log" (SB_LOG_INDEX).
+ * Htree keys are random, so every new fingerprint dirties a random leaf,
+ * and once the index outgrows the cache each insert costs a random read and
+ * a random write.  Here new index entries go to a memtable, a hash table in
+ * memory, which is written out as a run when it fills and at each sync: the
+ * entries sorted by key in one contiguous extent, followed by a Bloom
+ * filter of the run's keys.  Inserts cost only sequential writes.
+ *
+ * A lookup tries the memtable, then the runs newest first, skipping those
+ * whose key range or filter rule the key out.  Keys are uniform, so the
+ * block of a run holding a key is found by interpolating between its first
+ * and last keys, and is usually the first one read.  Runs are merged two at
+ * a time whenever the newer is at least a quarter the size of the older,
+ * so sizes fall by four from oldest to newest and there are few of them.
+ * The runs are listed in a directory block, oldest first.
+ *
+ * Entries are packed hleaf entries, 204 to a 4K block.  Fingerprints that
+ * share key and tag get an entry each and are told apart by their bucket
+ * entries, so there are no collision buckets.  The collector and the index
+ * rebuild replace all the runs with one.  The memtable is not written by a
+ * crash, which only loses those entries, as buckets are written before the
+ * index points at them.  The htree lock serializes the log as well.
+ */
+
+#define LOG_MAGIC 0x10c5
+#define LOG_MEMTABLE 4096	/* entries written out as a run when full */
+#define LOG_SLOTS (2 * LOG_MEMTABLE)
+#define LOG_FILTER_BITS 16	/* run filter bits per entry */
+#define LOG_MERGE 4		/* size ratio below which the newest two runs merge */
+
+struct logrun {
+	block_t block;		/* entry blocks then filter blocks */
+	u32 count;		/* entries, ascending by key */
+	u16 filterbits;		/* log2 of filter size in bits */
+	u16 unused;
+	u64 first, last;	/* lowest and highest key */
+};
+
+struct logdir {
+	u16 magic;
+	u16 runs;		/* oldest first */
+	u32 unused;
+	struct logrun run[];
+};
+
+struct fplog {
+	unsigned count;
+	struct hleaf_entry table[LOG_SLOTS]; /* open addressed, zero if empty */
+};
+
+static unsigned log_perblock(struct sb *sb)
+{
+	return sb->blocksize / sizeof(struct hleaf_entry);
+}
+
+static unsigned logrun_blocks(struct sb *sb, struct logrun *run)
+{
+	return (run->count + log_perblock(sb) - 1) / log_perblock(sb);
+}
+
+static unsigned logrun_size(struct sb *sb, struct logrun *run)
+{
+	return logrun_blocks(sb, run) + (1 << (run->filterbits - sb->blockbits - 3));
+}
+
+static int logdir_max(struct sb *sb)
+{
+	return (sb->blocksize - offsetof(struct logdir, run)) / sizeof(struct logrun);
+}
+
+static int hleaf_entry_cmp(const void *a, const void *b)
+{
+	struct hleaf_entry *x = (void *)a, *y = (void *)b;
+	u64 xkey = hentry_key(x), ykey = hentry_key(y);
+	if (xkey != ykey)
+		return xkey < ykey ? -1 : 1;
+	return hentry_tag(x) < hentry_tag(y) ? -1 : hentry_tag(x) > hentry_tag(y);
+}
+
+/* Give the volume an empty log */
+int make_fplog(struct sb *sb)
+{
+	int err = balloc(sb, 1, &sb->logindex);
+	if (err)
+		return err;
+	struct buffer_head *buffer = sb_getblk(sb, sb->logindex);
+	if (!buffer)
+		return -ENOMEM;
+	memset(bufdata(buffer), 0, bufsize(buffer));
+	*(struct logdir *)bufdata(buffer) = (struct logdir){ .magic = LOG_MAGIC };
+	brelse_dirty(buffer);
+	return 0;
+}
+
+static struct buffer_head *logdir_read(struct sb *sb)
+{
+	struct buffer_head *buffer = sb_bread(sb, sb->logindex);
+	if (buffer && ((struct logdir *)bufdata(buffer))->magic != LOG_MAGIC) {
+		warn("bad fingerprint log directory at %Lx", (L)sb->logindex);
+		brelse(buffer);
+		return NULL;
+	}
+	return buffer;
+}
+
+static struct buffer_head *logrun_read(struct sb *sb, struct logrun *run, unsigned at, unsigned *count)
+{
+	unsigned per = log_perblock(sb);
+	*count = min(per, run->count - at * per);
+	return sb_bread(sb, run->block + at);
+}
+
+/* Data block of the fingerprint if the entry is for it, else -1 */
+static block_t log_check(struct sb *sb, struct hleaf_entry *entry, unsigned char *hash, block_t *bucket, int *slot)
+{
+	struct buffer_head *buffer = bucket_read(sb, hentry_bucket(entry));
+	if (!buffer)
+		return -1;
+	struct bucket_entry *found = ((struct bucket *)bufdata(buffer))->entries + hentry_slot(entry);
+	block_t block = memcmp(hash, found->sha_hash, FINGERPRINT_SIZE) ? -1 : bentry_block(found);
+	brelse(buffer);
+	if (block != -1) {
+		*bucket = hentry_bucket(entry);
+		*slot = hentry_slot(entry);
+	}
+	return block;
+}
+
+static block_t logrun_find(struct sb *sb, struct logrun *run, u64 key, unsigned char *hash, block_t *bucket, int *slot)
+{
+	unsigned per = log_perblock(sb), blocks = logrun_blocks(sb, run), count, i = 0;
+	if (!run->count || key < run->first || key > run->last ||
+	    !bloom_probe(sb, run->block + blocks, run->filterbits, key))
+		return -1;
+	unsigned at = run->count > 1 ? interpolate(key, run->first, run->last, 0, run->count - 1) / per : 0;
+	struct buffer_head *buffer;
+	struct hleaf_entry *entries;
+	/* back to before the key if the guess was past it, else on to it */
+	while (1) {
+		if (!(buffer = logrun_read(sb, run, at, &count)))
+			return -1;
+		entries = bufdata(buffer);
+		if (!at || hentry_key(entries) < key)
+			break;
+		brelse(buffer);
+		at--;
+	}
+	while (hentry_key(entries + count - 1) < key && at + 1 < blocks) {
+		brelse(buffer);
+		if (!(buffer = logrun_read(sb, run, ++at, &count)))
+			return -1;
+		entries = bufdata(buffer);
+	}
+	while (hentry_key(entries + i) < key)
+		i++;
+	/* entries for the key may go on into the next block */
+	u32 tag = fingerprint_tag(hash);
+	block_t found = -1;
+	while (1) {
+		for (; i < count && hentry_key(entries + i) == key && found == -1; i++)
+			if (hentry_tag(entries + i) == tag)
+				found = log_check(sb, entries + i, hash, bucket, slot);
+		brelse(buffer);
+		if (found != -1 || i < count || ++at == blocks)
+			return found;
+		if (!(buffer = logrun_read(sb, run, at, &count)))
+			return -1;
+		entries = bufdata(buffer);
+		i = 0;
+	}
+}
+
+/* Find where a fingerprint lives, without taking a reference */
+static block_t fplog_locate(struct sb *sb, unsigned char *hash, block_t *bucket, int *slot)
+{
+	struct fplog *log = sb->fplog;
+	u64 key = fingerprint_key(hash);
+	u32 tag = fingerprint_tag(hash);
+	block_t found = -1;
+	if (log) {
+		for (unsigned i = key % LOG_SLOTS; log->table[i].where && found == -1; i = (i + 1) % LOG_SLOTS)
+			if (hentry_key(log->table + i) == key && hentry_tag(log->table + i) == tag)
+				found = log_check(sb, log->table + i, hash, bucket, slot);
+		if (found != -1)
+			return found;
+	}
+	struct buffer_head *buffer = logdir_read(sb);
+	if (!buffer)
+		return -1;
+	struct logdir *dir = bufdata(buffer);
+	for (int i = dir->runs - 1; i >= 0 && found == -1; i--)
+		found = logrun_find(sb, dir->run + i, key, hash, bucket, slot);
+	brelse(buffer);
+	return found;
+}
+
+/* Write sorted entries out as a new run, not yet in the directory */
+static int logrun_write(struct sb *sb, struct hleaf_entry *entries, unsigned count, struct logrun *run)
+{
+	unsigned per = log_perblock(sb), bits = sb->blockbits + 3;
+	while ((1ULL << bits) < (u64)count * LOG_FILTER_BITS)
+		bits++;
+	*run = (struct logrun){ .count = count, .filterbits = bits, .first = hentry_key(entries), .last = hentry_key(entries + count - 1) };
+	int err = balloc(sb, logrun_size(sb, run), &run->block);
+	if (err)
+		return err;
+	unsigned blocks = logrun_blocks(sb, run);
+	for (unsigned i = 0; i < blocks; i++) {
+		struct buffer_head *buffer = sb_getblk(sb, run->block + i);
+		if (!buffer)
+			return -ENOMEM;
+		memset(bufdata(buffer), 0, bufsize(buffer));
+		memcpy(bufdata(buffer), entries + i * per, min(per, count - i * per) * sizeof(*entries));
+		brelse_dirty(buffer);
+	}
+	if ((err = bloom_clear(sb, run->block + blocks, bits)))
+		return err;
+	for (unsigned i = 0; i < count; i++)
+		if ((err = bloom_set(sb, run->block + blocks, bits, hentry_key(entries + i))))
+			return err;
+	return 0;
+}
+
+/* Read all the entries of a run into entries */
+static int logrun_load(struct sb *sb, struct logrun *run, struct hleaf_entry *entries)
+{
+	unsigned blocks = logrun_blocks(sb, run), count;
+	for (unsigned at = 0; at < blocks; at++) {
+		struct buffer_head *buffer = logrun_read(sb, run, at, &count);
+		if (!buffer)
+			return -EIO;
+		memcpy(entries, bufdata(buffer), count * sizeof(*entries));
+		entries += count;
+		brelse(buffer);
+	}
+	return 0;
+}
+
+/* Free a run, dropping any of its blocks not written out yet */
+static void logrun_free(struct sb *sb, struct logrun *run)
+{
+	unsigned size = logrun_size(sb, run);
+	for (unsigned i = 0; i < size; i++) {
+		struct buffer_head *buffer = peekblk(sb->volmap->map, run->block + i);
+		if (buffer) {
+			if (!buffer_empty(buffer))
+				set_buffer_empty(buffer);
+			brelse(buffer);
+		}
+	}
+	bfree(sb, run->block, size);
+}
+
+/* Merge the newest two runs into one */
+static int logrun_merge(struct sb *sb, struct logdir *dir)
+{
+	struct logrun *older = dir->run + dir->runs - 2, *newer = older + 1, merged;
+	unsigned count = older->count + newer->count, mid = older->count;
+	struct hleaf_entry *in = malloc(count * sizeof(*in)), *out = malloc(count * sizeof(*out));
+	int err = -ENOMEM;
+	if (!in || !out)
+		goto out;
+	if ((err = logrun_load(sb, older, in)) || (err = logrun_load(sb, newer, in + mid)))
+		goto out;
+	for (unsigned i = 0, j = mid, k = 0; k < count; k++)
+		out[k] = j == count || (i < mid && hleaf_entry_cmp(in + i, in + j) <= 0) ? in[i++] : in[j++];
+	if ((err = logrun_write(sb, out, count, &merged)))
+		goto out;
+	logrun_free(sb, older);
+	logrun_free(sb, newer);
+	*older = merged;
+	dir->runs--;
+out:
+	free(in);
+	free(out);
+	return err;
+}
+
+/* Write the memtable out as the newest run and merge runs as needed */
+int fplog_flush(struct sb *sb)
+{
+	struct fplog *log = sb->fplog;
+	if (!log || !log->count)
+		return 0;
+	struct hleaf_entry *entries = malloc(log->count * sizeof(*entries));
+	if (!entries)
+		return -ENOMEM;
+	unsigned count = 0;
+	for (unsigned i = 0; i < LOG_SLOTS; i++)
+		if (log->table[i].where)
+			entries[count++] = log->table[i];
+	qsort(entries, count, sizeof(*entries), hleaf_entry_cmp);
+	struct buffer_head *buffer = logdir_read(sb);
+	int err = -EIO;
+	if (!buffer)
+		goto out;
+	struct logdir *dir = bufdata(buffer);
+	if (dir->runs == logdir_max(sb) && (err = logrun_merge(sb, dir)))
+		goto release;
+	if ((err = logrun_write(sb, entries, count, dir->run + dir->runs)))
+		goto release;
+	dir->runs++;
+	memset(log->table, 0, sizeof(log->table));
+	log->count = 0;
+	while (dir->runs > 1 && dir->run[dir->runs - 1].count * LOG_MERGE >= dir->run[dir->runs - 2].count)
+		if ((err = logrun_merge(sb, dir)))
+			break;
+release:
+	brelse_dirty(buffer);
+out:
+	free(entries);
+	return err;
+}
+
+static int fplog_insert(struct sb *sb, struct hleaf_entry *entry)
+{
+	struct fplog *log = sb->fplog;
+	int err;
+	if (!log && !(log = sb->fplog = calloc(1, sizeof(*log))))
+		return -ENOMEM;
+	if (log->count == LOG_MEMTABLE && (err = fplog_flush(sb)))
+		return err;
+	unsigned i = hentry_key(entry) % LOG_SLOTS;
+	while (log->table[i].where)
+		i = (i + 1) % LOG_SLOTS;
+	log->table[i] = *entry;
+	log->count++;
+	return 0;
+}
+
+/* Replace the whole log with one run of sorted entries */
+static int fplog_replace(struct sb *sb, struct hleaf_entry *entries, unsigned count)
+{
+	struct buffer_head *buffer = logdir_read(sb);
+	struct logrun run;
+	int err;
+	if (!buffer)
+		return -EIO;
+	if (count && (err = logrun_write(sb, entries, count, &run))) {
+		brelse(buffer);
+		return err;
+	}
+	struct logdir *dir = bufdata(buffer);
+	for (unsigned i = 0; i < dir->runs; i++)
+		logrun_free(sb, dir->run + i);
+	dir->runs = 0;
+	if (count)
+		dir->run[dir->runs++] = run;
+	brelse_dirty(buffer);
+	if (sb->fplog) {
+		memset(sb->fplog->table, 0, sizeof(sb->fplog->table));
+		sb->fplog->count = 0;
+	}
+	return 0;
+}
+
+/* Call fn on every entry of the log, returns the number of entries */
+static int fplog_walk(struct sb *sb, int (*fn)(struct sb *sb, struct hleaf_entry *entry, void *info), void *info)
+{
+	struct fplog *log = sb->fplog;
+	int err = 0, entries = 0;
+	for (unsigned i = 0; log && i < LOG_SLOTS && !err; i++)
+		if (log->table[i].where && !(err = fn(sb, log->table + i, info)))
+			entries++;
+	struct buffer_head *buffer = logdir_read(sb);
+	if (!buffer)
+		return -EIO;
+	struct logdir *dir = bufdata(buffer);
+	for (unsigned i = 0; i < dir->runs && !err; i++) {
+		struct logrun *run = dir->run + i;
+		unsigned blocks = logrun_blocks(sb, run), count;
+		for (unsigned at = 0; at < blocks && !err; at++) {
+			struct buffer_head *runbuf = logrun_read(sb, run, at, &count);
+			if (!runbuf) {
+				err = -EIO;
+				break;
+			}
+			struct hleaf_entry *entry = bufdata(runbuf);
+			for (unsigned j = 0; j < count && !err; j++)
+				if (!(err = fn(sb, entry + j, info)))
+					entries++;
+			brelse(runbuf);
+		}
+	}
+	brelse(buffer);
+	return err < 0 ? err : entries;
+}
+
+/* Number of runs in the log and the entries in them */
+int fplog_runs(struct sb *sb, unsigned *entries)
+{
+	struct buffer_head *buffer = logdir_read(sb);
+	if (!buffer)
+		return -EIO;
+	struct logdir *dir = bufdata(buffer);
+	int runs = dir->runs;
+	*entries = sb->fplog ? sb->fplog->count : 0;
+	for (int i = 0; i < runs; i++)
+		*entries += dir->run[i].count;
+	brelse(buffer);
+	return runs;
+}
+
+static block_t fplog_lookup(struct inode *inode, unsigned char *hash)
+{
+	struct sb *sb = inode->i_sb;
+	struct btree *btree = &sb->htree;
+	u64 key = fingerprint_key(hash), start = dedup_clock();
+	block_t bucket;
+	int slot;
+	down_write(&btree->lock);
+	sb->dedupstat.count[DEDUP_HTREE_PROBES]++;
+	block_t block = fplog_locate(sb, hash, &bucket, &slot);
+	dedup_time(sb, DEDUP_TIME_HTREE, start, 1);
+	if (block != -1) {
+		sb->dedupstat.count[DEDUP_HTREE_HITS]++;
+		refbucket_hit(inode, bucket);
+		bucket_readahead(sb, bucket);
+		fpcache_insert(sb, key, bucket, slot);
+		dedup_ref(sb, block, 1);
+		up_write(&btree->lock);
+		return block;
+	}
+	slot = writebucket_slot(inode);
+	struct hleaf_entry entry = make_hentry(key, fingerprint_tag(hash), inode->writebucket, slot);
+	if (fplog_insert(sb, &entry))
+		warn("unable to index fingerprint");
+	fpcache_insert(sb, key, inode->writebucket, slot);
+	bloom_add(sb, key);
+	up_write(&btree->lock);
+	return -1;
+}
+
+/*
+ * Data checksums
+ *
+ * A CRC32C for every volume block, kept in a contiguous table of volume
+ * blocks allocated at mkfs next to the fingerprint filter and cached the
+ * same way.  The checksum is recorded whenever a data block is written and
+ * checked when it is read back with readcheck on, so verifying a read
+ * costs one table lookup and a pass of the CRC instruction over the data,
+ * and never touches the dedup index.  Blocks shared by dedup have the same
+ * contents and so the same checksum.  Zero in the table means nothing was
+ * recorded, a block whose checksum really is zero is stored as one.
+ */
+
+#ifdef __KERNEL__
+static u32 crc32c_block(const void *data, unsigned size)
+{
+	return crc32c(~0, data, size) ^ ~0;
+}
+#else
+static u32 crc32c_table[256];
+
+static u32 crc32c_soft(u32 crc, const void *data, unsigned size)
+{
+	const unsigned char *byte = data;
+	if (!crc32c_table[1])
+		for (unsigned i = 0; i < 256; i++) {
+			u32 c = i;
+			for (int j = 0; j < 8; j++)
+				c = c >> 1 ^ (c & 1 ? 0x82f63b78 : 0);
+			crc32c_table[i] = c;
+		}
+	while (size--)
+		crc = crc >> 8 ^ crc32c_table[(crc ^ *byte++) & 0xff];
+	return crc;
+}
+
+#ifdef __x86_64__
+__attribute__((target("sse4.2")))
+static u32 crc32c_hard(u32 crc, const void *data, unsigned size)
+{
+	const u64 *word = data;
+	u64 c = crc;
+	for (unsigned i = 0; i < size / 8; i++)
+		c = __builtin_ia32_crc32di(c, word[i]);
+	return crc32c_soft(c, word + size / 8, size & 7);
+}
+#endif
+
+static u32 crc32c_block(const void *data, unsigned size)
+{
+#ifdef __x86_64__
+	static int hard = -1;
+	if (hard < 0)
+		hard = __builtin_cpu_supports("sse4.2");
+	if (hard)
+		return crc32c_hard(~0, data, size) ^ ~0;
+#endif
+	return crc32c_soft(~0, data, size) ^ ~0;
+}
+#endif
+
+static struct buffer_head *crctable_entry(struct sb *sb, block_t block, be_u32 **entry)
+{
+	struct buffer_head *buffer = sb_bread(sb, sb->crctable + (block >> (sb->blockbits - 2)));
+	if (buffer)
+		*entry = (be_u32 *)bufdata(buffer) + (block & ((sb->blocksize >> 2) - 1));
+	return buffer;
+}
+
+static u32 block_crc(struct sb *sb, const void *data)
+{
+	u32 crc = crc32c_block(data, sb->blocksize);
+	return crc ? crc : 1;
+}
+
+/* Remember the checksum of data just written to block */
+void crc_record(struct sb *sb, block_t block, const void *data)
+{
+	be_u32 *entry;
+	if (!sb->crctable)
+		return;
+	struct buffer_head *buffer = crctable_entry(sb, block, &entry);
+	if (!buffer) {
+		warn("unable to read checksum table");
+		return;
+	}
+	*entry = to_be_u32(block_crc(sb, data));
+	brelse_dirty(buffer);
+}
+
+/* Check data just read from block, -EIO if it is not what was written */
+int crc_verify(struct sb *sb, block_t block, const void *data)
+{
+	be_u32 *entry;
+	if (!sb->crctable)
+		return 0;
+	struct buffer_head *buffer = crctable_entry(sb, block, &entry);
+	if (!buffer)
+		return -EIO;
+	u32 want = from_be_u32(*entry), crc = want ? block_crc(sb, data) : 0;
+	brelse(buffer);
+	if (crc != want) {
+		warn("block %Lx checksum %08x, expected %08x", (L)block, crc, want);
+		return -EIO;
+	}
+	return 0;
+}
+
+/* Give the volume an empty checksum table */
+int make_crctable(struct sb *sb)
+{
+	unsigned blocks = crctable_blocks(sb);
+	int err;
+	if ((err = balloc(sb, blocks, &sb->crctable)))
+		return err;
+	for (unsigned i = 0; i < blocks; i++) {
+		struct buffer_head *buffer = sb_getblk(sb, sb->crctable + i);
+		if (!buffer)
+			return -ENOMEM;
+		memset(bufdata(buffer), 0, bufsize(buffer));
+		brelse_dirty(buffer);
+	}
+	return 0;
+}
+
+/*
+ * Shared read cache
+ *
+ * File data is cached per inode, so files that share a deduplicated block
+ * would each read it from disk and each keep a copy.  Reads go through a
+ * second cache first, keyed by volume block and shared by all inodes, and
+ * copy out of it on a hit, so the next file to read a shared block finds
+ * it in memory.  It is set associative and replaces cold entries first,
+ * like the fingerprint cache, so a long read of unique data only churns
+ * the cold entries and the shared blocks that keep being read stay.
+ *
+ * A block is dropped from the cache whenever it is written, which covers
+ * a freed block being reused, and a hit skips the checksum, which was
+ * checked when the block came in.
+ */
+
+#define READCACHE_SETS (1 << 8)
+#define READCACHE_WAYS 8
+#define READCACHE_HOT 3
+
+struct readcache {
+	unsigned hits, misses;
+	struct readcache_entry {
+		block_t block; /* zero if empty */
+		unsigned hot;
+	} entries[READCACHE_SETS][READCACHE_WAYS];
+	char data[];	/* a block for each entry */
+};
+
+static struct readcache_entry *readcache_set(struct sb *sb, block_t block)
+{
+	unsigned size = sizeof(struct readcache) + READCACHE_SETS * READCACHE_WAYS * sb->blocksize;
+	if (!sb->readcache && !(sb->readcache = calloc(1, size)))
+		return NULL;
+	return sb->readcache->entries[block % READCACHE_SETS];
+}
+
+static struct readcache_entry *readcache_find(struct sb *sb, block_t block)
+{
+	struct readcache_entry *set = readcache_set(sb, block);
+	if (set)
+		for (int i = 0; i < READCACHE_WAYS; i++)
+			if (set[i].block == block)
+				return set + i;
+	return NULL;
+}
+
+static void *readcache_data(struct sb *sb, struct readcache_entry *entry)
+{
+	return sb->readcache->data + ((entry - sb->readcache->entries[0]) << sb->blockbits);
+}
+
+/* Copy block into data if it is cached, returns zero on a hit */
+int readcache_read(struct sb *sb, block_t block, void *data)
+{
+	struct readcache_entry *cached = readcache_find(sb, block);
+	if (!cached) {
+		if (sb->readcache)
+			sb->readcache->misses++;
+		return -ENOENT;
+	}
+	memcpy(data, readcache_data(sb, cached), sb->blocksize);
+	if (cached->hot < READCACHE_HOT)
+		cached->hot++;
+	sb->readcache->hits++;
+	return 0;
+}
+
+/* Remember data just read from block */
+void readcache_insert(struct sb *sb, block_t block, const void *data)
+{
+	struct readcache_entry *set = readcache_set(sb, block), *victim = NULL;
+	if (!set)
+		return;
+	for (int i = 0; i < READCACHE_WAYS && !victim; i++)
+		if (!set[i].block || set[i].block == block)
+			victim = set + i;
+	while (!victim) {
+		for (int i = 0; i < READCACHE_WAYS; i++) {
+			if (!set[i].hot) {
+				victim = set + i;
+				break;
+			}
+		}
+		if (!victim)
+			for (int i = 0; i < READCACHE_WAYS; i++)
+				set[i].hot--;
+	}
+	*victim = (struct readcache_entry){ .block = block };
+	memcpy(readcache_data(sb, victim), data, sb->blocksize);
+}
+
+/* Drop block from the cache, it is about to be written */
+void readcache_forget(struct sb *sb, block_t block)
+{
+	struct readcache_entry *cached = sb->readcache ? readcache_find(sb, block) : NULL;
+	if (cached)
+		cached->block = 0;
+}
+
+/* Find the index entry for a fingerprint in the leaf, NULL if none */
+static struct hleaf_entry *hleaf_find(struct btree *btree, struct hleaf *leaf, u64 key, unsigned char *hash)
+{
+	unsigned at = hleaf_seek(btree, key, leaf);
+	if (!(btree->sb->flags & SB_TAGGED_INDEX))
+		return at < leaf->count && hentry_key(leaf->entries + at) == key ? leaf->entries + at : NULL;
+	u32 tag = fingerprint_tag(hash);
+	for (; at < leaf->count && hentry_key(leaf->entries + at) == key; at++)
+		if (hentry_tag(leaf->entries + at) == tag)
+			return leaf->entries + at;
+	return NULL;
+}
+
+block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct hleaf_entry* temp ,unsigned char* hash, int first)
 {
 	if(first == 1){
 		trace("********* Collision***********");
+		inode->i_sb->dedupstat.count[DEDUP_COLLISIONS]++;
 /* First collision found. */
 /*	- Create a new collision bucket. */
 /*	- Add the first entry and current entry to collision bucket. */
 /*	- Make changes to hleaf_entry to point to collision bucket and offset = -1. */
 		block_t col_bucket;
-		struct bucket_entry* tmp_entry;
 		int err = inode->btree.ops->balloc(inode->i_sb, 1, &col_bucket);
 		if(err)
 			warn("Collision bucket not initialized");
@@ -177,14 +1975,50 @@ block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct
 		memset(bufdata(buf), 0, bufsize(buf));
 		struct bucket *col_bck = (struct bucket *)bufdata(buf);
 		col_bck->count = 2;
-		/* Make entries for already present entry */
-		tmp_entry = col_bck->entries;
-		memcpy(tmp_entry->sha_hash,entry->sha_hash,SHA_DIGEST_LENGTH); 
-		tmp_entry->block = temp->block;
-		tmp_entry->refcount = temp->offset;/* Using the refcount field of the bucket entry for offsets in case of col. buckets */
-		tmp_entry = col_bck->entries + 1;
+		/* Make entries for already present entry, the slot says where it is in its bucket */
+		bentry_set(col_bck->entries, entry->sha_hash, hentry_bucket(temp), hentry_slot(temp));
+		struct buffer_head *wb_buf = sb_bread(inode->i_sb, inode->writebucket);
+		struct bucket *wb_bck = (struct bucket *)bufdata(wb_buf);
+		u16 count = wb_bck->count;
+		int flag = 0;
+		if(count >= inode->i_sb->entries_per_bucket) {		
+			brelse_dirty(wb_buf);
+			init_writebucket(inode);
+			count = 0;
+			flag = 1;
+		}
 		/* Making new entry */
-		memcpy(tmp_entry->sha_hash,hash,SHA_DIGEST_LENGTH); 
+		bentry_set(col_bck->entries + 1, hash, inode->writebucket, count);
+		hentry_point(temp, col_bucket, -1);
+		fpcache_forget(inode->i_sb, hentry_key(temp));
+		if (flag != 1)
+			brelse(wb_buf);
+		brelse_dirty(buf);
+		return 0;
+	}else{
+		trace("64bit match and offset == -1");
+		block_t bckno = hentry_bucket(temp);
+		struct buffer_head *buffer = bucket_read(inode->i_sb, bckno);
+		struct bucket *bck =(struct bucket *) bufdata(buffer);
+		struct bucket_entry *entry;
+		for(int i = 0; i < bck->count; i++) {
+			entry = bck->entries + i;
+			if (!memcmp(hash, entry->sha_hash, FINGERPRINT_SIZE)) {
+				trace("64bit match and offset == -1 and match found in col bck");
+				struct buffer_head *buf = bucket_read(inode->i_sb, bentry_block(entry));
+				struct bucket *org_bck =(struct bucket *) bufdata(buf);
+				struct bucket_entry *org_entry;
+				block_t ret_blk;
+				org_entry = org_bck->entries + bentry_slot(entry);
+				ret_blk = bentry_block(org_entry);
+				brelse(buf);
+				brelse(buffer);
+				dedup_ref(inode->i_sb, ret_blk, 1);
+				return ret_blk;
+			}
+		}
+		trace("Inside - 64bit match and offset == -1 and no match in col bck");
+		inode->i_sb->dedupstat.count[DEDUP_COLLISIONS]++;
 		struct buffer_head *wb_buf = sb_bread(inode->i_sb, inode->writebucket);
 		struct bucket *wb_bck = (struct bucket *)bufdata(wb_buf);
 		u16 count = wb_bck->count;
@@ -195,196 +2029,1597 @@ block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct
 			count = 0;
 			flag = 1;
 		}
-		tmp_entry->block = inode->writebucket; 
-		tmp_entry->refcount = count;
-		temp->block = col_bucket;
-		temp->offset = -1;
-		if (flag != 1)
-			brelse(wb_buf);
-		brelse_dirty(buf);
+		bentry_set(bck->entries + bck->count++, hash, inode->writebucket, count);
+		brelse_dirty(buffer);
+		if (flag != 1)
+			brelse(wb_buf);
+		return -1;
+	}
+	
+
+}
+
+block_t htree_lookup(struct inode *inode, struct btree *btree, unsigned char *hash)
+{
+	u64 offset;
+	block_t bckno;
+	u64 sh = fingerprint_key(hash);
+	struct cursor *cursor = alloc_cursor(btree,20);
+	if (!cursor)
+		return -ENOMEM;
+	down_write(&btree->lock);
+	tuxkey_t key = sh;
+	u64 start = dedup_clock();
+	if (probe(btree, key, cursor))
+		error("probe for %Lx failed", (L)key);
+	inode->i_sb->dedupstat.count[DEDUP_HTREE_PROBES]++;
+	
+	struct hleaf *leaf = (struct hleaf *)bufdata(cursor_leafbuf(cursor));
+	struct hleaf_entry *temp = hleaf_find(btree, leaf, key, hash);
+	dedup_time(inode->i_sb, DEDUP_TIME_HTREE, start, 1);
+	if (!temp)
+		goto insert;
+	
+	if(hentry_slot(temp) != -1) {
+		block_t block;
+		offset = hentry_slot(temp);
+		bckno = hentry_bucket(temp);
+		struct buffer_head *buffer = bucket_read(inode->i_sb, bckno);
+		struct bucket *bck =(struct bucket *) bufdata(buffer);
+		struct bucket_entry *entry;
+		entry = bck->entries + offset;
+		trace("64bit match and offset != -1");
+		if (!memcmp(hash, entry->sha_hash, FINGERPRINT_SIZE)) {
+			block = bentry_block(entry);
+			inode->i_sb->dedupstat.count[DEDUP_HTREE_HITS]++;
+			refbucket_hit(inode, bckno);
+			bucket_readahead(inode->i_sb, bckno);
+			fpcache_insert(inode->i_sb, sh, bckno, offset);
+			trace("Found entry in tree");
+			trace("Changed reference bucket to %Lx", (L)bckno);
+			brelse(buffer);
+			dedup_ref(inode->i_sb, block, 1);
+			release_cursor(cursor);
+			free(cursor);
+			up_write(&btree->lock);
+			trace("64bit match and offset != -1 and now complete 160bit match found");
+			return block;
+		} else {
+			if(!handle_collision(inode, entry, temp, hash, 1)){
+				brelse(buffer);
+				mark_buffer_dirty(cursor_leafbuf(cursor));
+				release_cursor(cursor);
+				free_cursor(cursor);
+				up_write(&btree->lock);
+				return -1;
+			}
+		}
+			
+	     	
+	}	
+	else {
+		block_t coll;
+		coll = handle_collision(inode, NULL, temp, hash, 0);
+		if (coll != -1)
+			inode->i_sb->dedupstat.count[DEDUP_HTREE_HITS]++;
+		mark_buffer_dirty(cursor_leafbuf(cursor));
+		release_cursor(cursor);
+		free_cursor(cursor);
+		up_write(&btree->lock);
+		return coll;	
+	}    
+insert:
+	trace("Entry not found in tree");
+	struct hleaf_entry *entry = (struct hleaf_entry *)tree_expand(btree, key, 1, cursor);
+	u16 count = writebucket_slot(inode);
+	*entry = make_hentry(key, fingerprint_tag(hash), inode->writebucket, count);
+	fpcache_insert(inode->i_sb, key, inode->writebucket, count);
+	bloom_add(inode->i_sb, key);
+	mark_buffer_dirty(cursor_leafbuf(cursor));
+	release_cursor(cursor);
+	free_cursor(cursor);
+	up_write(&btree->lock);
+	return -1; 
+}
+
+/* Look a fingerprint up in the index the volume has, adding it if new */
+static block_t index_lookup(struct inode *inode, unsigned char *hash)
+{
+	if (inode->i_sb->flags & SB_LOG_INDEX)
+		return fplog_lookup(inode, hash);
+	return htree_lookup(inode, &inode->i_sb->htree, hash);
+}
+
+void fingerprint(struct sb *sb, const void *data, unsigned char *hash)
+{
+	fingerprint_engines[sb->fingerprint].hash(data, sb->blocksize, hash);
+}
+
+/*
+ * All-zero blocks are left as holes rather than fingerprinted.  The words
+ * are ored together a cache line at a time, which the compiler turns into
+ * vector ors, so a zero block is checked at memory speed and nearly every
+ * other block is turned away by its first line.
+ */
+int zero_block(const void *data, unsigned size)
+{
+	const unsigned long *word = data, *limit = data + size;
+	for (; word < limit; word += 8)
+		if (word[0] | word[1] | word[2] | word[3] | word[4] | word[5] | word[6] | word[7])
+			return 0;
+	return 1;
+}
+
+/*
+ * Fingerprint a batch of blocks.  Hashing depends on nothing but the data,
+ * so in userspace the batch is spread over the volume's hash workers if it
+ * has any.  The results are looked up together, see hash_resolve().
+ */
+
+struct fingerprint_batch {
+	void **data;
+	unsigned char (*hash)[FINGERPRINT_SIZE];
+	struct sb *sb;
+};
+
+static void fingerprint_job(void *info, unsigned index)
+{
+	struct fingerprint_batch *batch = info;
+	fingerprint(batch->sb, batch->data[index], batch->hash[index]);
+}
+
+void fingerprint_blocks(struct sb *sb, void *data[], unsigned char (*hash)[FINGERPRINT_SIZE], unsigned count)
+{
+	struct fingerprint_batch batch = { .data = data, .hash = hash, .sb = sb };
+	u64 start = dedup_clock();
+#ifdef __KERNEL__
+	for (unsigned i = 0; i < count; i++)
+		fingerprint_job(&batch, i);
+#else
+	hashpool_run(sb->hashpool, fingerprint_job, &batch, count);
+#endif
+	dedup_time(sb, DEDUP_TIME_HASH, start, count);
+}
+
+/*
+ * Adaptive dedup
+ *
+ * Some streams never dedup, encrypted or compressed data, and would pay
+ * for hashing and lookups on every block for nothing.  Each inode keeps
+ * how many of its blocks were looked up lately and how many of those were
+ * found, halving both whenever they fill a window of YIELD_WINDOW blocks,
+ * so old history fades.  Once the window is half full and less than
+ * YIELD_MIN percent were found, the inode backs off: its holes are filled
+ * by plain allocation, the same as on a volume without dedup, except that
+ * one region is still deduplicated every YIELD_SAMPLE blocks written.
+ * Samples keep the window current, so a stream that turns to duplicates
+ * is picked up again.  The volume keeps a window of all writes too, which
+ * decides for files that have too little history of their own, so that a
+ * backup of many small unique files backs off as well.  Blocks written
+ * while backed off are not indexed, so later copies of them are not found.
+ */
+
+#define YIELD_WINDOW 1024	/* blocks the yield is taken over */
+#define YIELD_MIN 3		/* percent found below which a stream backs off */
+#define YIELD_SAMPLE 1024	/* blocks written plainly between samples */
+
+static void yield_note(struct dedup_yield *yield, unsigned looked, unsigned hits)
+{
+	yield->looked += looked;
+	yield->hits += hits;
+	while (yield->looked > YIELD_WINDOW) {
+		yield->looked /= 2;
+		yield->hits /= 2;
+	}
+	if (yield->looked >= YIELD_WINDOW / 2)
+		yield->off = yield->hits * 100 < yield->looked * YIELD_MIN;
+}
+
+/* Whether to deduplicate the next count blocks an inode writes */
+int dedup_wanted(struct inode *inode, unsigned count)
+{
+	struct sb *sb = inode->i_sb;
+	struct dedup_yield *yield = inode->yield.looked >= YIELD_WINDOW / 2 ? &inode->yield : &sb->yield;
+	if (!yield->off)
+		return 1;
+	if (yield->skipped >= YIELD_SAMPLE) {
+		yield->skipped = 0;
+		return 1;
+	}
+	yield->skipped += count;
+	sb->plainblocks += count;
+	return 0;
+}
+
+/* Count blocks looked up for an inode and how many were found */
+void dedup_yield(struct inode *inode, unsigned looked, unsigned hits)
+{
+	yield_note(&inode->yield, looked, hits);
+	yield_note(&inode->i_sb->yield, looked, hits);
+}
+
+/*
+ * Batch lookup
+ *
+ * Resolving a whole extent worth of fingerprints at once lets the htree be
+ * walked once, left to right: the batch is sorted by key and each probe
+ * starts from where the last one left off (probe_forward), so neighbouring
+ * keys cost no more than a leaf search.  Keys found near the inode's last
+ * hits (see Bucket locality) are not probed at all, and each hit the probes
+ * make is looked near for the keys still to come.  Fingerprints that
+ * repeat within the batch are looked up once, by the first of them (the
+ * leader), and the rest take its answer.
+ *
+ * This is done in two steps so the caller can decide in between which
+ * blocks really get deduplicated.  hash_resolve() only looks: each entry
+ * comes back with the data block and bucket entry of its fingerprint, or
+ * block -1 if it is new.  The caller then sets use on every entry and fills
+ * in the block of each new fingerprint to be indexed, and hash_commit()
+ * inserts those into the htree in one sorted sweep and takes references to
+ * the shared ones.  A new key that turns out to be taken by a different
+ * fingerprint is left to the collision handling in htree_lookup().
+ */
+
+struct batch_key {
+	tuxkey_t key;
+	unsigned index;
+	unsigned char *hash;
+};
+
+static int batch_key_cmp(const void *a, const void *b)
+{
+	const struct batch_key *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	int cmp = memcmp(x->hash, y->hash, FINGERPRINT_SIZE);
+	if (cmp)
+		return cmp;
+	return x->index < y->index ? -1 : x->index > y->index;
+}
+
+static void hash_found(struct hash_ref *ref, block_t block, block_t bucket, int slot)
+{
+	*ref = (struct hash_ref){ .block = block, .bucket = bucket, .slot = slot, .leader = ref->leader };
+}
+
+/* Look one key up in the leaf the cursor is on, entry must be a leader */
+static int hash_resolve_leaf(struct sb *sb, struct btree *btree, struct cursor *cursor, struct batch_key *key, struct hash_ref *ref)
+{
+	struct hleaf *leaf = bufdata(cursor_leafbuf(cursor));
+	struct hleaf_entry *found = hleaf_find(btree, leaf, key->key, key->hash);
+	if (!found)
+		return 0;
+	block_t bucket = hentry_bucket(found);
+	int slot = hentry_slot(found);
+	struct buffer_head *buffer = bucket_read(sb, bucket);
+	if (!buffer)
+		return -EIO;
+	struct bucket *bck = bufdata(buffer);
+	ref->collide = 1;
+	if (slot != -1) {
+		struct bucket_entry *entry = bck->entries + slot;
+		if (!memcmp(key->hash, entry->sha_hash, FINGERPRINT_SIZE)) {
+			hash_found(ref, bentry_block(entry), bucket, slot);
+			fpcache_insert(sb, key->key, bucket, slot);
+		}
+		brelse(buffer);
+		return 0;
+	}
+	/* collision bucket entries point at the real entry */
+	for (int i = 0; i < bck->count; i++) {
+		struct bucket_entry *entry = bck->entries + i;
+		if (memcmp(key->hash, entry->sha_hash, FINGERPRINT_SIZE))
+			continue;
+		struct buffer_head *orgbuf = bucket_read(sb, bentry_block(entry));
+		if (!orgbuf) {
+			brelse(buffer);
+			return -EIO;
+		}
+		struct bucket *org = bufdata(orgbuf);
+		hash_found(ref, bentry_block(org->entries + bentry_slot(entry)), bentry_block(entry), bentry_slot(entry));
+		brelse(orgbuf);
+		break;
+	}
+	brelse(buffer);
+	return 0;
+}
+
+/* Find where a fingerprint lives in the htree, without taking a reference */
+static block_t htree_locate(struct sb *sb, unsigned char *hash)
+{
+	struct btree *btree = &sb->htree;
+	struct batch_key key = { .key = fingerprint_key(hash), .hash = hash };
+	struct hash_ref ref = { .block = -1 };
+	if (!btree->root.depth)
+		return -1;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -1;
+	down_read(&btree->lock);
+	if (!probe(btree, key.key, cursor)) {
+		hash_resolve_leaf(sb, btree, cursor, &key, &ref);
+		release_cursor(cursor);
+	}
+	up_read(&btree->lock);
+	free_cursor(cursor);
+	return ref.block;
+}
+
+/* Where the index the volume has puts a fingerprint, takes no reference */
+static block_t index_locate(struct sb *sb, unsigned char *hash)
+{
+	block_t bucket;
+	int slot;
+	if (sb->flags & SB_LOG_INDEX)
+		return fplog_locate(sb, hash, &bucket, &slot);
+	return htree_locate(sb, hash);
+}
+
+/*
+ * Find which fingerprints of a batch are already known, see above.  Takes
+ * no references and changes nothing on disk.  For each leader:
+ *
+ * 0. If the fingerprint summary says the key is not in the index, it is
+ *    new and nothing else is looked at.
+ * 1. Look in the recent reference buckets and the ones their stream wrote
+ *    next (see Bucket locality).
+ * 2. Else, if the fingerprint cache knows the bucket entry and it matches,
+ *    take that.
+ * 3. Else probe the index.  A hit makes its bucket the most recent
+ *    reference bucket and reads the buckets after it ahead, so the keys
+ *    still to come may be found by 1.  A miss after the summary said
+ *    maybe is a false positive.
+ *
+ * The references to the blocks found and the index entries of the new
+ * fingerprints are left to hash_commit().
+ */
+int hash_resolve(struct inode *inode, unsigned char (*hash)[FINGERPRINT_SIZE], struct hash_ref *ref, unsigned count)
+{
+	struct sb *sb = inode->i_sb;
+	struct btree *btree = &sb->htree;
+	unsigned leaders = 0, probes = 0;
+	u64 start = dedup_clock();
+	int err = 0;
+
+	bucket_check(inode);
+	struct batch_key *keys = malloc(count * sizeof(*keys));
+	if (!keys)
+		return -ENOMEM;
+	sb->dedupstat.count[DEDUP_LOOKUPS] += count;
+	for (unsigned i = 0; i < count; i++) {
+		keys[i] = (struct batch_key){ .key = fingerprint_key(hash[i]), .index = i, .hash = hash[i] };
+		ref[i] = (struct hash_ref){ .block = -1, .leader = i };
+	}
+	qsort(keys, count, sizeof(*keys), batch_key_cmp);
+	/* repeats sort right after their leader, keep only the leaders */
+	for (unsigned i = 0; i < count; i++) {
+		struct batch_key *last = keys + leaders - 1;
+		if (leaders && last->key == keys[i].key && !memcmp(last->hash, keys[i].hash, FINGERPRINT_SIZE)) {
+			ref[keys[i].index].leader = last->index;
+			continue;
+		}
+		keys[leaders++] = keys[i];
+	}
+
+	/* new to the filter, else near the last hits or in the cache */
+	for (unsigned i = 0; i < leaders; i++) {
+		struct hash_ref *this = ref + keys[i].index;
+		if (!bloom_test(sb, keys[i].key))
+			continue;
+		block_t block = locality_locate(inode, keys[i].hash, &this->bucket, &this->slot);
+		if (block == -1)
+			block = fpcache_locate(sb, keys[i].hash, &this->bucket, &this->slot);
+		if (block != -1)
+			this->block = block;
+		else
+			keys[probes++] = keys[i];
+	}
+
+	if (probes && (sb->flags & SB_LOG_INDEX)) {
+		int moved = 0;
+		down_read(&btree->lock);
+		for (unsigned i = 0; i < probes; i++) {
+			struct hash_ref *this = ref + keys[i].index;
+			if (moved && (this->block = locality_locate(inode, keys[i].hash, &this->bucket, &this->slot)) != -1)
+				continue;
+			u64 probed = dedup_clock();
+			sb->dedupstat.count[DEDUP_HTREE_PROBES]++;
+			this->block = fplog_locate(sb, keys[i].hash, &this->bucket, &this->slot);
+			dedup_time(sb, DEDUP_TIME_HTREE, probed, 1);
+			if (this->block == -1) {
+				if (sb->bloom)
+					sb->bloomstat.falsepos++;
+				continue;
+			}
+			sb->dedupstat.count[DEDUP_HTREE_HITS]++;
+			refbucket_hit(inode, this->bucket);
+			bucket_readahead(sb, this->bucket);
+			moved = 1;
+		}
+		up_read(&btree->lock);
+	} else if (probes && btree->root.depth) {
+		struct cursor *cursor = alloc_cursor(btree, 0);
+		int moved = 0;
+		if (!cursor) {
+			err = -ENOMEM;
+			goto out;
+		}
+		down_read(&btree->lock);
+		for (unsigned i = 0; i < probes; i++) {
+			struct hash_ref *this = ref + keys[i].index;
+			/* a hit on an earlier key may have brought this one near */
+			if (moved && (this->block = locality_locate(inode, keys[i].hash, &this->bucket, &this->slot)) != -1)
+				continue;
+			u64 probed = dedup_clock();
+			if ((err = probe_forward(btree, keys[i].key, cursor)))
+				break;
+			sb->dedupstat.count[DEDUP_HTREE_PROBES]++;
+			if ((err = hash_resolve_leaf(sb, btree, cursor, keys + i, this)))
+				break;
+			dedup_time(sb, DEDUP_TIME_HTREE, probed, 1);
+			if (this->block == -1) {
+				if (sb->bloom)
+					sb->bloomstat.falsepos++;
+				continue;
+			}
+			sb->dedupstat.count[DEDUP_HTREE_HITS]++;
+			refbucket_hit(inode, this->bucket);
+			bucket_readahead(sb, this->bucket);
+			moved = 1;
+		}
+		release_cursor(cursor);
+		up_read(&btree->lock);
+		free_cursor(cursor);
+	}
+
+	/* a leader always comes before the entries that follow it */
+	for (unsigned i = 0; i < count; i++)
+		if (ref[i].leader != i)
+			ref[i] = ref[ref[i].leader];
+	dedup_time(sb, DEDUP_TIME_LOOKUP, start, count);
+out:
+	free(keys);
+	return err;
+}
+
+/*
+ * Index the new fingerprints of a resolved batch and count the shared
+ * ones.  Entries with use HASH_INDEX must be leaders and have their new
+ * data block filled in; HASH_SHARE entries either have a known block or
+ * follow a leader that is being indexed.
+ */
+int hash_commit(struct inode *inode, unsigned char (*hash)[FINGERPRINT_SIZE], struct hash_ref *ref, unsigned count)
+{
+	struct sb *sb = inode->i_sb;
+	struct btree *btree = &sb->htree;
+	unsigned inserts = 0;
+	int err = 0;
+
+	bucket_check(inode);
+	struct batch_key *keys = malloc(count * sizeof(*keys));
+	if (!keys)
+		return -ENOMEM;
+	for (unsigned i = 0; i < count; i++)
+		if (ref[i].use == HASH_INDEX && !ref[i].collide)
+			keys[inserts++] = (struct batch_key){ .key = fingerprint_key(hash[i]), .index = i, .hash = hash[i] };
+	qsort(keys, inserts, sizeof(*keys), batch_key_cmp);
+
+	if (inserts && (sb->flags & SB_LOG_INDEX)) {
+		down_write(&btree->lock);
+		for (unsigned i = 0; i < inserts; i++) {
+			struct hash_ref *this = ref + keys[i].index;
+			block_t bucket;
+			int slot;
+			if (fplog_locate(sb, keys[i].hash, &bucket, &slot) != -1) {
+				this->collide = 1;
+				continue;
+			}
+			slot = writebucket_slot(inode);
+			struct hleaf_entry entry = make_hentry(keys[i].key, fingerprint_tag(keys[i].hash), inode->writebucket, slot);
+			if ((err = fplog_insert(sb, &entry)))
+				break;
+			make_hash_entry(inode, keys[i].hash, this->block);
+			this->bucket = inode->writebucket;
+			this->slot = slot;
+			fpcache_insert(sb, keys[i].key, this->bucket, slot);
+			bloom_add(sb, keys[i].key);
+		}
+		up_write(&btree->lock);
+		if (err)
+			goto out;
+	} else if (inserts) {
+		struct cursor *cursor = alloc_cursor(btree, 8);
+		if (!cursor) {
+			err = -ENOMEM;
+			goto out;
+		}
+		down_write(&btree->lock);
+		for (unsigned i = 0; i < inserts; i++) {
+			struct hash_ref *this = ref + keys[i].index;
+			tuxkey_t key = keys[i].key;
+			if ((err = probe_forward(btree, key, cursor)))
+				break;
+			/* taken since resolve, or by an earlier fingerprint in this batch */
+			if (hleaf_find(btree, bufdata(cursor_leafbuf(cursor)), key, keys[i].hash)) {
+				this->collide = 1;
+				continue;
+			}
+			struct hleaf_entry *entry = tree_expand(btree, key, 1, cursor);
+			if (!entry) {
+				err = -ENOMEM;
+				break;
+			}
+			int slot = writebucket_slot(inode);
+			*entry = make_hentry(key, fingerprint_tag(keys[i].hash), inode->writebucket, slot);
+			mark_buffer_dirty(cursor_leafbuf(cursor));
+			make_hash_entry(inode, keys[i].hash, this->block);
+			this->bucket = inode->writebucket;
+			this->slot = slot;
+			fpcache_insert(sb, key, this->bucket, slot);
+			bloom_add(sb, key);
+		}
+		release_cursor(cursor);
+		up_write(&btree->lock);
+		free_cursor(cursor);
+		if (err)
+			goto out;
+	}
+
+	/* rare, so these take the slow path */
+	for (unsigned i = 0; i < count; i++) {
+		if (ref[i].use != HASH_INDEX || !ref[i].collide)
+			continue;
+		/*
+		 * Indexed since resolve, or missed by a stale filter: the new
+		 * block is already mapped, so it just goes unshared
+		 */
+		block_t block = index_locate(sb, hash[i]);
+		if (block != -1) {
+			trace("block %Lx already indexed as %Lx", (L)ref[i].block, (L)block);
+			ref[i].use = HASH_IGNORE;
+			continue;
+		}
+		if ((block = index_lookup(inode, hash[i])) != -1) {
+			dedup_ref(sb, block, -1);
+			ref[i].use = HASH_IGNORE;
+			continue;
+		}
+		ref[i].slot = make_hash_entry(inode, hash[i], ref[i].block);
+		ref[i].bucket = inode->writebucket;
+	}
+
+	for (unsigned i = 0; i < count; i++) {
+		if (ref[i].use != HASH_SHARE)
+			continue;
+		dedup_ref(sb, ref[i].block, 1);
+		struct hash_ref *this = ref[i].bucket ? ref + i : ref + ref[i].leader;
+		if (this->bucket)
+			refbucket_hit(inode, this->bucket);
+	}
+out:
+	free(keys);
+	return err;
+}
+
+/*
+ * Bucket garbage collection
+ *
+ * Frees the dead list.  The htree is walked twice: the first pass counts
+ * the live entries of every bucket, the second takes out the keys and
+ * collision entries of dead blocks and moves the live entries of buckets
+ * less than half full into fresh buckets, repointing their keys.  Then the
+ * emptied buckets are unlinked from their streams' chains and freed, along
+ * with the dead blocks.  A dead entry in a bucket
+ * that is kept is zeroed, which no block fingerprints to.
+ *
+ * Moving entries or freeing buckets invalidates anything else that points
+ * at bucket slots: the fingerprint cache is emptied and bumping
+ * sb->bucketgen makes inodes drop their read and write buckets.  A key
+ * only taken out leaves its zeroed entry in place, which the cache and the
+ * recent buckets simply miss.  The filter cannot forget keys, but a key
+ * left in it only costs a probe that finds nothing, so it is rebuilt once
+ * a quarter of the keys set in it are gone.  Returns the number of htree
+ * keys taken out.
+ *
+ * Every collection walks the whole index, so sync_super() only collects
+ * once dedup_gc_due() says enough blocks have died, and a write only when
+ * it runs out of space, see data_balloc().
+ */
+
+#define GC_DEAD_BLOCKS 4096	/* dead blocks worth a walk of the index */
+
+struct gc_bucket { block_t bucket; unsigned live; };
+
+struct gc {
+	struct sb *sb;
+	struct gc_bucket *buckets;
+	unsigned count, size;
+	block_t out;		/* fresh bucket live entries are moved to */
+	unsigned dropped;	/* htree keys taken out */
+	int changed;		/* current leaf needs writing */
+	int compact;		/* move the entries of sparse buckets */
+};
+
+static int gc_bucket_cmp(const void *a, const void *b)
+{
+	return block_cmp(&((struct gc_bucket *)a)->bucket, &((struct gc_bucket *)b)->bucket);
+}
+
+static int gc_note(struct gc *gc, block_t bucket, int live)
+{
+	if (gc->count == gc->size) {
+		unsigned size = gc->size ? 2 * gc->size : 256;
+		struct gc_bucket *buckets = realloc(gc->buckets, size * sizeof(*buckets));
+		if (!buckets)
+			return -ENOMEM;
+		gc->buckets = buckets;
+		gc->size = size;
+	}
+	gc->buckets[gc->count++] = (struct gc_bucket){ .bucket = bucket, .live = live };
+	return 0;
+}
+
+/* Sum the live entries noted for each bucket */
+static void gc_merge(struct gc *gc)
+{
+	unsigned count = 0;
+	qsort(gc->buckets, gc->count, sizeof(*gc->buckets), gc_bucket_cmp);
+	for (unsigned i = 0; i < gc->count; i++) {
+		if (count && gc->buckets[count - 1].bucket == gc->buckets[i].bucket)
+			gc->buckets[count - 1].live += gc->buckets[i].live;
+		else
+			gc->buckets[count++] = gc->buckets[i];
+	}
+	gc->count = count;
+}
+
+static int gc_sparse(struct gc *gc, block_t bucket)
+{
+	struct gc_bucket *found = bsearch(&(struct gc_bucket){ .bucket = bucket },
+		gc->buckets, gc->count, sizeof(*gc->buckets), gc_bucket_cmp);
+	return gc->compact && found && found->live * 2 < gc->sb->entries_per_bucket;
+}
+
+/*
+ * Buckets that stay may chain on to sparse ones about to be freed, whose
+ * blocks can then hold anything.  Link them past those to the next bucket
+ * of the stream that stays, or end the chain.
+ */
+static int gc_relink(struct gc *gc)
+{
+	struct sb *sb = gc->sb;
+	for (unsigned i = 0; i < gc->count; i++) {
+		block_t bucket = gc->buckets[i].bucket;
+		if (gc_sparse(gc, bucket))
+			continue;
+		struct buffer_head *buffer = sb_bread(sb, bucket);
+		if (!buffer)
+			return -EIO;
+		struct bucket *bck = bufdata(buffer);
+		block_t next = bucket_next(sb, bucket, bck);
+		if (!next || !gc_sparse(gc, next)) {
+			brelse(buffer);
+			continue;
+		}
+		while (next && gc_sparse(gc, next)) {
+			struct buffer_head *nextbuf = sb_bread(sb, next);
+			if (!nextbuf) {
+				brelse(buffer);
+				return -EIO;
+			}
+			next = bucket_next(sb, next, bufdata(nextbuf));
+			brelse(nextbuf);
+		}
+		bck->next = next ? next - bucket : 0;
+		brelse_dirty(buffer);
+	}
+	return 0;
+}
+
+static int gc_put(struct gc *gc, struct bucket_entry *entry, block_t *bucket, int *slot)
+{
+	struct sb *sb = gc->sb;
+	struct buffer_head *buffer = gc->out ? sb_bread(sb, gc->out) : NULL;
+	if (gc->out && !buffer)
+		return -EIO;
+	if (!buffer || ((struct bucket *)bufdata(buffer))->count == sb->entries_per_bucket) {
+		if (buffer)
+			brelse(buffer);
+		int err = balloc(sb, 1, &gc->out);
+		if (err)
+			return err;
+		if (!(buffer = sb_getblk(sb, gc->out)))
+			return -ENOMEM;
+		memset(bufdata(buffer), 0, bufsize(buffer));
+	}
+	struct bucket *bck = bufdata(buffer);
+	bck->entries[bck->count] = *entry;
+	*bucket = gc->out;
+	*slot = bck->count++;
+	brelse_dirty(buffer);
+	return 0;
+}
+
+/*
+ * Look at the bucket entry in slot of bucket.  Counting, only note whether
+ * it is live.  Moving, return 1 if it is dead, else move it out if its
+ * bucket is sparse, updating bucket and slot.
+ */
+static int gc_entry(struct gc *gc, block_t *bucket, int *slot, int move)
+{
+	struct sb *sb = gc->sb;
+	struct buffer_head *buffer = sb_bread(sb, *bucket);
+	if (!buffer)
+		return -EIO;
+	struct bucket_entry *entry = ((struct bucket *)bufdata(buffer))->entries + *slot;
+	int dead = !!dead_find(sb, bentry_block(entry));
+	if (!move) {
+		brelse(buffer);
+		return gc_note(gc, *bucket, !dead);
+	}
+	int sparse = gc_sparse(gc, *bucket);
+	if (dead && !sparse) {
+		memset(entry, 0, sizeof(*entry));
+		brelse_dirty(buffer);
+		return 1;
+	}
+	struct bucket_entry copy = *entry;
+	brelse(buffer);
+	if (dead || !sparse)
+		return dead;
+	gc->changed = 1;
+	return gc_put(gc, &copy, bucket, slot);
+}
+
+/* Collision bucket entries name the real entry and its slot */
+static int gc_collision(struct gc *gc, block_t bucket, int move)
+{
+	struct sb *sb = gc->sb;
+	struct buffer_head *buffer = sb_bread(sb, bucket);
+	if (!buffer)
+		return -EIO;
+	struct bucket *bck = bufdata(buffer);
+	unsigned kept = 0;
+	for (unsigned i = 0; i < bck->count; i++) {
+		struct bucket_entry *entry = bck->entries + i;
+		block_t real = bentry_block(entry);
+		int slot = bentry_slot(entry);
+		int dead = gc_entry(gc, &real, &slot, move);
+		if (dead < 0) {
+			brelse(buffer);
+			return dead;
+		}
+		if (!dead) {
+			bentry_point(entry, real, slot);
+			bck->entries[kept++] = *entry;
+		}
+	}
+	if (!move) {
+		brelse(buffer);
+		return 0;
+	}
+	if (kept) {
+		memset(bck->entries + kept, 0, (bck->count - kept) * sizeof(*bck->entries));
+		bck->count = kept;
+		brelse_dirty(buffer);
+		return 0;
+	}
+	brelse(buffer);
+	bfree(sb, bucket, 1);
+	return 1;
+}
+
+static int gc_sweep(struct gc *gc, int move)
+{
+	struct btree *btree = &gc->sb->htree;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	int err;
+	if (!cursor)
+		return -ENOMEM;
+	down_write(&btree->lock);
+	if ((err = probe(btree, 0, cursor)))
+		goto out;
+	do {
+		struct buffer_head *leafbuf = cursor_leafbuf(cursor);
+		struct hleaf *leaf = bufdata(leafbuf);
+		unsigned kept = 0;
+		gc->changed = 0;
+		for (unsigned i = 0; i < leaf->count; i++) {
+			struct hleaf_entry *entry = leaf->entries + i;
+			block_t bucket = hentry_bucket(entry);
+			int slot = hentry_slot(entry);
+			int dead = slot == -1 ?
+				gc_collision(gc, bucket, move) :
+				gc_entry(gc, &bucket, &slot, move);
+			if (dead < 0) {
+				release_cursor(cursor);
+				err = dead;
+				goto out;
+			}
+			if (dead)
+				gc->dropped++;
+			else {
+				hentry_point(entry, bucket, slot);
+				leaf->entries[kept++] = *entry;
+			}
+		}
+		if (kept < leaf->count) {
+			/* lookups must not find dropped keys past the end */
+			memset(leaf->entries + kept, 0, (leaf->count - kept) * sizeof(*leaf->entries));
+			leaf->count = kept;
+			gc->changed = 1;
+		}
+		if (gc->changed)
+			mark_buffer_dirty(leafbuf);
+	} while ((err = advance(btree, cursor)) > 0);
+out:
+	up_write(&btree->lock);
+	free_cursor(cursor);
+	return err;
+}
+
+struct gc_log {
+	struct gc *gc;
+	struct hleaf_entry *kept;
+	unsigned count;
+	int move;
+};
+
+static int gc_log_entry(struct sb *sb, struct hleaf_entry *entry, void *info)
+{
+	struct gc_log *log = info;
+	block_t bucket = hentry_bucket(entry);
+	int slot = hentry_slot(entry);
+	int dead = gc_entry(log->gc, &bucket, &slot, log->move);
+	if (dead < 0 || !log->move)
+		return dead;
+	if (dead)
+		log->gc->dropped++;
+	else {
+		struct hleaf_entry *kept = log->kept + log->count++;
+		*kept = *entry;
+		hentry_point(kept, bucket, slot);
+	}
+	return 0;
+}
+
+/* Sweep the fingerprint log as gc_sweep() does the htree, into one new run */
+static int gc_log(struct gc *gc)
+{
+	struct sb *sb = gc->sb;
+	struct gc_log log = { .gc = gc };
+	unsigned entries;
+	int err;
+	if ((err = fplog_flush(sb)) || (err = fplog_runs(sb, &entries)) < 0)
+		return err;
+	if ((err = fplog_walk(sb, gc_log_entry, &log)) < 0)
+		return err;
+	gc_merge(gc);
+	if (!(log.kept = malloc((entries + 1) * sizeof(*log.kept))))
+		return -ENOMEM;
+	log.move = 1;
+	if ((err = fplog_walk(sb, gc_log_entry, &log)) >= 0) {
+		qsort(log.kept, log.count, sizeof(*log.kept), hleaf_entry_cmp);
+		err = fplog_replace(sb, log.kept, log.count);
+	}
+	free(log.kept);
+	return err;
+}
+
+/* Whether enough blocks have died to be worth collecting, less on a small volume */
+int dedup_gc_due(struct sb *sb)
+{
+	unsigned dead = sb->dead ? sb->dead->count : 0;
+	return dead && (dead >= GC_DEAD_BLOCKS || dead >= sb->volblocks / 64);
+}
+
+static int gc_collect(struct sb *sb, int compact)
+{
+	struct deadlist *dead = sb->dead;
+	struct gc gc = { .sb = sb, .compact = compact };
+	unsigned freed = 0;
+	int err = 0;
+	if (!dead || !dead->count)
+		return 0;
+	if (sb->flags & SB_LOG_INDEX || sb->htree.root.depth) {
+		if (sb->flags & SB_LOG_INDEX)
+			err = gc_log(&gc);
+		else if (!(err = gc_sweep(&gc, 0))) {
+			gc_merge(&gc);
+			err = gc_sweep(&gc, 1);
+		}
+		if (err || (err = gc_relink(&gc)))
+			goto out;
+		for (unsigned i = 0; i < gc.count; i++) {
+			if (gc_sparse(&gc, gc.buckets[i].bucket)) {
+				bfree(sb, gc.buckets[i].bucket, 1);
+				freed++;
+			}
+		}
+	}
+	qsort(dead->blocks, dead->count, sizeof(*dead->blocks), block_cmp);
+	for (unsigned i = 0, run; i < dead->count; i += run) {
+		for (run = 1; i + run < dead->count; run++)
+			if (dead->blocks[i + run] != dead->blocks[i] + run)
+				break;
+		bfree(sb, dead->blocks[i], run);
+	}
+	dead->count = 0;
+	dead->dirty = 1;
+	if (freed) {
+		if (sb->fpcache)
+			memset(sb->fpcache->entries, 0, sizeof(sb->fpcache->entries));
+		sb->bucketgen++;
+	}
+	sb->bloomstale += gc.dropped;
+	if (sb->bloomstale * 4 <= sb->bloomkeys || (err = rebuild_bloom(sb)) >= 0)
+		err = gc.dropped;
+out:
+	free(gc.buckets);
+	return err;
+}
+
+int dedup_gc(struct sb *sb)
+{
+	return gc_collect(sb, 1);
+}
+
+/*
+ * Out of space, collect the dead blocks however few, returns how many.
+ * Moving entries takes fresh buckets, so sparse buckets are left for the
+ * next full collection.
+ */
+int dedup_reclaim(struct sb *sb)
+{
+	unsigned dead = sb->dead ? sb->dead->count : 0;
+	int err = dead ? gc_collect(sb, 0) : 0;
+	return err < 0 ? err : dead;
+}
+
+/*
+ * The dead list on disk
+ *
+ * Dead blocks are only freed by a collection, so a dead list lost in a
+ * crash leaks its blocks for good.  Each sync it changed writes the whole
+ * list out as a chain of blocks rooted in the superblock, like the noted
+ * extents, in place of the chain written before.  Mounting reads it back
+ * and leaves it on disk until then.
+ */
+
+#define DEADLIST_MAGIC 0xdead
+
+struct deadblock {
+	u16 magic, count;
+	u32 unused;
+	u64 next;			/* next block of the list, zero if none */
+	u64 blocks[];
+};
+
+static unsigned dead_perblock(struct sb *sb)
+{
+	return (sb->blocksize - offsetof(struct deadblock, blocks)) / sizeof(u64);
+}
+
+/* Read the next block of the chain on disk, NULL at the end or if bad */
+static struct buffer_head *dead_next(struct sb *sb, block_t block, int *err)
+{
+	struct buffer_head *buffer;
+	*err = 0;
+	if (!block)
+		return NULL;
+	if (!(buffer = sb_bread(sb, block))) {
+		*err = -EIO;
+		return NULL;
+	}
+	struct deadblock *chain = bufdata(buffer);
+	if (chain->magic != DEADLIST_MAGIC || chain->count > dead_perblock(sb) || chain->next >= sb->volblocks) {
+		warn("bad dead list block at %Lx", (L)block);
+		brelse(buffer);
+		*err = -EIO;
+		return NULL;
+	}
+	return buffer;
+}
+
+/* Free the chain on disk, what it lists is in memory */
+static int dead_unchain(struct sb *sb)
+{
+	struct buffer_head *buffer;
+	int err;
+	while ((buffer = dead_next(sb, sb->deadblock, &err))) {
+		block_t block = sb->deadblock;
+		sb->deadblock = ((struct deadblock *)bufdata(buffer))->next;
+		brelse(buffer);
+		bfree(sb, block, 1);
+	}
+	return err;
+}
+
+/* Write the dead list in place of the chain written last time */
+int dead_flush(struct sb *sb)
+{
+	struct deadlist *dead = sb->dead;
+	unsigned per = dead_perblock(sb);
+	int err;
+	if (!dead || !dead->dirty)
+		return 0;
+	if ((err = dead_unchain(sb)))
+		return err;
+	dead->dirty = 0;
+	for (unsigned at = 0; at < dead->count; at += per) {
+		unsigned count = min(per, dead->count - at);
+		block_t block;
+		if ((err = balloc(sb, 1, &block)))
+			goto fail;
+		struct buffer_head *buffer = sb_getblk(sb, block);
+		if (!buffer) {
+			bfree(sb, block, 1);
+			err = -ENOMEM;
+			goto fail;
+		}
+		struct deadblock *chain = bufdata(buffer);
+		memset(chain, 0, bufsize(buffer));
+		*chain = (struct deadblock){ .magic = DEADLIST_MAGIC, .count = count, .next = sb->deadblock };
+		for (unsigned i = 0; i < count; i++)
+			chain->blocks[i] = dead->blocks[at + i];
+		brelse_dirty(buffer);
+		sb->deadblock = block;
+	}
+	return 0;
+fail:
+	dead->dirty = 1;
+	return err;
+}
+
+/* Take the dead list written at the last sync back into memory */
+int dead_load(struct sb *sb)
+{
+	struct buffer_head *buffer;
+	block_t block = sb->deadblock;
+	int err;
+	while ((buffer = dead_next(sb, block, &err))) {
+		struct deadblock *chain = bufdata(buffer);
+		for (unsigned i = 0; i < chain->count && !err; i++)
+			if (chain->blocks[i] < sb->volblocks)
+				err = dead_add(sb, chain->blocks[i], 1);
+		block = chain->next;
+		brelse(buffer);
+		if (err)
+			return err;
+	}
+	if (err) {
+		/* only what the rest of the chain holds leaks */
+		sb->deadblock = 0;
 		return 0;
-	}else{
-		int k;
-		trace("64bit match and offset == -1");
-		block_t bckno = temp->block;
-		struct buffer_head *buffer = sb_bread(inode->i_sb, bckno);
-		struct bucket *bck =(struct bucket *) bufdata(buffer);
-		struct bucket_entry *entry;
-		for(int i = 0; i < bck->count; i++) {
-			entry = bck->entries + i;
-			for(k = 0;k < 20;k++) {
-				if (hash[k] == entry->sha_hash[k])
-					continue;
-				else 
-					break;
+	}
+	if (sb->dead)
+		sb->dead->dirty = 0;
+	return 0;
+}
+
+struct btree_ops htree_ops = {
+	.btree_init = hleaf_btree_init,
+	.leaf_init = hleaf_init,
+	.leaf_split = hleaf_split,
+	.leaf_resize = hleaf_resize,
+	.leaf_sniff = hleaf_sniff,
+	.leaf_free = hleaf_free,
+	.balloc = balloc,
+	.bfree = bfree,
+	.search = SEARCH_INTERPOLATE,
+};
+
+/*
+ * Index rebuild
+ *
+ * Makes a new htree and buckets from the data blocks the dtrees map, for
+ * when the index is lost or damaged.  The caller walks the dtrees and
+ * feeds every data extent to index_build_extent(), in file order, which
+ * fingerprints the blocks.  index_build_finish() then keeps the first
+ * block seen for each fingerprint, writes their bucket entries in the
+ * order they were fed, so each bucket chain follows a file as a stream
+ * would have written it (see Bucket locality), and bulk loads the htree
+ * from the entries sorted by key.  The new index is tagged, so only
+ * fingerprints that clash on key and tag get a collision bucket, as in
+ * htree_lookup().  A volume with a fingerprint log gets a log of one run
+ * instead.  Finally the old index is freed, if it can be read, and the
+ * filter rebuilt.
+ *
+ * The whole volume's fingerprints are held and sorted in memory.
+ * Reference counts are not touched, sharing does not change.
+ */
+
+#define BUILD_BATCH 256
+
+struct build_entry {
+	u64 key;
+	unsigned char hash[FINGERPRINT_SIZE];
+	block_t block, bucket;
+	unsigned seq, slot;
+};
+
+struct index_build {
+	struct build_entry *entries;
+	unsigned count, size;
+};
+
+struct index_build *new_index_build(void)
+{
+	return calloc(1, sizeof(struct index_build));
+}
+
+void free_index_build(struct index_build *build)
+{
+	free(build->entries);
+	free(build);
+}
+
+static int build_entry_cmp(const void *a, const void *b)
+{
+	const struct build_entry *x = a, *y = b;
+	if (x->key != y->key)
+		return x->key < y->key ? -1 : 1;
+	int cmp = memcmp(x->hash, y->hash, FINGERPRINT_SIZE);
+	if (cmp)
+		return cmp;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+static int build_seq_cmp(const void *a, const void *b)
+{
+	const struct build_entry *x = a, *y = b;
+	return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
+
+/* Fingerprint the non-zero blocks of a data extent */
+int index_build_extent(struct sb *sb, struct index_build *build, block_t block, unsigned count)
+{
+	struct buffer_head *buffers[BUILD_BATCH];
+	void *data[BUILD_BATCH];
+	block_t blocks[BUILD_BATCH];
+	unsigned char (*hash)[FINGERPRINT_SIZE] = malloc(BUILD_BATCH * FINGERPRINT_SIZE);
+	int err = 0;
+	if (!hash)
+		return -ENOMEM;
+	while (count) {
+		unsigned batch = min(count, (unsigned)BUILD_BATCH), live = 0;
+		for (unsigned i = 0; i < batch; i++) {
+			struct buffer_head *buffer = sb_bread(sb, block + i);
+			if (!buffer) {
+				err = -EIO;
+				goto release;
 			}
-			if (k == 20) {
-				trace("64bit match and offset == -1 and match found in col bck");
-				struct buffer_head *buf = sb_bread(inode->i_sb, entry->block);
-				struct bucket *org_bck =(struct bucket *) bufdata(buf);
-				struct bucket_entry *org_entry;
-				block_t ret_blk;
-				org_entry = org_bck->entries + entry->refcount;
-				org_entry->refcount++;
-				ret_blk = org_entry->block;
-				brelse_dirty(buf);
+			if (zero_block(bufdata(buffer), sb->blocksize)) {
 				brelse(buffer);
-				return ret_blk;
+				continue;
 			}
+			buffers[live] = buffer;
+			data[live] = bufdata(buffer);
+			blocks[live++] = block + i;
 		}
-		trace("Inside - 64bit match and offset == -1 and no match in col bck");
-		memcpy(entry->sha_hash,hash,SHA_DIGEST_LENGTH); 
-		entry->block = inode->writebucket;
-		bck->count++;
-		struct buffer_head *wb_buf = sb_bread(inode->i_sb, inode->writebucket);
-		struct bucket *wb_bck = (struct bucket *)bufdata(wb_buf);
-		u16 count = wb_bck->count;
-		int flag = 0;
-		if(count >= inode->i_sb->entries_per_bucket) {		
-			brelse_dirty(wb_buf);
-			init_writebucket(inode);
-			count = 0;
-			flag = 1;
+		fingerprint_blocks(sb, data, hash, live);
+		if (build->count + live > build->size) {
+			unsigned size = build->size ? build->size : 1 << 12;
+			while (size < build->count + live)
+				size *= 2;
+			struct build_entry *entries = realloc(build->entries, size * sizeof(*entries));
+			if (!entries) {
+				err = -ENOMEM;
+				goto release;
+			}
+			build->entries = entries;
+			build->size = size;
 		}
-		entry->refcount = wb_bck->count;
-		brelse_dirty(buffer);
-		if (flag != 1)
-			brelse(wb_buf);
-		return -1;
+		for (unsigned i = 0; i < live; i++) {
+			struct build_entry *entry = build->entries + build->count;
+			*entry = (struct build_entry){ .key = fingerprint_key(hash[i]), .block = blocks[i], .seq = build->count };
+			memcpy(entry->hash, hash[i], FINGERPRINT_SIZE);
+			build->count++;
+		}
+release:
+		for (unsigned i = 0; i < live; i++)
+			brelse(buffers[i]);
+		if (err)
+			break;
+		block += batch;
+		count -= batch;
 	}
-	
+	free(hash);
+	return err;
+}
 
+/* Write the bucket entries in feed order, chaining the buckets as a stream */
+/* Free the buckets of entries in feed order, as build_buckets() gave them */
+static void free_buckets(struct sb *sb, struct build_entry *entries, unsigned count)
+{
+	for (unsigned i = 0; i < count; i += sb->entries_per_bucket)
+		bfree(sb, entries[i].bucket, 1);
 }
 
-block_t htree_lookup(struct inode *inode, struct btree *btree, unsigned char *hash)
+static int build_buckets(struct sb *sb, struct build_entry *entries, unsigned count)
 {
-	int k;
-	u64 offset;
-	block_t bckno;
-	u64 sh;
-	for(int k=0; k<8; k++) {
-		sh = sh << 8;
-		sh = sh | (hash[k]);
+	unsigned per = sb->entries_per_bucket, buckets = (count + per - 1) / per;
+	block_t bucket = 0, last = 0;
+	/* one run if there is room, so the chain is read in order */
+	int run = !buckets || !balloc(sb, buckets, &bucket);
+	struct buffer_head *buffer = NULL;
+	for (unsigned i = 0; i < count; i++) {
+		if (!(i % per)) {
+			if (buffer)
+				brelse_dirty(buffer);
+			if (run)
+				bucket = last ? last + 1 : bucket;
+			else if (balloc(sb, 1, &bucket)) {
+				free_buckets(sb, entries, i);
+				return -ENOSPC;
+			}
+			entries[i].bucket = bucket;
+			if (!(buffer = sb_getblk(sb, bucket))) {
+				if (run)
+					bfree(sb, entries[0].bucket, buckets);
+				else
+					free_buckets(sb, entries, i + 1);
+				return -ENOMEM;
+			}
+			memset(bufdata(buffer), 0, bufsize(buffer));
+			if (last && bucket > last && bucket - last <= (u32)~0) {
+				struct buffer_head *lastbuf = sb_bread(sb, last);
+				if (lastbuf) {
+					((struct bucket *)bufdata(lastbuf))->next = bucket - last;
+					brelse_dirty(lastbuf);
+				}
+			}
+			last = bucket;
+		}
+		struct bucket *bck = bufdata(buffer);
+		bentry_set(bck->entries + bck->count, entries[i].hash, entries[i].block, 0);
+		entries[i].bucket = bucket;
+		entries[i].slot = bck->count++;
 	}
-	struct cursor *cursor = alloc_cursor(btree,20);
-	if (!cursor)
+	if (buffer)
+		brelse_dirty(buffer);
+	return 0;
+}
+
+/* Collision bucket entries name the real entry and its slot */
+static int build_collision(struct sb *sb, struct build_entry *entries, unsigned count, block_t *bucket)
+{
+	int err;
+	if (count > sb->entries_per_bucket)
+		count = sb->entries_per_bucket;
+	if ((err = balloc(sb, 1, bucket)))
+		return err;
+	struct buffer_head *buffer = sb_getblk(sb, *bucket);
+	if (!buffer) {
+		bfree(sb, *bucket, 1);
 		return -ENOMEM;
-	down_write(&btree->lock);
-	tuxkey_t key = sh;
-	unsigned at;
-	if (probe(btree, key, cursor))
-		error("probe for %Lx failed", (L)key);
-	
-	at = hleaf_seek(btree, key, bufdata(cursor_leafbuf(cursor))); 
+	}
+	memset(bufdata(buffer), 0, bufsize(buffer));
+	struct bucket *bck = bufdata(buffer);
+	for (unsigned i = 0; i < count; i++)
+		bentry_set(bck->entries + bck->count++, entries[i].hash, entries[i].bucket, entries[i].slot);
+	brelse_dirty(buffer);
+	return 0;
+}
 
-	struct hleaf *leaf = (struct hleaf *)bufdata(cursor_leafbuf(cursor));
-	struct hleaf_entry *temp = leaf->entries + at;
-	
-	if(temp->key == sh && temp->offset != -1) {
-		block_t block;
-		offset = temp->offset;
-		bckno = temp->block;
-		struct buffer_head *buffer = sb_bread(inode->i_sb, bckno);
-		struct bucket *bck =(struct bucket *) bufdata(buffer);
-		struct bucket_entry *entry;
-		entry = bck->entries + offset;
-		for(k = 0;k < 20;k++) {
-			if (hash[k] == entry->sha_hash[k])
+static int note_block(block_t **blocks, unsigned *count, unsigned *size, block_t block)
+{
+	if (*count == *size) {
+		unsigned more = *size ? 2 * *size : 256;
+		block_t *grown = realloc(*blocks, more * sizeof(**blocks));
+		if (!grown)
+			return -ENOMEM;
+		*blocks = grown;
+		*size = more;
+	}
+	(*blocks)[(*count)++] = block;
+	return 0;
+}
+
+/* Free the tree blocks and buckets of an htree */
+static int free_index(struct sb *sb, struct btree *btree)
+{
+	block_t *blocks = NULL;
+	unsigned count = 0, size = 0;
+	int err;
+	struct cursor *cursor = alloc_cursor(btree, 0);
+	if (!cursor)
+		return -ENOMEM;
+	down_read(&btree->lock);
+	if ((err = probe(btree, 0, cursor)))
+		goto out;
+	do {
+		err = 0;
+		for (int i = 0; i < cursor->len && !err; i++)
+			err = note_block(&blocks, &count, &size, bufindex(cursor->path[i].buffer));
+		struct hleaf *leaf = bufdata(cursor_leafbuf(cursor));
+		for (unsigned i = 0; i < leaf->count && !err; i++) {
+			struct hleaf_entry *entry = leaf->entries + i;
+			if ((err = note_block(&blocks, &count, &size, hentry_bucket(entry))) || hentry_slot(entry) != -1)
 				continue;
-			else 
+			struct buffer_head *buffer = sb_bread(sb, hentry_bucket(entry));
+			if (!buffer) {
+				err = -EIO;
 				break;
+			}
+			struct bucket *bck = bufdata(buffer);
+			for (unsigned j = 0; j < bck->count && !err; j++)
+				err = note_block(&blocks, &count, &size, bentry_block(bck->entries + j));
+			brelse(buffer);
 		}
-		trace("64bit match and offset != -1");
-		if (k == 20) {
-			entry->refcount++;
-			block = entry->block;
-			inode->refbucket = bckno;
-			trace("Found entry in tree");
-			trace("Changed reference bucket to %Lx", (L)bckno);
-			brelse_dirty(buffer);
+		if (err) {
 			release_cursor(cursor);
-			free(cursor);
-			up_write(&btree->lock);
-			trace("64bit match and offset != -1 and now complete 160bit match found");
-			return block;
-		} else {
-			if(!handle_collision(inode, entry, temp, hash, 1)){
-				brelse(buffer);
-				mark_buffer_dirty(cursor_leafbuf(cursor));
-				release_cursor(cursor);
-				free_cursor(cursor);
-				up_write(&btree->lock);
-				return -1;
-			}
+			goto out;
 		}
-			
-	     	
-	}	
-	else if (temp->key == sh && temp->offset == -1) {
-		block_t coll;
-		coll = handle_collision(inode, NULL, temp, hash, 0);
-		mark_buffer_dirty(cursor_leafbuf(cursor));
-		release_cursor(cursor);
-		free_cursor(cursor);
-		up_write(&btree->lock);
-		return coll;	
-	}    
-	trace("Entry not found in tree");
-	struct hleaf_entry *entry = (struct hleaf_entry *)tree_expand(btree, key, 1, cursor);
-	if(inode->writebucket == 0)
-		init_writebucket(inode);
-	struct buffer_head *buffer = sb_bread(inode->i_sb, inode->writebucket);
-        struct bucket *bck = (struct bucket *)bufdata(buffer);
-        u16 count = bck->count;
-	int flag = 0;
-        if(count >= inode->i_sb->entries_per_bucket) {		
-		brelse_dirty(buffer);
-		init_writebucket(inode);
-		count = 0;
-		flag = 1;
-       	}
-	entry->block = inode->writebucket; 
-	entry->key = key;
-	entry->offset = count;
-	if (flag != 1)
-		brelse(buffer);
-	mark_buffer_dirty(cursor_leafbuf(cursor));
-	release_cursor(cursor);
+	} while ((err = advance(btree, cursor)) > 0);
+	if (err)
+		goto out;
+	qsort(blocks, count, sizeof(*blocks), block_cmp);
+	for (unsigned i = 0; i < count; i++)
+		if (!i || blocks[i] != blocks[i - 1])
+			bfree(sb, blocks[i], 1);
+out:
+	up_read(&btree->lock);
 	free_cursor(cursor);
-	up_write(&btree->lock);
-	return -1; 
+	free(blocks);
+	return err;
 }
 
-/* ALGORITHM FOR DEDUPLICATION */
-/* 1. Perform hash lookup in the current reference bucket. */
-/* 2. If a match is found,  */
-/*      -Increment refernce count for that entry */
-/* 	-Return the duplicate block number to be mapped */
-/* 3.Else, */
-/* 	-Performed lookup in the hash tree to get the corresponding bucket number. */
-/* 	-If an entry is found in the hash tree, then the current reference bucket is written back and */
-/* 	 the bucket in the matched entry is loaded into memory as the current */
-/* 	 read bucket.  */
-/* 	-Else, */
-/* 	     -an entry for the particular block is added to the hash tree */
-/* 	      and an entry is added in the current writebucket with reference count as 1. */
-
-block_t hash_lookup(struct inode *inode, unsigned char *hash)
-{
-	block_t block = -1;
-	if((block = bucket_lookup(inode, hash)) == -1) {
-		block = htree_lookup(inode, &inode->i_sb->htree, hash);
-	}   
-	return block;
+/* Replace the fingerprint log with one run of the built entries */
+static int build_log(struct sb *sb, struct build_entry *entries, unsigned count)
+{
+	struct hleaf_entry *run = malloc((count + 1) * sizeof(*run));
+	if (!run)
+		return -ENOMEM;
+	for (unsigned i = 0; i < count; i++)
+		run[i] = make_hentry(entries[i].key, fingerprint_tag(entries[i].hash), entries[i].bucket, entries[i].slot);
+	int err = fplog_replace(sb, run, count);
+	free(run);
+	return err;
+}
+
+/* Replace the index with one built from the fed extents, returns keys */
+int index_build_finish(struct sb *sb, struct index_build *build)
+{
+	struct build_entry *entries = build->entries;
+	struct btree *btree = &sb->htree, old = *btree;
+	unsigned count = 0, keys = 0, flags = sb->flags;
+	block_t *collisions = NULL;
+	unsigned collided = 0, size = 0;
+	int err;
+
+	/* the first block fed with each fingerprint is the one indexed */
+	qsort(entries, build->count, sizeof(*entries), build_entry_cmp);
+	for (unsigned i = 0; i < build->count; i++)
+		if (!count || entries[i].key != entries[count - 1].key ||
+		    memcmp(entries[i].hash, entries[count - 1].hash, FINGERPRINT_SIZE))
+			entries[count++] = entries[i];
+	qsort(entries, count, sizeof(*entries), build_seq_cmp);
+	if ((err = build_buckets(sb, entries, count)))
+		return err;
+	qsort(entries, count, sizeof(*entries), build_entry_cmp);
+	if (sb->flags & SB_LOG_INDEX) {
+		if ((err = build_log(sb, entries, count)))
+			goto fail;
+		keys = count;
+		goto done;
+	}
+
+	/* a rebuilt index is always tagged, this is how old volumes convert */
+	struct btree_load load;
+	sb->flags |= SB_TAGGED_INDEX;
+	init_btree(btree, sb, (struct root){}, &htree_ops);
+	btree_load_begin(&load, btree);
+	for (unsigned i = 0, run, keyrun = 0; i < count; i += run, keyrun -= run) {
+		/* all the entries for one key go in the same leaf */
+		if (!keyrun) {
+			for (keyrun = 1; i + keyrun < count; keyrun++)
+				if (entries[i + keyrun].key != entries[i].key)
+					break;
+			if (load.leafbuf && hleaf_free(btree, bufdata(load.leafbuf)) < keyrun &&
+			    (err = btree_load_leaf(&load, entries[i].key)))
+				break;
+		}
+		u32 tag = fingerprint_tag(entries[i].hash);
+		for (run = 1; run < keyrun; run++)
+			if (fingerprint_tag(entries[i + run].hash) != tag)
+				break;
+		struct hleaf_entry *entry = btree_load_add(&load, entries[i].key, 1);
+		if (!entry)
+			break;
+		*entry = make_hentry(entries[i].key, tag, entries[i].bucket, entries[i].slot);
+		if (run > 1) {
+			block_t bucket;
+			sb->dedupstat.count[DEDUP_COLLISIONS] += run - 1;
+			if ((err = build_collision(sb, entries + i, run, &bucket)))
+				break;
+			if ((err = note_block(&collisions, &collided, &size, bucket))) {
+				bfree(sb, bucket, 1);
+				break;
+			}
+			hentry_point(entry, bucket, -1);
+		}
+		keys++;
+	}
+	/* a failed load frees its own blocks, the buckets are freed below */
+	if (err)
+		load.err = err;
+	if ((err = btree_load_finish(&load))) {
+		*btree = old;
+		sb->flags = flags;
+		for (unsigned i = 0; i < collided; i++)
+			bfree(sb, collisions[i], 1);
+		goto fail;
+	}
+	free(collisions);
+	if (old.root.depth && (err = free_index(sb, &old)))
+		warn("old index not freed (%i)", err);
+done:
+	if (sb->fpcache)
+		memset(sb->fpcache->entries, 0, sizeof(sb->fpcache->entries));
+	sb->bucketgen++;
+	if ((err = rebuild_bloom(sb)) < 0)
+		return err;
+	return keys;
+fail:
+	free(collisions);
+	qsort(entries, count, sizeof(*entries), build_seq_cmp);
+	free_buckets(sb, entries, count);
+	return err;
 }
 
+/*
+ * Offline deduplication
+ *
+ * Volumes made with "mkfs --dedup offline" (SB_DEDUP_OFFLINE) keep hashing
+ * and index lookups off the write path.  map_region() allocates file data
+ * as it would with no dedup at all and only notes each new extent here, by
+ * inode and logical block.  "tux3 dedupd" works through the noted extents
+ * later, oldest first: it reads them back, fingerprints them a dtree
+ * extent at a time and remaps the duplicates through the dtree to the
+ * blocks already indexed, see redup_region().  The copies it drops go
+ * through dedup_free() like any other, and the collector gives them back.
+ * "--dedup off" (SB_DEDUP_OFF) neither dedups nor notes.
+ *
+ * Noted extents are kept in memory, contiguous writes to the same file
+ * merged, and written out at each sync as a chain of blocks, newest first,
+ * rooted in the superblock.  The daemon takes the whole chain back into
+ * memory and frees it; whatever it does not get to is written out again.
+ * A crash loses at most what was noted since the last sync, which costs
+ * only the space dedupd would have saved.
+ */
 
-struct btree_ops htree_ops = {
-	.btree_init = hleaf_btree_init,
-	.leaf_init = hleaf_init,
-	.leaf_split = hleaf_split,
-	.leaf_resize = hleaf_resize,
-	.leaf_sniff = hleaf_sniff,
-	.leaf_free = hleaf_free,
-	.balloc = balloc,
+#define PENDING_MAGIC 0xdede
+#define PENDING_MIN 256
+
+/* An extent of new file data, native endian like the log directory */
+struct pending {
+	u64 inum;
+	u64 index;
+	u32 count, unused;
 };
+
+struct pendlist {
+	unsigned count, size;
+	struct pending entries[];	/* oldest first */
+};
+
+struct pendblock {
+	u16 magic, count;
+	u32 unused;
+	u64 next;			/* older block, zero if none */
+	struct pending entries[];
+};
+
+/* Volume flags for a dedup mode name */
+int dedup_mode(const char *name)
+{
+	if (!strcmp(name, "inline"))
+		return 0;
+	if (!strcmp(name, "offline"))
+		return SB_DEDUP_OFFLINE;
+	if (!strcmp(name, "off"))
+		return SB_DEDUP_OFF;
+	return -EINVAL;
+}
+
+static unsigned pending_perblock(struct sb *sb)
+{
+	return (sb->blocksize - offsetof(struct pendblock, entries)) / sizeof(struct pending);
+}
+
+/* Make room in the pending list for more entries at the front or the end */
+static int pending_room(struct sb *sb, unsigned more)
+{
+	struct pendlist *list = sb->pending;
+	unsigned count = list ? list->count : 0;
+	if (list && count + more <= list->size)
+		return 0;
+	unsigned size = list ? list->size : PENDING_MIN;
+	while (size < count + more)
+		size *= 2;
+	if (!(list = realloc(list, sizeof(*list) + size * sizeof(*list->entries))))
+		return -ENOMEM;
+	list->count = count;
+	list->size = size;
+	sb->pending = list;
+	return 0;
+}
+
+/* Note an extent of new file data for dedupd */
+int pending_add(struct sb *sb, inum_t inum, block_t index, unsigned count)
+{
+	struct pendlist *list = sb->pending;
+	if (list && list->count) {
+		struct pending *last = list->entries + list->count - 1;
+		if (last->inum == inum && last->index + last->count == index) {
+			last->count += count;
+			return 0;
+		}
+	}
+	int err = pending_room(sb, 1);
+	if (err)
+		return err;
+	list = sb->pending;
+	list->entries[list->count++] = (struct pending){ .inum = inum, .index = index, .count = count };
+	return 0;
+}
+
+/* Write the noted extents out in front of the chain */
+int pending_flush(struct sb *sb)
+{
+	struct pendlist *list = sb->pending;
+	unsigned per = pending_perblock(sb);
+	if (!list || !list->count)
+		return 0;
+	for (unsigned at = 0; at < list->count; at += per) {
+		unsigned count = min(per, list->count - at);
+		block_t block;
+		int err = balloc(sb, 1, &block);
+		if (err)
+			return err;
+		struct buffer_head *buffer = sb_getblk(sb, block);
+		if (!buffer) {
+			bfree(sb, block, 1);
+			return -ENOMEM;
+		}
+		struct pendblock *pend = bufdata(buffer);
+		memset(pend, 0, bufsize(buffer));
+		*pend = (struct pendblock){ .magic = PENDING_MAGIC, .count = count, .next = sb->pendblock };
+		memcpy(pend->entries, list->entries + at, count * sizeof(*pend->entries));
+		brelse_dirty(buffer);
+		sb->pendblock = block;
+	}
+	list->count = 0;
+	return 0;
+}
+
+/* Take the chain back into memory, ahead of anything noted since, and free it */
+int pending_load(struct sb *sb)
+{
+	while (sb->pendblock) {
+		block_t block = sb->pendblock;
+		struct buffer_head *buffer = sb_bread(sb, block);
+		if (!buffer)
+			return -EIO;
+		struct pendblock *pend = bufdata(buffer);
+		if (pend->magic != PENDING_MAGIC || pend->count > pending_perblock(sb)) {
+			warn("bad pending extent block at %Lx", (L)block);
+			brelse(buffer);
+			return -EIO;
+		}
+		int err = pending_room(sb, pend->count);
+		if (err) {
+			brelse(buffer);
+			return err;
+		}
+		struct pendlist *list = sb->pending;
+		vecmove(list->entries + pend->count, list->entries, list->count);
+		memcpy(list->entries, pend->entries, pend->count * sizeof(*list->entries));
+		list->count += pend->count;
+		sb->pendblock = pend->next;
+		brelse(buffer);
+		bfree(sb, block, 1);
+	}
+	return 0;
+}
@@ -757,6 +757,30 @@ int dwalk_add(struct dwalk *walk, tuxkey_t index, struct diskextent extent)
 	return 0; // extent out of order??? leaf full???
 }
 
+/*
+ * Grow the last extent with the start of extent, if extent carries on from
+ * it both in the file and on disk.  Same conditions as dwalk_add(), returns
+ * the number of blocks taken in, and the caller adds the rest.
+ */
+unsigned dwalk_extend(struct dwalk *walk, tuxkey_t index, struct diskextent extent)
+{
+	if (!dleaf_groups(walk->leaf) || dwalk_first(walk))
+		return 0;
+	/* FIXME: assume entry has only one extent */
+	struct diskextent *last = walk->extent - 1;
+	block_t block = extent_block(*last);
+	unsigned count = extent_count(*last);
+	if (dwalk_index(walk) + count != index || block + count != extent_block(extent) ||
+	    extent_version(*last) != extent_version(extent))
+		return 0;
+	unsigned took = min(extent_count(extent), MAX_EXTENT - count);
+	if (took) {
+		trace("extend extent %ti by %x", last - walk->leaf->table, took);
+		*last = make_extent(block, count + took);
+	}
+	return took;
+}
+
 /* Update this extent. The caller have to check new extent isn't overlapping. */
 static void dwalk_update(struct dwalk *walk, struct diskextent extent)
 {
@@ -820,8 +844,25 @@ struct btree_ops dtree_ops = {
 	.leaf_free = dleaf_free,
 	.leaf_split = dleaf_split,
 //	.leaf_resize = dleaf_resize,
+	.leaf_chop = dleaf_chop,
+	.leaf_merge = dleaf_merge,
+	.balloc = balloc,
+	.bfree = dedup_free,
+	.search = SEARCH_BINARY,
+};
+
+/* Files none of whose data can be in the dedup index, see dedup_free() */
+struct btree_ops dtree_unindexed_ops = {
+	.btree_init = dleaf_btree_init,
+	.leaf_sniff = dleaf_sniff,
+	.leaf_init = dleaf_init,
+	.leaf_dump = dleaf_dump,
+	.leaf_need = dleaf_need,
+	.leaf_free = dleaf_free,
+	.leaf_split = dleaf_split,
 	.leaf_chop = dleaf_chop,
 	.leaf_merge = dleaf_merge,
 	.balloc = balloc,
 	.bfree = bfree,
+	.search = SEARCH_BINARY,
 };
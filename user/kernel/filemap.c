@@ -31,11 +31,298 @@ void show_segs(struct seg map[], unsigned segs)
 	printf("\n");
 }
 
+/*
+ * Read a data block to compare against, through the shared read cache so a
+ * block that many writes turn out to duplicate is only read once.
+ */
+static int verify_read(struct sb *sb, block_t block, void *data)
+{
+	int err = 0;
+
+	if (!readcache_read(sb, block, data))
+		return 0;
+	sb->verifystat.reads++;
+#ifdef __KERNEL__
+	struct buffer_head *buffer = sb_bread(vfs_sb(sb), block);
+	if (!buffer)
+		return -EIO;
+	memcpy(data, bufdata(buffer), sb->blocksize);
+	brelse(buffer);
+#else
+	err = diskread(sb->dev->fd, data, sb->blocksize, block << sb->blockbits);
+	if (!err && sb->readcheck)
+		err = crc_verify(sb, block, data);
+#endif
+	if (!err)
+		readcache_insert(sb, block, data);
+	return err;
+}
+
+/*
+ * Files with the verify dedup policy, and all files on a volume with a weak
+ * fingerprint engine, only share a block once its bytes are seen to match,
+ * not just its fingerprint.  A repeat within the batch is
+ * compared with its leader's data, anything else with the block the index
+ * found.  A block that cannot be read is not shared either.
+ */
+static int verify_dup(struct sb *sb, struct hash_ref *ref, unsigned k, void **data, void *scratch)
+{
+	unsigned leader = ref[k].leader;
+	const void *have = data[leader];
+
+	sb->verifystat.compares++;
+	if (ref[leader].use != HASH_INDEX) {
+		int err = verify_read(sb, ref[k].block, scratch);
+		if (err) {
+			warn("block %Lx not read for verify (%i)", (L)ref[k].block, err);
+			return 0;
+		}
+		have = scratch;
+	}
+	if (!memcmp(have, data[k], sb->blocksize))
+		return 1;
+	warn("block %Lx matches fingerprint but not data", (L)ref[k].block);
+	sb->verifystat.mismatches++;
+	return 0;
+}
+
+/*
+ * Dead blocks are free space the collector has not given back yet, so a
+ * write that runs out of space collects them and tries once more.  Only
+ * here, where no index update or bucket is in hand: balloc() itself also
+ * runs in the middle of those, which a collection would pull out from under.
+ */
+static int data_balloc(struct inode *inode, unsigned count, block_t *block)
+{
+	int err = stream_balloc(inode, count, block);
+	if (err == -ENOSPC && dedup_reclaim(tux_sb(inode->i_sb)) > 0)
+		err = stream_balloc(inode, count, block);
+	return err;
+}
+
+/*
+ * Fingerprint every block of a hole and resolve each one against the dedup
+ * index on its own.  Blocks that are all zero are left out: they stay in
+ * the hole, so they are never hashed, allocated or indexed, and read back
+ * as zeros.  The rest are hashed as one batch first, which may run on the
+ * hash workers; only the lookups and seg packing below are done one block
+ * at a time.  Space for the whole hole is allocated up front so that a miss
+ * can be entered in the write bucket the moment it is looked up: the htree
+ * entry made by the lookup points at the next free bucket slot, and a later
+ * block of the same hole may well be a duplicate of this one.  Misses take
+ * the reserved blocks in order, so runs of misses and runs of hits on
+ * consecutive blocks collapse into single segs, and whatever the hits and
+ * zero blocks left unused is freed at the end.
+ *
+ * Each lookup may start a new seg, so stop looking up once only one seg is
+ * left and map the remainder as plain new data.  Returns the number of segs
+ * written to map[].
+ */
+static int dedup_region(struct inode *inode, block_t index, unsigned count, struct seg map[], unsigned max_segs, int create)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned newstate = create == 2 ? 0 : SEG_NEW, used = 0, live = 0;
+	int verify = dedup_policy(inode) == DEDUP_POLICY_VERIFY || fingerprint_engines[sb->fingerprint].weak;
+	void *scratch = NULL;
+	block_t base;
+	int err, segs = 0;
+
+	assert(max_segs > 0);
+	void **data = malloc(count * (sizeof(void *) + sizeof(struct buffer_head *) + sizeof(struct hash_ref) + sizeof(unsigned) + FINGERPRINT_SIZE));
+	if (!data)
+		return -ENOMEM;
+	if (verify && !(scratch = malloc(sb->blocksize))) {
+		free(data);
+		return -ENOMEM;
+	}
+	struct buffer_head **buffers = (void *)(data + count);
+	struct hash_ref *ref = (void *)(buffers + count);
+	unsigned *which = (void *)(ref + count);
+	unsigned char (*hash)[FINGERPRINT_SIZE] = (void *)(which + count);
+	for (unsigned j = 0; j < count; j++) {
+		buffers[j] = blockget(mapping(inode), index + j);
+		if (zero_block(bufdata(buffers[j]), sb->blocksize))
+			continue;
+		data[live] = bufdata(buffers[j]);
+		which[live++] = j;
+	}
+	sb->dedupstat.count[DEDUP_ZERO] += count - live;
+	if (!live) {
+		trace("zero region %Lx/%x left as a hole", (L)index, count);
+		for (unsigned j = 0; j < count; j++)
+			brelse(buffers[j]);
+		free(scratch);
+		free(data);
+		map[0] = (struct seg){ .count = count, .state = SEG_HOLE };
+		return 1;
+	}
+	fingerprint_blocks(sb, data, hash, live);
+	if ((err = data_balloc(inode, count, &base))) {
+		base = 0;
+		goto error;
+	}
+	if ((err = hash_resolve(inode, hash, ref, live)))
+		goto error;
+	for (unsigned j = 0, k = 0; j < count; j++) {
+		struct hash_ref *this = k < live && which[k] == j ? ref + k++ : NULL;
+		block_t block = -1;
+		unsigned state;
+		/* a repeat of a new fingerprint shares the block of its leader */
+		if (this && this->block == -1 && ref[this->leader].use == HASH_INDEX)
+			this->block = ref[this->leader].block;
+		if (segs + 2 <= max_segs) {
+			if (this) {
+				this->use = this->block == -1 ? HASH_INDEX : HASH_SHARE;
+				if (verify && this->use == HASH_SHARE && !verify_dup(sb, ref, this - ref, data, scratch))
+					this->use = HASH_IGNORE, this->block = -1;
+				block = this->block;
+			} else
+				block = 0;
+		}
+		state = !block ? SEG_HOLE : block == -1 ? newstate : SEG_DUP;
+		if (block == -1)
+			block = base + used++;
+		if (this && this->use == HASH_INDEX)
+			this->block = block;
+		struct seg *last = map + segs - 1;
+		if (segs && last->state == state && last->count < MAX_EXTENT &&
+		    (state == SEG_HOLE || last->block + last->count == block)) {
+			last->count++;
+			continue;
+		}
+		assert(segs < max_segs);
+		trace("%s %Lx => %Lx", state == SEG_DUP ? "dup" : state == SEG_HOLE ? "zero" : "new", (L)(index + j), (L)block);
+		map[segs++] = (struct seg){ .block = block, .count = 1, .state = state };
+	}
+	if ((err = hash_commit(inode, hash, ref, live)))
+		goto error;
+	unsigned hits = 0;
+	for (unsigned k = 0; k < live; k++)
+		hits += ref[k].use == HASH_SHARE;
+	dedup_yield(inode, live, hits);
+	for (unsigned j = 0; j < count; j++)
+		brelse(buffers[j]);
+	free(scratch);
+	free(data);
+	if (used < count) {
+		trace("free %u blocks not needed for dups", count - used);
+		stream_bfree(inode, base + used, count - used);
+	}
+	return segs;
+error:
+	for (unsigned j = 0; j < count; j++)
+		brelse(buffers[j]);
+	free(scratch);
+	free(data);
+	if (base)
+		stream_bfree(inode, base, count);
+	return err;
+}
+
+/*
+ * Deduplicate an extent already on disk, for dedupd: the same batch lookup
+ * as dedup_region(), but the data was read back from base rather than
+ * being about to be written.  Blocks found in the index somewhere else
+ * become dups of those, new fingerprints are indexed where they already
+ * are, and zero blocks become holes.  Blocks no longer mapped are freed
+ * once their replacements are referenced.  The caller has the buffers
+ * read.  Returns the number of segs written to map[].
+ */
+static int redup_region(struct inode *inode, block_t index, block_t base, unsigned count, struct seg map[], unsigned max_segs)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	unsigned live = 0;
+	int verify = fingerprint_engines[sb->fingerprint].weak;
+	void *scratch = NULL;
+	int err, segs = 0;
+
+	assert(max_segs > 0);
+	void **data = malloc(count * (sizeof(void *) + sizeof(struct buffer_head *) + sizeof(struct hash_ref) + sizeof(unsigned) + FINGERPRINT_SIZE));
+	if (!data)
+		return -ENOMEM;
+	if (verify && !(scratch = malloc(sb->blocksize))) {
+		free(data);
+		return -ENOMEM;
+	}
+	struct buffer_head **buffers = (void *)(data + count);
+	struct hash_ref *ref = (void *)(buffers + count);
+	unsigned *which = (void *)(ref + count);
+	unsigned char (*hash)[FINGERPRINT_SIZE] = (void *)(which + count);
+	for (unsigned j = 0; j < count; j++) {
+		buffers[j] = blockget(mapping(inode), index + j);
+		if (zero_block(bufdata(buffers[j]), sb->blocksize))
+			continue;
+		data[live] = bufdata(buffers[j]);
+		which[live++] = j;
+	}
+	fingerprint_blocks(sb, data, hash, live);
+	if ((err = hash_resolve(inode, hash, ref, live)))
+		goto out;
+	for (unsigned j = 0, k = 0; j < count; j++) {
+		struct hash_ref *this = k < live && which[k] == j ? ref + k++ : NULL;
+		block_t block = base + j;
+		unsigned state;
+		if (this && this->block == -1 && ref[this->leader].use == HASH_INDEX)
+			this->block = ref[this->leader].block;
+		if (segs + 2 <= max_segs) {
+			if (!this)
+				block = 0;
+			else if (this->block == -1) {
+				this->use = HASH_INDEX;
+				this->block = block;
+			} else if (this->block != block) {
+				this->use = HASH_SHARE;
+				if (verify && !verify_dup(sb, ref, this - ref, data, scratch))
+					this->use = HASH_IGNORE;
+				else
+					block = this->block;
+			}
+		}
+		state = !block ? SEG_HOLE : block == base + j ? 0 : SEG_DUP;
+		if (state == SEG_HOLE)
+			sb->dedupstat.count[DEDUP_ZERO]++;
+		struct seg *last = map + segs - 1;
+		if (segs && last->state == state && last->count < MAX_EXTENT &&
+		    (state == SEG_HOLE || last->block + last->count == block)) {
+			last->count++;
+			continue;
+		}
+		assert(segs < max_segs);
+		trace("%s %Lx => %Lx", state == SEG_DUP ? "dup" : state == SEG_HOLE ? "zero" : "keep", (L)(index + j), (L)block);
+		map[segs++] = (struct seg){ .block = block, .count = 1, .state = state };
+	}
+	if ((err = hash_commit(inode, hash, ref, live)))
+		goto out;
+	for (int i = 0; i < segs; i++) {
+		if (map[i].state != 0 && (err = dedup_free(sb, base, map[i].count)))
+			break;
+		base += map[i].count;
+	}
+out:
+	for (unsigned j = 0; j < count; j++)
+		brelse(buffers[j]);
+	free(scratch);
+	free(data);
+	return err ? err : segs;
+}
+
+/*
+ * Pack a seg after the extent before it, filling that extent up first if the
+ * seg carries on from it on disk: a run of duplicates of contiguous blocks
+ * written over several flushes, or new data allocated right after the
+ * duplicates before it, packs into as few extents as if written at once.
+ */
+static void pack_extent(struct dwalk *walk, tuxkey_t index, block_t block, unsigned count)
+{
+	unsigned took = dwalk_extend(walk, index, make_extent(block, count));
+	if (took < count)
+		dwalk_add(walk, index + took, make_extent(block + took, count - took));
+}
+
 static int map_region(struct inode *inode, block_t start, unsigned count, struct seg map[], unsigned max_segs, int create)
 {
 	struct sb *sb = tux_sb(inode->i_sb);
 	struct btree *btree = &tux_inode(inode)->btree;
-	unsigned char *hash;
 	int segs = 0;
 
 	assert(max_segs > 0);
@@ -133,59 +420,74 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 		map[0].count = count;
 		map[0].state = SEG_HOLE;
 	}
-	block_t blk = -1;
-	struct buffer_head *buffer;
+	/*
+	 * File data is deduplicated inline by splitting holes as they fill,
+	 * unless the stream has backed off (see dedup_wanted()), or offline
+	 * by noting them here and splitting the extents later, in dedupd
+	 * (create == 3), as the file's dedup policy says (see xattr.c).
+	 */
+	int policy = dedup_policy(inode);
+	int dedup = policy == DEDUP_POLICY_INLINE || policy == DEDUP_POLICY_VERIFY;
+	/* data written from now on may be indexed, so freed through dedup_free() */
+	if (policy != DEDUP_POLICY_OFF)
+		tux_inode(inode)->btree.ops = &dtree_ops;
+	block_t at = start;
 	for (int i = 0; i < segs; i++) {
-		if (map[i].state == SEG_HOLE) {
-			if( inode->inum > 4 && inode->inum != 10 && inode->inum != 13) {
-				buffer = (blockget(mapping(inode),start)); /* DREAMZ */
-				hash = (unsigned char *)malloc(sizeof(unsigned char) * SHA_DIGEST_LENGTH);
-				hash = SHA1(bufdata(buffer),inode->i_sb->blocksize,hash); 
-				brelse(buffer);
-				blk = hash_lookup(inode, hash);
-			}
-			if(blk == -1){
-				count = map[i].count;
-				if ((err = balloc(sb, count, &block))) { // goal ???
-					/*
-					 * Out of space on file data allocation.  It happens.  Tread
-					 * carefully.  We have not stored anything in the btree yet,
-					 * so we free what we allocated so far.  We need to leave the
-					 * user with a nice ENOSPC return and all metadata consistent
-					 * on disk.  We better have reserved everything we need for
-					 * metadata, just giving up is not an option.
-					 */
-					/*
-					 * Alternatively, we can go ahead and try to record just what
-					 * we successfully allocated, then if the update fails on no
-					 * space for btree splits, free just the blocks for extents
-					 * we failed to store.
-					 */
-					segs = err;
-					goto out_create;
-				}
-				if(inode->inum > 4 && inode->inum != 13 && inode->inum != 10){
-					make_hash_entry(inode, hash, block);
-					free(hash);
-				}
-				trace("fill in %Lx/%i ", (L)block, count);
-				map[i] = (struct seg){
-					.block = block,
-					.count = count,
-					/* if create == 2, buffer should be dirty */
-					.state = create == 2 ? 0 : SEG_NEW,				
-				};
-			
+		int hole = map[i].state == SEG_HOLE;
+		count = map[i].count;
+		if (create == 3 ? !hole : hole && dedup && dedup_wanted(inode, count)) {
+			/* park the segs after this one at the top of map[] while it splits */
+			unsigned rest = segs - i - 1, room = max_segs - segs + 1;
+			vecmove(map + max_segs - rest, map + i + 1, rest);
+			int split = create == 3 ?
+				redup_region(inode, at, map[i].block, count, map + i, room) :
+				dedup_region(inode, at, count, map + i, room, create);
+			if (split < 0) {
+				segs = split;
+				goto out_create;
 			}
-			else{
-				if(inode->inum > 4 && inode->inum != 13 && inode->inum != 10)
-					free(hash);
-				trace("Duplicate found");
-				map[i] = (struct seg){ .block = blk, .count = count, .state = SEG_DUP, };
-		        }
-			
-			
+			vecmove(map + i + split, map + max_segs - rest, rest);
+			segs += split - 1;
+			i += split - 1;
+			at += count;
+			continue;
 		}
+		if (!hole || create == 3) {
+			at += count;
+			continue;
+		}
+		if ((err = data_balloc(inode, count, &block))) { // goal ???
+			/*
+			 * Out of space on file data allocation.  It happens.  Tread
+			 * carefully.  We have not stored anything in the btree yet,
+			 * so we free what we allocated so far.  We need to leave the
+			 * user with a nice ENOSPC return and all metadata consistent
+			 * on disk.  We better have reserved everything we need for
+			 * metadata, just giving up is not an option.
+			 */
+			/*
+			 * Alternatively, we can go ahead and try to record just what
+			 * we successfully allocated, then if the update fails on no
+			 * space for btree splits, free just the blocks for extents
+			 * we failed to store.
+			 */
+			segs = err;
+			goto out_create;
+		}
+		trace("fill in %Lx/%i ", (L)block, count);
+		if (policy == DEDUP_POLICY_OFFLINE &&
+		    (err = pending_add(sb, inode->inum, at, count))) {
+			stream_bfree(inode, block, count);
+			segs = err;
+			goto out_create;
+		}
+		map[i] = (struct seg){
+			.block = block,
+			.count = count,
+			/* if create == 2, buffer should be dirty */
+			.state = create == 2 ? 0 : SEG_NEW,
+		};
+		at += count;
 	}
 	/* Go back to region start and pack in new segs */
 	dwalk_chop(&headwalk);
@@ -210,17 +512,22 @@ static int map_region(struct inode *inode, block_t start, unsigned count, struct
 		}
 		if (i < 0) {
 			trace("emit below");
-			dwalk_add(&headwalk, seg_start, make_extent(below_block, below));
+			pack_extent(&headwalk, seg_start, below_block, below);
 			continue;
 		}
 		if (i == segs) {
 			trace("emit above");
-			dwalk_add(&headwalk, index, make_extent(above_block, above));
+			pack_extent(&headwalk, index, above_block, above);
+			continue;
+		}
+		/* zero blocks stay holes, see dedup_region() */
+		if (map[i].state == SEG_HOLE) {
+			index += map[i].count;
 			continue;
 		}
 		trace("pack 0x%Lx => %Lx/%x", (L)index, (L)map[i].block, map[i].count);
 		//dleaf_dump(btree, leaf);
-		dwalk_add(&headwalk, index, make_extent(map[i].block, map[i].count));
+		pack_extent(&headwalk, index, map[i].block, map[i].count);
 		//dleaf_dump(btree, leaf);
 		index += map[i].count;
 	}
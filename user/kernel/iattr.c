@@ -163,7 +163,9 @@ void *decode_attrs(struct inode *inode, void *attrs, unsigned size)
 			break;
 		case DATA_BTREE_ATTR:
 			attrs = decode64(attrs, &v64);
-			init_btree(&tuxnode->btree, sb, unpack_root(v64), &dtree_ops);
+			/* the mode comes first, a regular file may have been indexed */
+			init_btree(&tuxnode->btree, sb, unpack_root(v64),
+				   S_ISREG(inode->i_mode) ? &dtree_ops : &dtree_unindexed_ops);
 			break;
 		case XATTR_ATTR:;
 			// immediate xattr: kind+version:16, bytes:16, atom:16, data[bytes - 2]
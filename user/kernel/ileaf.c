@@ -269,6 +269,17 @@ inum_t find_empty_inode(struct btree *btree, struct ileaf *leaf, inum_t goal)
 	return i + ibase(leaf);
 }
 
+/* First inode at or after goal that has attributes in leaf, or -1 if none */
+inum_t find_used_inode(struct btree *btree, struct ileaf *leaf, inum_t goal)
+{
+	be_u16 *dict = (void *)leaf + btree->sb->blocksize;
+	unsigned i = goal > ibase(leaf) ? goal - ibase(leaf) : 0;
+	for (; i < icount(leaf); i++)
+		if (from_be_u16(*(dict - i - 1)) != atdict(dict, i))
+			return i + ibase(leaf);
+	return -1;
+}
+
 int ileaf_purge(struct btree *btree, inum_t inum, struct ileaf *leaf)
 {
 	if (inum < ibase(leaf) || inum - ibase(leaf) >= btree->entries_per_leaf)
@@ -297,4 +308,5 @@ struct btree_ops itable_ops = {
 	.leaf_split = ileaf_split,
 	.leaf_resize = ileaf_resize,
 	.balloc = balloc,
+	.search = SEARCH_BINARY,
 };
@@ -85,6 +85,8 @@ struct inode *tux_new_inode(struct inode *dir, struct tux_iattr *iattr,
 	tux_set_inum(inode, TUX_INVALID_INO);
 	tux_inode(inode)->present = CTIME_SIZE_BIT|MTIME_BIT|MODE_OWNER_BIT|DATA_BTREE_BIT|LINK_COUNT_BIT;
 	tux_setup_inode(inode, rdev);
+	if (dedup_policy_inherit(inode, dir))
+		warn("dedup policy not inherited");
 	return inode;
 }
 
@@ -212,7 +214,8 @@ static int make_inode(struct inode *inode, inum_t goal)
 
 	tux_set_inum(inode, goal);
 	if (tux_inode(inode)->present & DATA_BTREE_BIT)
-		if ((err = new_btree(&tux_inode(inode)->btree, sb, &dtree_ops)))
+		if ((err = new_btree(&tux_inode(inode)->btree, sb,
+				     dedup_policy(inode) == DEDUP_POLICY_OFF ? &dtree_unindexed_ops : &dtree_ops)))
 			goto release;
 	if ((err = store_attrs(inode, cursor)))
 		goto out;
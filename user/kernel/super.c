@@ -43,6 +43,8 @@ static struct inode *tux3_alloc_inode(struct super_block *sb)
 	tuxi->btree = (struct btree){ };
 	tuxi->present = 0;
 	tuxi->xcache = NULL;
+	tuxi->dedup = DEDUP_POLICY_UNKNOWN;
+	tuxi->container = (struct container){ };
 
 	/* uninitialized stuff by alloc_inode() */
 	tuxi->vfs_inode.i_version = 1;
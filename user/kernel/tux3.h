@@ -9,6 +9,7 @@
 #include <linux/fs.h>
 #include <linux/buffer_head.h>
 #include <linux/mutex.h>
+#include <linux/crc32c.h>
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(2,6,27)
 #include <linux/cred.h> // fsuid
@@ -156,7 +157,7 @@ static inline void link_del_next(struct link *node)
 /* Tux3 disk format */
 
 #define SB_MAGIC_SIZE 8
-#define SB_MAGIC { 't', 'u', 'x', '3', 0xdd, 0x08, 0x12, 0x12 } /* date of latest incompatible sb format */
+#define SB_MAGIC { 't', 'u', 'x', '3', 0xdd, 0x26, 0x10, 0x16 } /* date of latest incompatible sb format */
 /*
  * disk format revision history
  * !!! always update this for every incompatible change !!!
@@ -164,6 +165,7 @@ static inline void link_del_next(struct link *node)
  * 2008-08-06: Beginning of time
  * 2008-09-06: Actual checking starts
  * 2008-12-12: Atom dictionary size in disksuper instead of atable->i_size
+ * 2026-10-16: Packed big endian dedup index and bucket entries
  */
 
 #define MAX_INODES_BITS 48
@@ -181,17 +183,34 @@ static inline void link_del_next(struct link *node)
 #define TUX_ATABLE_INO		10
 #define TUX_ROOTDIR_INO		13
 
+/* Dedup statistics, kept in the superblock, see dedup.c */
+
+enum {
+	DEDUP_LOOKUPS, DEDUP_BUCKET_HITS, DEDUP_CACHE_HITS, DEDUP_HTREE_PROBES,
+	DEDUP_HTREE_HITS, DEDUP_BUCKET_READS, DEDUP_COLLISIONS, DEDUP_NEW_BUCKETS,
+	DEDUP_SAVED, DEDUP_ZERO, DEDUP_COUNTERS
+};
+
+enum { DEDUP_TIME_HASH, DEDUP_TIME_LOOKUP, DEDUP_TIME_BUCKET, DEDUP_TIME_HTREE, DEDUP_TIMERS };
+
+#define DEDUP_TIME_SLOTS 8	/* latencies in steps of four from a microsecond */
+
+struct dedupstat {
+	u64 count[DEDUP_COUNTERS];
+	u64 time[DEDUP_TIMERS][DEDUP_TIME_SLOTS];
+};
+
 struct disksuper
 {
 	/* Update magic on any incompatible format change */
 	char magic[SB_MAGIC_SIZE];
 	be_u64 birthdate;	/* Volume creation date */
-	be_u64 flags;		/* Need to assign some flags */
+	be_u64 flags;		/* Volume format flags, SB_* below */
 	be_u64 iroot;		/* Root of the inode table btree */
 	be_u64 aroot;		/* The atime table is a file now, delete on next format rev */
 	be_u64 hroot;           /*Root of the hash btree DREAMZ */
 	be_u16 blockbits;	/* Shift to get volume block size */
-	be_u16 unused1;		/* Throw away on next format rev */
+	be_u16 fingerprint;	/* Dedup fingerprint engine, zero is SHA-1 */
 	be_u32 unused2;		/* Throw away on next format rev */
 	be_u64 volblocks;	/* Volume size */
 	/* The rest should be moved to a "metablock" that is updated frequently */
@@ -200,6 +219,61 @@ struct disksuper
 	be_u32 freeatom;	/* Beginning of persistent free atom list in atable */
 	be_u32 atomgen;		/* Next atom number if there are no free atoms */
 	be_u64 dictsize;	/* Size of the atom dictionary instead if i_size */
+	be_u64 bloom;		/* Fingerprint filter, log2 bits << 48 | block */
+	be_u64 rroot;		/* Root of the dedup refcount btree, zero if none yet */
+	be_u64 dedupstat[DEDUP_COUNTERS + DEDUP_TIMERS * DEDUP_TIME_SLOTS];
+	be_u64 crctable;	/* Data block checksums, zero if none */
+	be_u64 logindex;	/* Fingerprint log directory, zero if none */
+	be_u64 pending;		/* Newest block of extents waiting for dedupd, zero if none */
+	be_u64 dead;		/* Dead list as of the last sync, zero if empty */
+};
+
+#define SB_TAGGED_INDEX (1 << 0) /* htree entries carry fingerprint tags, see dedup.c */
+#define SB_LOG_INDEX (1 << 1) /* fingerprints indexed by a log instead of the htree */
+#define SB_DEDUP_OFFLINE (1 << 2) /* writes only note new extents, dedupd dedups them later */
+#define SB_DEDUP_OFF (1 << 3) /* file data is not deduplicated at all */
+
+/* Dedup policy of a file, from its tux3.dedup attribute, see xattr.c */
+enum {
+	DEDUP_POLICY_UNKNOWN, DEDUP_POLICY_VOLUME, DEDUP_POLICY_OFF,
+	DEDUP_POLICY_INLINE, DEDUP_POLICY_OFFLINE, DEDUP_POLICY_VERIFY
+};
+
+/* Dedup fingerprints, see dedup.c */
+
+#define FINGERPRINT_SIZE 20
+#define REFBUCKETS 8	/* read buckets an inode keeps looking in */
+
+enum { FINGERPRINT_SHA1, FINGERPRINT_SHA256, FINGERPRINT_BLAKE2S, FINGERPRINT_XXH64, FINGERPRINT_ENGINES };
+
+struct fingerprint_engine {
+	const char *name;
+	void (*hash)(const void *data, unsigned size, unsigned char *hash);
+	int weak;	/* matches may differ, compare the data before sharing */
+};
+
+/* One fingerprint of a batch lookup, see hash_resolve() */
+struct hash_ref {
+	block_t block;		/* data block, -1 if the fingerprint is new */
+	block_t bucket;		/* bucket entry of the fingerprint, if known */
+	int slot;
+	unsigned leader;	/* first entry in the batch with this fingerprint */
+	unsigned char use;	/* what hash_commit() does with it, set by caller */
+	unsigned char collide;	/* key is indexed for a different fingerprint */
+};
+
+enum { HASH_IGNORE, HASH_SHARE, HASH_INDEX };
+
+/* Dedup yield of a write stream over its recent blocks, see dedup.c */
+struct dedup_yield {
+	unsigned looked, hits;	/* blocks looked up and found, halved as the window fills */
+	unsigned skipped;	/* blocks written without lookups since the last sample */
+	unsigned off;		/* backed off to plain allocation */
+};
+
+/* Open container of a write stream, see balloc.c */
+struct container {
+	block_t next, limit;	/* blocks from next up to limit not yet used */
 };
 
 struct root {
@@ -244,6 +318,22 @@ struct cursor {
 	} path[];
 };
 
+/* Bottom up btree construction from ascending keys, see btree.c */
+
+#define BTREE_LOAD_LEVELS 16
+
+struct btree_load {
+	struct btree *btree;
+	struct buffer_head *leafbuf;	/* Leaf being filled, NULL before the first */
+	tuxkey_t leafkey;		/* First key of that leaf */
+	unsigned levels;		/* Index levels started so far */
+	struct load_level {
+		struct buffer_head *buffer; /* Index node being filled */
+		tuxkey_t key;		/* First key below it */
+	} level[BTREE_LOAD_LEVELS];
+	int err;
+};
+
 struct stash { struct link *tail; u64 *pos, *top; };
 
 /* Tux3-specific sb is a handle for the entire volume state */
@@ -253,6 +343,7 @@ struct sb {
 	struct inode *volmap;	/* Volume metadata cache (like blockdev).
 				 * Note, ->btree is the btree for itable. */
 	struct btree htree;    /* Cached root of the hash table DREAMZ */
+	struct btree rtree;	/* Extra references to shared data blocks */
 	struct inode *bitmap;	/* allocation bitmap special file */
 	struct inode *rootdir;	/* root directory special file */
 	struct inode *vtable;	/* version table special file */
@@ -276,11 +367,33 @@ struct sb {
 	struct mutex loglock;	/* serialize log entries (spinlock me) */
 	struct stash defree;	/* defer extent frees until affer commit */
 	u16 entries_per_bucket; /*Number of entries per bucket */
-	int readcheck; /* Mount point flag for data integrity check */
+	unsigned flags;		/* Volume format flags, SB_* */
+	unsigned fingerprint;	/* Index of dedup fingerprint engine */
+	struct fpcache *fpcache; /* Recently seen fingerprints, see dedup.c */
+	block_t bloom;		/* Fingerprint filter location, zero if none */
+	unsigned bloombits;	/* Log2 of fingerprint filter size in bits */
+	unsigned bloomkeys, bloomstale; /* Keys set in the filter, and taken out of the index since */
+	struct bloomstat { u64 probes, skips, falsepos; } bloomstat;
+	struct verifystat { u64 compares, reads, mismatches; } verifystat; /* Dedup policy verify */
+	struct dedupstat dedupstat; /* Dedup counters and latencies */
+	struct refdelta *refdelta; /* Refcount changes not yet in the rtree */
+	struct deadlist *dead;	/* Unreferenced data blocks still in the index */
+	block_t deadblock;	/* Dead list on disk, zero if none, see dead_flush() */
+	unsigned bucketgen;	/* Bumped when the collector moves bucket entries */
+	block_t crctable;	/* Data block checksums, zero if none, see dedup.c */
+	int readcheck; /* Mount point flag, verify data reads against crctable */
+	block_t logindex;	/* Fingerprint log directory, zero if none, see dedup.c */
+	struct fplog *fplog;	/* Fingerprint log entries not written yet */
+	struct readcache *readcache; /* Data blocks by volume block, see dedup.c */
+	block_t pendblock;	/* Newest block of noted extents on disk, zero if none */
+	struct pendlist *pending; /* Extents noted for dedupd not written yet */
+	struct dedup_yield yield; /* Of all writes, for files with little history */
+	u64 plainblocks;	/* Data blocks written without lookups while backed off */
 #ifdef __KERNEL__
 	struct super_block *vfs_sb; /* Generic kernel superblock */
 #else
 	struct dev *dev;		/* userspace block device */
+	struct hashpool *hashpool; /* fingerprint workers, NULL hashes inline */
 #endif
 };
 
@@ -306,6 +419,8 @@ typedef struct {
 	inum_t inum;		/* Inode number.  Fixme: also in generic inode */
 	unsigned present;	/* Attributes decoded from or to be encoded to inode table */
 	struct xcache *xcache;	/* Extended attribute cache */
+	unsigned char dedup;	/* DEDUP_POLICY_* of its own, UNKNOWN until looked up */
+	struct container container; /* Where its new data goes, see stream_balloc() */
 	struct inode vfs_inode;	/* Generic kernel inode */
 } tuxnode_t;
 
@@ -352,6 +467,7 @@ typedef struct inode {
 	inum_t inum;
 	unsigned present;
 	struct xcache *xcache;
+	unsigned char dedup;	/* DEDUP_POLICY_* of its own, UNKNOWN until looked up */
 	struct sb *i_sb;
 	map_t *map;
 	loff_t i_size;
@@ -360,8 +476,11 @@ typedef struct inode {
 	unsigned i_mode, i_uid, i_gid, i_nlink;
 	struct mutex i_mutex;
 	dev_t i_rdev;
-	block_t refbucket;      /* points to block number of current read bucket*/
+	block_t refbucket[REFBUCKETS]; /* read buckets hit lately, most recent first */
 	block_t writebucket;    /* points to block number of current write bucket */
+	unsigned bucketgen;	/* sb->bucketgen the buckets above are from */
+	struct dedup_yield yield; /* Of this file's writes, see dedup_wanted() */
+	struct container container; /* Where its new data goes, see stream_balloc() */
 } tuxnode_t;
 
 struct file {
@@ -401,6 +520,12 @@ static inline struct btree *itable_btree(struct sb *sb)
 	return &tux_inode(sb->volmap)->btree;
 }
 
+/* Volume blocks in the data checksum table, one be_u32 per volume block */
+static inline unsigned crctable_blocks(struct sb *sb)
+{
+	return (sb->volblocks + (sb->blocksize >> 2) - 1) >> (sb->blockbits - 2);
+}
+
 #define TUX_LINK_MAX 64		/* just for debug for now */
 
 #define TUX_NAME_LEN 255
@@ -525,6 +650,12 @@ static inline void inc_dleaf_groups(struct dleaf *leaf, int n)
 
 typedef void vleaf;
 
+/*
+ * How probe() searches index nodes.  Binary suits any key distribution,
+ * interpolation only pays off for evenly spread keys like fingerprints.
+ */
+enum { SEARCH_BINARY, SEARCH_INTERPOLATE };
+
 struct btree_ops {
 	void (*btree_init)(struct btree *btree);
 	int (*leaf_sniff)(struct btree *btree, vleaf *leaf);
@@ -539,8 +670,15 @@ struct btree_ops {
 	void (*leaf_merge)(struct btree *btree, vleaf *into, vleaf *from);
 	int (*balloc)(struct sb *sb, unsigned blocks, block_t *block);
 	int (*bfree)(struct sb *sb, block_t block, unsigned blocks);
+	unsigned search;	/* index node search strategy */
 };
 
+/* Guess the position of key between first at lo and last at hi, lo < hi */
+static inline unsigned interpolate(tuxkey_t key, tuxkey_t first, tuxkey_t last, unsigned lo, unsigned hi)
+{
+	return lo + (key - first) / ((last - first) / (hi - lo) + 1);
+}
+
 /*
  * Tux3 times are 32.32 fixed point while time attributes are stored in 32.16
  * format, trading away some precision to compress time fields by two bytes
@@ -572,7 +710,10 @@ static inline fixed32 tuxtime(struct timespec time)
 void hexdump(void *data, unsigned size);
 int balloc(struct sb *sb, unsigned blocks, block_t *block);
 int bfree(struct sb *sb, block_t start, unsigned blocks);
+int stream_balloc(struct inode *inode, unsigned blocks, block_t *block);
+int stream_bfree(struct inode *inode, block_t start, unsigned blocks);
 int update_bitmap(struct sb *sb, block_t start, unsigned count, int set);
+int dedup_free(struct sb *sb, block_t start, unsigned blocks); /* dedup.c */
 
 enum atkind {
 	MIN_ATTR = 6,
@@ -694,21 +835,62 @@ struct buffer_head *new_leaf(struct btree *btree);
 int probe(struct btree *btree, tuxkey_t key, struct cursor *cursor);
 int advance(struct btree *btree, struct cursor *cursor);
 tuxkey_t next_key(struct cursor *cursor, int depth);
+int probe_forward(struct btree *btree, tuxkey_t key, struct cursor *cursor);
 int tree_chop(struct btree *btree, struct delete_info *info, millisecond_t deadline);
 int btree_insert_leaf(struct cursor *cursor, tuxkey_t key, struct buffer_head *leafbuf);
 int btree_leaf_split(struct btree *btree, struct cursor *cursor, tuxkey_t key);
 void *tree_expand(struct btree *btree, tuxkey_t key, unsigned newsize, struct cursor *cursor);
 void show_tree_range(struct btree *btree, tuxkey_t start, unsigned count);
 void show_tree(struct btree *btree);
+void btree_load_begin(struct btree_load *load, struct btree *btree);
+int btree_load_leaf(struct btree_load *load, tuxkey_t key);
+void *btree_load_add(struct btree_load *load, tuxkey_t key, unsigned newsize);
+int btree_load_finish(struct btree_load *load);
 
 /* dedup.c */
-block_t bucket_lookup(struct inode *inode, unsigned char *hash);
-void make_hash_entry(struct inode *inode, unsigned char *hash, block_t block);
+extern struct fingerprint_engine fingerprint_engines[];
+int fingerprint_engine(const char *name);
+int make_bloom(struct sb *sb, unsigned bits);
+int rebuild_bloom(struct sb *sb);
+int make_crctable(struct sb *sb);
+int make_fplog(struct sb *sb);
+int fplog_flush(struct sb *sb);
+int fplog_runs(struct sb *sb, unsigned *entries);
+void crc_record(struct sb *sb, block_t block, const void *data);
+int crc_verify(struct sb *sb, block_t block, const void *data);
+int readcache_read(struct sb *sb, block_t block, void *data);
+void readcache_insert(struct sb *sb, block_t block, const void *data);
+void readcache_forget(struct sb *sb, block_t block);
+int dedup_mode(const char *name);
+int pending_add(struct sb *sb, inum_t inum, block_t index, unsigned count);
+int pending_flush(struct sb *sb);
+int pending_load(struct sb *sb);
+int fold_refcounts(struct sb *sb);
+void dedup_ref(struct sb *sb, block_t block, int delta);
+int dedup_refs(struct sb *sb, block_t block);
+int dedup_gc_due(struct sb *sb);
+int dedup_gc(struct sb *sb);
+int dedup_reclaim(struct sb *sb);
+int dead_flush(struct sb *sb);
+int dead_load(struct sb *sb);
+void fingerprint(struct sb *sb, const void *data, unsigned char *hash);
+void fingerprint_blocks(struct sb *sb, void *data[], unsigned char (*hash)[FINGERPRINT_SIZE], unsigned count);
+int zero_block(const void *data, unsigned size);
+int dedupstat_show(struct sb *sb, char *buf, unsigned size);
+int make_hash_entry(struct inode *inode, unsigned char *hash, block_t block);
 void init_writebucket(struct inode *inode);
 block_t htree_lookup(struct inode *inode, struct btree *btree, u64 sh, unsigned char *hash);
 block_t handle_collision(struct inode* inode, struct bucket_entry* entry, struct hleaf_entry* temp ,unsigned char* hash, int first);
-block_t hash_lookup(struct inode *inode, unsigned char *hash);
+int dedup_wanted(struct inode *inode, unsigned count);
+void dedup_yield(struct inode *inode, unsigned looked, unsigned hits);
+int hash_resolve(struct inode *inode, unsigned char (*hash)[FINGERPRINT_SIZE], struct hash_ref *ref, unsigned count);
+int hash_commit(struct inode *inode, unsigned char (*hash)[FINGERPRINT_SIZE], struct hash_ref *ref, unsigned count);
+struct index_build *new_index_build(void);
+void free_index_build(struct index_build *build);
+int index_build_extent(struct sb *sb, struct index_build *build, block_t block, unsigned count);
+int index_build_finish(struct sb *sb, struct index_build *build);
 extern struct btree_ops htree_ops;
+extern struct btree_ops rtree_ops;
 
 /* dir.c */
 int tux_update_entry(struct buffer_head *buffer, tux_dirent *entry, inum_t inum, unsigned mode);
@@ -727,7 +909,7 @@ void dleaf_dump(struct btree *btree, vleaf *vleaf);
 int dleaf_split_at(vleaf *from, vleaf *into, struct entry *entry, unsigned blocksize);
 void dleaf_merge(struct btree *btree, vleaf *vinto, vleaf *vfrom);
 unsigned dleaf_need(struct btree *btree, vleaf *vleaf);
-extern struct btree_ops dtree_ops;
+extern struct btree_ops dtree_ops, dtree_unindexed_ops;
 
 int dwalk_end(struct dwalk *walk);
 block_t dwalk_block(struct dwalk *walk);
@@ -740,6 +922,7 @@ int dwalk_mock(struct dwalk *walk, tuxkey_t index, struct diskextent extent);
 void dwalk_copy(struct dwalk *walk, struct dleaf *dest);
 void dwalk_chop(struct dwalk *walk);
 int dwalk_add(struct dwalk *walk, tuxkey_t index, struct diskextent extent);
+unsigned dwalk_extend(struct dwalk *walk, tuxkey_t index, struct diskextent extent);
 
 /* filemap.c */
 int tux3_get_block(struct inode *inode, sector_t iblock,
@@ -757,6 +940,7 @@ void *decode_attrs(struct inode *inode, void *attrs, unsigned size);
 /* ileaf.c */
 void *ileaf_lookup(struct btree *btree, inum_t inum, struct ileaf *leaf, unsigned *result);
 inum_t find_empty_inode(struct btree *btree, struct ileaf *leaf, inum_t goal);
+inum_t find_used_inode(struct btree *btree, struct ileaf *leaf, inum_t goal);
 int ileaf_purge(struct btree *btree, inum_t inum, struct ileaf *leaf);
 extern struct btree_ops itable_ops;
 
@@ -779,6 +963,9 @@ int xcache_dump(struct inode *inode);
 struct xcache *new_xcache(unsigned maxsize);
 int get_xattr(struct inode *inode, const char *name, unsigned len, void *data, unsigned size);
 int set_xattr(struct inode *inode, const char *name, unsigned len, const void *data, unsigned size, unsigned flags);
+int del_xattr(struct inode *inode, const char *name, unsigned len);
+int dedup_policy(struct inode *inode);
+int dedup_policy_inherit(struct inode *inode, struct inode *dir);
 void *encode_xattrs(struct inode *inode, void *attrs, unsigned size);
 unsigned decode_xsize(struct inode *inode, void *attrs, unsigned size);
 unsigned encode_xsize(struct inode *inode);
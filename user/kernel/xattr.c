@@ -363,6 +363,10 @@ int get_xattr(struct inode *inode, const char *name, unsigned len, void *data, u
 		goto out;
 	}
 	struct xattr *xattr = xcache_lookup(tux_inode(inode)->xcache, atom);
+	if (IS_ERR(xattr)) {
+		ret = PTR_ERR(xattr);
+		goto out;
+	}
 	ret = xattr->size;
 	if (ret < size)
 		memcpy(data, xattr->body, ret);
@@ -373,14 +377,22 @@ out:
 	return ret;
 }
 
+static int dedup_attr(const char *name, unsigned len);
+static int dedup_policy_parse(const void *data, unsigned size);
+
 int set_xattr(struct inode *inode, const char *name, unsigned len, const void *data, unsigned size, unsigned flags)
 {
 	struct inode *atable = tux_sb(inode->i_sb)->atable;
+	int policy = dedup_attr(name, len) ? dedup_policy_parse(data, size) : DEDUP_POLICY_UNKNOWN;
+	if (policy < 0)
+		return policy;
 	mutex_lock(&atable->i_mutex);
 	change_begin(tux_sb(inode->i_sb));
 	atom_t atom = make_atom(atable, name, len);
 	int err = (atom == -1) ? -EINVAL :
 		xcache_update(inode, atom, data, size, flags);
+	if (!err && policy)
+		tux_inode(inode)->dedup = policy;
 	change_end(tux_sb(inode->i_sb));
 	mutex_unlock(&atable->i_mutex);
 	return err;
@@ -406,6 +418,8 @@ int del_xattr(struct inode *inode, const char *name, unsigned len)
 	int used = remove_old(xcache, xattr);
 	if (used)
 		use_atom(atable, atom, -used);
+	if (dedup_attr(name, len))
+		tux_inode(inode)->dedup = DEDUP_POLICY_VOLUME;
 out:
 	change_end(tux_sb(inode->i_sb));
 	mutex_unlock(&atable->i_mutex);
@@ -444,6 +458,84 @@ fail:
 	return -EINVAL;
 }
 
+/*
+ * Dedup policy
+ *
+ * How a file's data is deduplicated is set by its tux3.dedup attribute:
+ * "off", "inline", "offline" (noted for dedupd, see dedup.c) or "verify",
+ * which is inline with every match compared byte for byte before it is
+ * shared.  A file with no attribute follows the volume, as made by mkfs
+ * --dedup.  A new file or directory is given the attribute of the
+ * directory it is made in, so setting it on a directory covers everything
+ * created below it from then on; files already there keep their own.
+ * Only regular files are deduplicated, whatever the attribute says, as
+ * directories and the special files are rewritten in place.  The attribute
+ * is looked up the first time it is needed and cached in the inode, and
+ * setting or removing it updates the cache.
+ */
+
+#define DEDUP_ATTR "tux3.dedup"
+
+static const char *dedup_policy_names[] = {
+	[DEDUP_POLICY_OFF] = "off",
+	[DEDUP_POLICY_INLINE] = "inline",
+	[DEDUP_POLICY_OFFLINE] = "offline",
+	[DEDUP_POLICY_VERIFY] = "verify",
+};
+
+static int dedup_attr(const char *name, unsigned len)
+{
+	return len == strlen(DEDUP_ATTR) && !memcmp(name, DEDUP_ATTR, len);
+}
+
+static int dedup_policy_parse(const void *data, unsigned size)
+{
+	for (int i = DEDUP_POLICY_OFF; i < ARRAY_SIZE(dedup_policy_names); i++)
+		if (size == strlen(dedup_policy_names[i]) && !memcmp(data, dedup_policy_names[i], size))
+			return i;
+	return -EINVAL;
+}
+
+/* The inode's own policy, or DEDUP_POLICY_VOLUME if it has none */
+static int dedup_policy_own(struct inode *inode)
+{
+	tuxnode_t *tuxnode = tux_inode(inode);
+	if (tuxnode->dedup == DEDUP_POLICY_UNKNOWN) {
+		char value[16];
+		int size = -ENOATTR, policy;
+		if (tuxnode->xcache)
+			size = get_xattr(inode, DEDUP_ATTR, strlen(DEDUP_ATTR), value, sizeof(value));
+		policy = size < 0 ? -ENOATTR : dedup_policy_parse(value, size);
+		tuxnode->dedup = policy < 0 ? DEDUP_POLICY_VOLUME : policy;
+	}
+	return tuxnode->dedup;
+}
+
+/* How the data written to an inode is deduplicated, never UNKNOWN or VOLUME */
+int dedup_policy(struct inode *inode)
+{
+	struct sb *sb = tux_sb(inode->i_sb);
+	if (!S_ISREG(inode->i_mode))
+		return DEDUP_POLICY_OFF;
+	int policy = dedup_policy_own(inode);
+	if (policy != DEDUP_POLICY_VOLUME)
+		return policy;
+	return sb->flags & SB_DEDUP_OFF ? DEDUP_POLICY_OFF :
+		sb->flags & SB_DEDUP_OFFLINE ? DEDUP_POLICY_OFFLINE : DEDUP_POLICY_INLINE;
+}
+
+/* Give a new inode the policy attribute of the directory it is made in */
+int dedup_policy_inherit(struct inode *inode, struct inode *dir)
+{
+	int policy = dedup_policy_own(dir);
+	if (policy == DEDUP_POLICY_VOLUME) {
+		tux_inode(inode)->dedup = policy;
+		return 0;
+	}
+	const char *name = dedup_policy_names[policy];
+	return set_xattr(inode, DEDUP_ATTR, strlen(DEDUP_ATTR), name, strlen(name), 0);
+}
+
 /* Xattr encode/decode */
 
 void *encode_xattrs(struct inode *inode, void *attrs, unsigned size)
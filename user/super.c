@@ -28,7 +28,8 @@ int load_sb(struct sb *sb)
 		return err;
 	init_btree(itable_btree(sb), sb, iroot, &itable_ops);
 	init_btree(&sb->htree, sb, sb->htree.root, &htree_ops);
-	return 0;
+	init_btree(&sb->rtree, sb, sb->rtree.root, &rtree_ops);
+	return dead_load(sb);
 }
 
 int save_sb(struct sb *sb)
@@ -41,6 +42,23 @@ int save_sb(struct sb *sb)
 int sync_super(struct sb *sb)
 {
 	int err;
+	printf("fold refcounts\n");
+	if ((err = fold_refcounts(sb)))
+		return err;
+	printf("flush fingerprint log\n");
+	if ((err = fplog_flush(sb)))
+		return err;
+	printf("flush pending extents\n");
+	if ((err = pending_flush(sb)))
+		return err;
+	if (dedup_gc_due(sb)) {
+		printf("collect dead blocks\n");
+		if ((err = dedup_gc(sb)) < 0)
+			return err;
+	}
+	printf("flush dead list\n");
+	if ((err = dead_flush(sb)))
+		return err;
 	printf("sync rootdir\n");
 	if ((err = tuxsync(sb->rootdir)))
 		return err;
@@ -59,6 +77,16 @@ int sync_super(struct sb *sb)
 	return 0;
 }
 
+/* Collect whatever is dead rather than leave it to the next mount */
+int put_super(struct sb *sb)
+{
+	int err;
+	printf("collect dead blocks\n");
+	if ((err = dedup_gc(sb)) < 0)
+		return err;
+	return sync_super(sb);
+}
+
 static int clear_other_magic(struct sb *sb)
 {
 	int err;
@@ -102,6 +130,25 @@ int make_tux3(struct sb *sb)
 	err = new_btree(&sb->htree, sb, &htree_ops);
 	if (err)
 		goto eek;
+	sb->entries_per_bucket = (sb->blocksize - offsetof(struct bucket, entries)) / sizeof(struct bucket_entry);
+	sb->flags |= SB_TAGGED_INDEX;
+	if (sb->flags & SB_LOG_INDEX) {
+		trace("create fingerprint log");
+		if ((err = make_fplog(sb)))
+			goto eek;
+	}
+	trace("create refcount table");
+	err = new_btree(&sb->rtree, sb, &rtree_ops);
+	if (err)
+		goto eek;
+	if (sb->bloombits) {
+		trace("create fingerprint filter");
+		if ((err = make_bloom(sb, sb->bloombits)))
+			goto eek;
+	}
+	trace("create checksum table");
+	if ((err = make_crctable(sb)))
+		goto eek;
 	sb->bitmap->i_size = (sb->volblocks + 7) >> 3;
 	trace("create bitmap inode");
 	if (make_inode(sb->bitmap, TUX_BITMAP_INO))
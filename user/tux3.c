@@ -30,15 +30,32 @@ void usage(poptContext optCon, int exitcode, char *error, char *addl) {
 	exit(exitcode);
 }
 
+/* Log2 of a fingerprint filter size giving about perblock bits per volume block */
+static unsigned bloom_order(struct sb *sb, int perblock)
+{
+	unsigned bits = 0;
+	while (perblock > 0 && (1ULL << bits) < (u64)sb->volblocks * perblock)
+		bits++;
+	return bits;
+}
+
 int main(int argc, const char *argv[])
 {
 	char opts[1001]; // overflow???
 	poptContext popt;
-	char *seekarg = NULL;
-	unsigned blocksize = 0;
+	char *seekarg = NULL, *fingerprint = NULL, *index = NULL, *dedup = NULL;
+	unsigned blocksize = 0, hashers = 0, budget = 0, rate = 0;
+	int bloom = -1;
 	struct poptOption options[] = {
 		{ "seek", 's', POPT_ARG_STRING, &seekarg, 0, "seek offset", "<offset>" },
 		{ "blocksize", 'b', POPT_ARG_INT, &blocksize, 0, "filesystem blocksize", "<size>" },
+		{ "fingerprint", 'f', POPT_ARG_STRING, &fingerprint, 0, "dedup fingerprint engine (sha1, sha256, blake2s, xxh64)", "<name>" },
+		{ "bloom", 0, POPT_ARG_INT, &bloom, 0, "fingerprint filter bits per volume block (default 8, 0 for none)", "<bits>" },
+		{ "index", 0, POPT_ARG_STRING, &index, 0, "fingerprint index (htree, log)", "<kind>" },
+		{ "dedup", 0, POPT_ARG_STRING, &dedup, 0, "dedup mode (inline, offline, off)", "<mode>" },
+		{ "budget", 0, POPT_ARG_INT, &budget, 0, "blocks dedupd reads each run (default all)", "<blocks>" },
+		{ "rate", 0, POPT_ARG_INT, &rate, 0, "blocks dedupd reads each second (default no limit)", "<blocks>" },
+		{ "hashers", 'j', POPT_ARG_INT, &hashers, 0, "fingerprint worker threads (default one per cpu)", "<count>" },
 		POPT_AUTOHELP
 		{ NULL, 0, 0, NULL, 0 }};
 
@@ -86,6 +103,29 @@ int main(int argc, const char *argv[])
 		if (poptPeekArg(popt))
 			goto usage;
 		sb->super = (struct disksuper){ .magic = SB_MAGIC, .volblocks = to_be_u64(sb->blockbits) };
+		if (fingerprint) {
+			int engine = fingerprint_engine(fingerprint);
+			if (engine < 0) {
+				fprintf(stderr, "unknown fingerprint engine '%s'\n", fingerprint);
+				exit(1);
+			}
+			sb->fingerprint = engine;
+		}
+		if (index && !strcmp(index, "log"))
+			sb->flags |= SB_LOG_INDEX;
+		else if (index && strcmp(index, "htree")) {
+			fprintf(stderr, "unknown fingerprint index '%s'\n", index);
+			exit(1);
+		}
+		if (dedup) {
+			int mode = dedup_mode(dedup);
+			if (mode < 0) {
+				fprintf(stderr, "unknown dedup mode '%s'\n", dedup);
+				exit(1);
+			}
+			sb->flags |= mode;
+		}
+		sb->bloombits = bloom_order(sb, bloom < 0 ? 8 : bloom);
 		printf("make tux3 filesystem on %s (0x%Lx bytes)\n", volname, (L)volsize);
 		if ((errno = -make_tux3(sb)))
 			goto eek;
@@ -108,6 +148,64 @@ int main(int argc, const char *argv[])
 		goto eek;
 	show_tree_range(&sb->rootdir->btree, 0, -1);
 	show_tree_range(&sb->bitmap->btree, 0, -1);
+	if (!strcmp(command, "bloom")) {
+		if (poptPeekArg(popt))
+			goto usage;
+		if (bloom >= 0 && (errno = -make_bloom(sb, bloom_order(sb, bloom))))
+			goto eek;
+		int keys = rebuild_bloom(sb);
+		if ((errno = -keys) > 0)
+			goto eek;
+		if (sb->bloom)
+			printf("fingerprint filter of 2^%u bits at %Lx, %i keys\n", sb->bloombits, (L)sb->bloom, keys);
+		else
+			printf("no fingerprint filter\n");
+		if ((errno = -put_super(sb)))
+			goto eek;
+		return 0;
+	}
+	if (!strcmp(command, "rebuild-index")) {
+		if (poptPeekArg(popt))
+			goto usage;
+		sb->hashpool = new_hashpool(hashers ? hashers : sysconf(_SC_NPROCESSORS_ONLN));
+		int keys = rebuild_index(sb);
+		free_hashpool(sb->hashpool);
+		sb->hashpool = NULL;
+		if ((errno = -keys) > 0)
+			goto eek;
+		if (sb->flags & SB_LOG_INDEX)
+			printf("fingerprint log of %i keys at %Lx\n", keys, (L)sb->logindex);
+		else
+			printf("fingerprint index of %i keys, depth %u, root at %Lx\n", keys, sb->htree.root.depth, (L)sb->htree.root.block);
+		if ((errno = -put_super(sb)))
+			goto eek;
+		return 0;
+	}
+	if (!strcmp(command, "dedupd")) {
+		if (poptPeekArg(popt))
+			goto usage;
+		sb->hashpool = new_hashpool(hashers ? hashers : sysconf(_SC_NPROCESSORS_ONLN));
+		int blocks = dedupd(sb, budget, rate);
+		free_hashpool(sb->hashpool);
+		sb->hashpool = NULL;
+		if ((errno = -blocks) > 0)
+			goto eek;
+		unsigned left = 0;
+		for (unsigned i = 0; sb->pending && i < sb->pending->count; i++)
+			left += sb->pending->entries[i].count;
+		printf("deduplicated %i blocks, %u left\n", blocks, left);
+		if ((errno = -put_super(sb)))
+			goto eek;
+		return 0;
+	}
+	if (!strcmp(command, "dedupstat")) {
+		if (poptPeekArg(popt))
+			goto usage;
+		char stats[1 << 12];
+		dedupstat_show(sb, stats, sizeof(stats));
+		printf("%s", stats);
+		return 0;
+	}
 	char *filename = (void *)poptGetArg(popt);
 	if (!filename)
 		goto usage;
@@ -144,6 +242,7 @@ int main(int argc, const char *argv[])
 		}
 		char text[2 << 16];
 		unsigned len;
+		sb->hashpool = new_hashpool(hashers ? hashers : sysconf(_SC_NPROCESSORS_ONLN));
 
 #if 0
 		memcpy(text, "hello", 5);
@@ -155,7 +254,9 @@ int main(int argc, const char *argv[])
 				goto eek;
 		if ((errno = -tuxsync(inode)))
 			goto eek;
-		if ((errno = -sync_super(sb)))
+		free_hashpool(sb->hashpool);
+		sb->hashpool = NULL;
+		if ((errno = -put_super(sb)))
 			goto eek;
 		//bitmap_dump(sb->bitmap, 0, sb->volblocks);
 		tux_dump_entries(blockget(sb->rootdir->map, 0));
@@ -226,7 +327,7 @@ int main(int argc, const char *argv[])
 			if ((errno = -set_xattr(inode, "foo", 3, "foobar", 6, 0)))
 				goto eek;
 			tuxsync(inode);
-			if ((errno = -sync_super(sb)))
+			if ((errno = -put_super(sb)))
 				goto eek;
 		}
 	}
@@ -265,7 +366,7 @@ int main(int argc, const char *argv[])
 		if ((errno = -tux_delete_entry(buffer, entry)))
 			goto eek;
 		tux_dump_entries(blockread(sb->rootdir->map, 0));
-		if ((errno = -sync_super(sb)))
+		if ((errno = -put_super(sb)))
 			goto eek;
 	}
 
@@ -289,7 +390,7 @@ int main(int argc, const char *argv[])
 		if ((errno = -tree_chop(&inode->btree, &(struct delete_info){ .key = index }, 0)))
 			goto eek;
 		tuxsync(inode);
-		if ((errno = -sync_super(sb)))
+		if ((errno = -put_super(sb)))
 			goto eek;
 	}
 
@@ -16,6 +16,7 @@
 #include <errno.h>
 #include "err.h"
 #include "buffer.h"
+#include "hashpool.h"
 #include "trace.h"
 #include "lockdebug.h"
 
@@ -196,7 +197,9 @@ void change_end(struct sb *sb);
 	.i_nlink = 1
 
 #define rapid_open_inode(sb, io, mode)	({		\
-	struct inode *__inode = &(struct inode){	\
+	struct inode *__inode = malloc(sizeof(struct inode));	\
+	assert(__inode);				\
+	*__inode = (struct inode){			\
 		INIT_INODE(sb, mode),			\
 		.btree = {				\
 			.lock = __RWSEM_INITIALIZER,	\
@@ -55,6 +55,12 @@ static u64 volsize;
 static struct sb *sb;
 static struct dev *dev;
 static int readcheck;
+static unsigned hashers; /* zero for one per cpu */
+
+static struct fuse_opt tux3_opts[] = {
+	{ "hashers=%u", 0, 0 },
+	FUSE_OPT_END
+};
 
 static struct inode *open_fuse_ino(fuse_ino_t ino)
 {
@@ -194,7 +200,7 @@ static void tux3_create(fuse_req_t req, fuse_ino_t parent, const char *name,
 			.entry_timeout = 0.0,
 		};
 		inode->writebucket = 0; /* DREAMZ */
-		inode->refbucket = 0; /* DREAMZ */
+		memset(inode->refbucket, 0, sizeof(inode->refbucket)); /* DREAMZ */
 		
 		if(parent_ino->inum != TUX_ROOTDIR_INO)
 			tuxclose(parent_ino);
@@ -455,6 +461,7 @@ static void tux3_init(void *data, struct fuse_conn_info *conn)
 	if ((errno = -open_inode(sb->atable)))
 		goto eek;
 	sb->readcheck = readcheck;
+	sb->hashpool = new_hashpool(hashers ? hashers : sysconf(_SC_NPROCESSORS_ONLN));
 	return;
 nomem:
 	errno = ENOMEM;
@@ -466,6 +473,8 @@ eek:
 /* Stub methods */
 static void tux3_destroy(void *userdata)
 {
+	free_hashpool(sb->hashpool);
+	sb->hashpool = NULL;
 }
 
 static void tux3_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup)
@@ -647,7 +656,14 @@ static void tux3_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size
 			goto out;
 		}
 	}
-	int size = get_xattr(inode, name, strlen(name), data, maxsize);
+	int size;
+	/* not stored, made up from the volume's dedup counters */
+	if (ino == FUSE_ROOT_ID && !strcmp(name, "tux3.dedupstat")) {
+		size = dedupstat_show(sb, data, maxsize);
+		if (maxsize && size > maxsize)
+			size = -ERANGE;
+	} else
+		size = get_xattr(inode, name, strlen(name), data, maxsize);
 	if (size < 0)
 		fuse_reply_err(req, -size);
 	else if (!maxsize)
@@ -754,8 +770,10 @@ int main(int argc, char *argv[])
 	int foreground;
 	int err = -1;
 	if (argc < 3)
-		error("usage: %s <volname> <mountpoint>", argv[0]);
-	
+		error("usage: %s <volname> <mountpoint> [-o hashers=<count>]", argv[0]);
+	if (fuse_opt_parse(&args, &hashers, tux3_opts, NULL) == -1)
+		error("bad mount options");
+
 	if (fuse_parse_cmdline(&args, &mountpoint, NULL, &foreground) != -1)
 	{
 		struct fuse_chan *fc = fuse_mount(mountpoint, &args);
@@ -775,7 +793,7 @@ int main(int argc, char *argv[])
 						readcheck = 1;
 					fuse_daemonize(foreground);					
 					err = fuse_session_loop(fs);
-					sync_super(sb);
+					put_super(sb);
 					fuse_remove_signal_handlers(fs);
 					fuse_session_remove_chan(fc);
 				}
@@ -784,7 +802,13 @@ int main(int argc, char *argv[])
 			}
 			fprintf(stderr,"\nTotal Number of blocks == %Lu",(L)sb->volblocks );
 			fprintf(stderr,"\nFree blocks available  == %Lu",(L)sb->freeblocks);
-			fprintf(stderr,"\nTotal blocks used      == %Lu\n\n",(L)(sb->volblocks - sb->freeblocks));
+			fprintf(stderr,"\nTotal blocks used      == %Lu\n",(L)(sb->volblocks - sb->freeblocks));
+			fprintf(stderr,"\nFilter probes          == %Lu",(L)sb->bloomstat.probes);
+			fprintf(stderr,"\nFilter definite misses == %Lu",(L)sb->bloomstat.skips);
+			fprintf(stderr,"\nFilter false positives == %Lu\n\n",(L)sb->bloomstat.falsepos);
+			char stats[1 << 12];
+			dedupstat_show(sb, stats, sizeof(stats));
+			fprintf(stderr, "%s\n", stats);
 			fuse_unmount(mountpoint, fc);
 		}
 	}
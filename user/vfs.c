@@ -1,3 +1,4 @@
 #define include_buffer
 #include "buffer.c"
 #include "diskio.c"
+#include "hashpool.c"